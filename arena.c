@@ -0,0 +1,275 @@
+/*
+ * raw2rgbpnm --- convert raw bayer images to RGB PNM for easier viewing
+ *
+ * Copyright (C) 2008--2011 Nokia Corporation
+ *
+ * Contact: Sakari Ailus <sakari.ailus@maxwell.research.nokia.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ */
+
+/*
+ * Frame buffer arena
+ *
+ * Frame sized buffers are too large for the malloc heap: every one is a
+ * fresh mmap() whose pages fault in on first touch and are unmapped again
+ * by free(). The arena keeps released buffers and hands them out again
+ * for requests of the same size class. Classes are an eighth of a power
+ * of two apart, so frames of nearly the same size share buffers.
+ *
+ * Idle buffers of every class are kept, so a conversion alternating
+ * between input and output sized buffers finds both in the cache. Only
+ * when a new buffer would take the arena beyond the most memory it ever
+ * had in use at once are idle buffers released, least recently used
+ * first, so the cache never grows beyond the working set.
+ *
+ * With huge pages enabled, buffers of at least one huge page are mapped
+ * from the hugetlb pool if it has pages to spare, or else aligned to the
+ * huge page size and advised for transparent huge pages. The demosaic
+ * reads several rows apart for every pixel, which on a large frame
+ * touches a different 4 KiB page per row and thrashes the TLB.
+ *
+ * Buffers are only handed out again on the NUMA node of the thread that
+ * first allocated them. The pages of a new buffer are placed by the first
+ * write, which is done by the allocating worker.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include "utils.h"
+#include "numa.h"
+#include "arena.h"
+
+enum arena_backing {
+	ARENA_MALLOC,		/* Heap, normal pages */
+	ARENA_HUGETLB,		/* mmap(MAP_HUGETLB) */
+	ARENA_THP,		/* mmap() advised with MADV_HUGEPAGE */
+	ARENA_PAGES,		/* mmap(), madvise() refused */
+};
+
+static const char *arena_backing_name[] = {
+	[ARENA_MALLOC] = "normal pages",
+	[ARENA_HUGETLB] = "hugetlb pages",
+	[ARENA_THP] = "transparent huge pages",
+	[ARENA_PAGES] = "normal pages (huge pages unavailable)",
+};
+
+struct arena_block {
+	struct arena_block *next;
+	void *buf;
+	size_t size;		/* Size class of the buffer */
+	int used;
+	unsigned long long last_used;	/* arena_clock when last freed */
+	unsigned int node;	/* NUMA node of the allocating thread */
+	enum arena_backing backing;
+	void *map;		/* Mapping holding buf, for munmap() */
+	size_t map_size;
+};
+
+static pthread_mutex_t arena_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct arena_block *arena_blocks;
+static int arena_huge;
+static size_t arena_in_use;	/* Bytes handed out */
+static size_t arena_peak;	/* Most bytes handed out at once */
+static size_t arena_idle;	/* Bytes cached for reuse */
+static unsigned long long arena_clock;
+
+static size_t arena_page_size(void)
+{
+	long page = sysconf(_SC_PAGESIZE);
+
+	return page > 0 ? page : 4096;
+}
+
+/* Huge page size from /proc/meminfo, 2 MiB if it is not there */
+static size_t arena_huge_page_size(void)
+{
+	static size_t huge;
+	char line[128];
+	FILE *f;
+
+	if (huge)
+		return huge;
+	huge = 2 * 1024 * 1024;
+	f = fopen("/proc/meminfo", "r");
+	if (!f)
+		return huge;
+	while (fgets(line, sizeof(line), f)) {
+		unsigned long kb;
+		if (sscanf(line, "Hugepagesize: %lu kB", &kb) == 1) {
+			huge = kb * 1024;
+			break;
+		}
+	}
+	fclose(f);
+	return huge;
+}
+
+static size_t arena_class(size_t size)
+{
+	size_t page = arena_page_size();
+	size_t step = page;
+
+	if (arena_huge && size >= arena_huge_page_size())
+		page = step = arena_huge_page_size();
+
+	size = (size + page - 1) / page * page;
+	while (step * 8 <= size)
+		step *= 2;
+	return (size + step - 1) / step * step;
+}
+
+static void arena_release(struct arena_block *b)
+{
+	if (b->map)
+		munmap(b->map, b->map_size);
+	else
+		free(b->buf);
+	free(b);
+}
+
+/* Release idle buffers, least recently used first, until no more than
+ * limit bytes are idle. Called with the lock held. */
+static void arena_evict(size_t limit)
+{
+	while (arena_idle > limit) {
+		struct arena_block **p, **lru = NULL, *b;
+
+		for (p = &arena_blocks; *p; p = &(*p)->next)
+			if (!(*p)->used && (!lru || (*p)->last_used < (*lru)->last_used))
+				lru = p;
+		if (!lru)
+			break;
+		b = *lru;
+		*lru = b->next;
+		arena_idle -= b->size;
+		arena_release(b);
+	}
+}
+
+/* Map a buffer backed by huge pages if possible */
+static void arena_map_huge(struct arena_block *b)
+{
+	size_t huge = arena_huge_page_size();
+	unsigned char *map, *buf;
+
+	b->map_size = b->size;
+	b->map = mmap(NULL, b->map_size, PROT_READ | PROT_WRITE,
+		      MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+	if (b->map != MAP_FAILED) {
+		b->buf = b->map;
+		b->backing = ARENA_HUGETLB;
+		return;
+	}
+
+	/* Align to the huge page size so that the whole buffer can be
+	 * collapsed into huge pages, and trim the slack */
+	map = mmap(NULL, b->size + huge, PROT_READ | PROT_WRITE,
+		   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (map == MAP_FAILED)
+		error("memory allocation failed");
+	buf = (unsigned char *)(((unsigned long)map + huge - 1) & ~(unsigned long)(huge - 1));
+	if (buf > map)
+		munmap(map, buf - map);
+	if (buf + b->size < map + b->size + huge)
+		munmap(buf + b->size, map + b->size + huge - (buf + b->size));
+	b->map = b->buf = buf;
+	b->backing = madvise(buf, b->size, MADV_HUGEPAGE) ? ARENA_PAGES : ARENA_THP;
+}
+
+void *arena_alloc(size_t size)
+{
+	unsigned int node = numa_this_node();
+	struct arena_block *b;
+
+	size = arena_class(size);
+
+	pthread_mutex_lock(&arena_lock);
+	for (b = arena_blocks; b; b = b->next) {
+		if (!b->used && b->size == size && b->node == node) {
+			b->used = 1;
+			arena_idle -= size;
+			arena_in_use += size;
+			if (arena_in_use > arena_peak)
+				arena_peak = arena_in_use;
+			pthread_mutex_unlock(&arena_lock);
+			return b->buf;
+		}
+	}
+	arena_in_use += size;
+	if (arena_in_use > arena_peak)
+		arena_peak = arena_in_use;
+	arena_evict(arena_peak - arena_in_use);
+
+	b = malloc(sizeof(*b));
+	if (!b)
+		error("memory allocation failed");
+	memset(b, 0, sizeof(*b));
+	b->size = size;
+	b->used = 1;
+	b->node = node;
+	if (arena_huge && size >= arena_huge_page_size()) {
+		arena_map_huge(b);
+		printf("Allocated %zu KiB buffer backed by %s\n", size / 1024,
+		       arena_backing_name[b->backing]);
+	} else {
+		b->backing = ARENA_MALLOC;
+		if (posix_memalign(&b->buf, arena_page_size(), size))
+			error("memory allocation failed");
+	}
+	b->next = arena_blocks;
+	arena_blocks = b;
+	pthread_mutex_unlock(&arena_lock);
+
+	return b->buf;
+}
+
+void arena_free(void *buf)
+{
+	struct arena_block *b;
+
+	if (!buf)
+		return;
+
+	pthread_mutex_lock(&arena_lock);
+	for (b = arena_blocks; b; b = b->next) {
+		if (b->buf == buf) {
+			b->used = 0;
+			b->last_used = ++arena_clock;
+			arena_in_use -= b->size;
+			arena_idle += b->size;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&arena_lock);
+	if (!b)
+		error("arena_free: unknown buffer");
+}
+
+void arena_set_huge_pages(int enable)
+{
+	arena_huge = enable;
+}
+
+void arena_trim(void)
+{
+	pthread_mutex_lock(&arena_lock);
+	arena_evict(0);
+	pthread_mutex_unlock(&arena_lock);
+}
@@ -0,0 +1,42 @@
+/*
+ * raw2rgbpnm --- convert raw bayer images to RGB PNM for easier viewing
+ *
+ * Copyright (C) 2008--2011 Nokia Corporation
+ *
+ * Contact: Sakari Ailus <sakari.ailus@maxwell.research.nokia.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ */
+
+#ifndef __ARENA_H__
+#define __ARENA_H__
+
+#include <stddef.h>
+
+/* Return a page aligned buffer of at least size bytes. The contents are
+ * undefined: buffers are recycled and never cleared. Never fails. */
+void *arena_alloc(size_t size);
+
+/* Give a buffer back for reuse by any thread */
+void arena_free(void *buf);
+
+/* Back new frame sized buffers with huge pages. Prints the backing
+ * every new buffer gets. */
+void arena_set_huge_pages(int enable);
+
+/* Release all buffers not in use */
+void arena_trim(void);
+
+#endif /* __ARENA_H__ */
@@ -0,0 +1,559 @@
+/*
+ * raw2rgbpnm --- convert raw bayer images to RGB PNM for easier viewing
+ *
+ * Copyright (C) 2008--2011 Nokia Corporation
+ *
+ * Contact: Sakari Ailus <sakari.ailus@maxwell.research.nokia.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ */
+
+/*
+ * Lossless image encoders
+ *
+ * Images are encoded a few rows at a time, as the rows are converted.
+ * Encoded bytes collect in a buffer that is written out, or appended to
+ * the image in memory, whenever another row might not fit.
+ *
+ * QOI follows the specification at https://qoiformat.org/.
+ *
+ * PNG is written either with stored deflate blocks, which costs little
+ * more than the raw samples, or with every row Sub filtered and deflated
+ * in a single fixed Huffman block. The only matches searched for are runs
+ * of a repeated byte (distance 1), which the Sub filter turns flat areas
+ * into. That needs no hash tables and no second pass over the data, and
+ * a row never takes more than 9 bits per byte.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "utils.h"
+#include "encode.h"
+
+#define ENCODER_BUFFER	(256 * 1024)
+#define STORED_BLOCK	65535
+
+struct encoder {
+	enum image_format format;
+	int width, height, bpp;
+	int depth;		/* Significant bits of a sample */
+	int rows;		/* Encoded so far */
+	FILE *f;
+
+	unsigned char *buf;	/* Encoded bytes not emitted yet */
+	size_t len, size;
+	size_t row_bound;	/* Most bytes one row adds to buf */
+
+	unsigned char *mem;	/* The image, if f is NULL */
+	size_t mem_len, mem_size;
+
+	/* QOI */
+	uint32_t index[64];	/* RGBA, alpha always 255 once set */
+	unsigned char prev[3];
+	int run;
+
+	/* PNG */
+	unsigned char *row;	/* Filter type and big endian samples of a row */
+	uint32_t adler_a, adler_b;
+	uint64_t bits;		/* Deflate bits not in buf yet, LSB first */
+	int nbits;
+	int last;		/* Last byte of the deflate input, -1 at start */
+	unsigned char *block;	/* Stored block being filled */
+	size_t block_len;
+};
+
+static uint32_t crc_table[256];
+
+/* Fixed Huffman codes, bit reversed for LSB first output. Length codes
+ * include their extra bits and the code of distance 1. */
+static uint16_t lit_code[256], lit_bits[256];
+static uint32_t len_code[259], len_bits[259];
+static uint16_t eob_code, eob_bits;
+
+static pthread_once_t encoder_once = PTHREAD_ONCE_INIT;
+
+static unsigned int reverse(unsigned int code, int bits)
+{
+	unsigned int r = 0;
+
+	while (bits--) {
+		r = (r << 1) | (code & 1);
+		code >>= 1;
+	}
+	return r;
+}
+
+static void fixed_code(unsigned int sym, uint32_t *code, uint32_t *bits)
+{
+	if (sym < 144) {
+		*bits = 8;
+		*code = reverse(0x30 + sym, 8);
+	} else if (sym < 256) {
+		*bits = 9;
+		*code = reverse(0x190 + sym - 144, 9);
+	} else if (sym < 280) {
+		*bits = 7;
+		*code = reverse(sym - 256, 7);
+	} else {
+		*bits = 8;
+		*code = reverse(0xc0 + sym - 280, 8);
+	}
+}
+
+static void encoder_init(void)
+{
+	static const uint16_t len_base[29] = {
+		3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+		35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258,
+	};
+	static const uint8_t len_extra[29] = {
+		0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+		3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0,
+	};
+	uint32_t code, bits;
+	unsigned int i, j;
+	int k;
+
+	for (i = 0; i < 256; i++) {
+		uint32_t c = i;
+		for (k = 0; k < 8; k++)
+			c = c & 1 ? 0xedb88320 ^ (c >> 1) : c >> 1;
+		crc_table[i] = c;
+	}
+
+	for (i = 0; i < 256; i++) {
+		fixed_code(i, &code, &bits);
+		lit_code[i] = code;
+		lit_bits[i] = bits;
+	}
+	fixed_code(256, &code, &bits);
+	eob_code = code;
+	eob_bits = bits;
+
+	for (i = 0; i < 29; i++) {
+		for (j = len_base[i]; j < (i < 28 ? len_base[i + 1] : 259u); j++) {
+			fixed_code(257 + i, &code, &bits);
+			/* Extra bits, then the five zero bits of distance 1 */
+			len_code[j] = code | (j - len_base[i]) << bits;
+			len_bits[j] = bits + len_extra[i] + 5;
+		}
+	}
+}
+
+static uint32_t crc32(uint32_t crc, const unsigned char *p, size_t n)
+{
+	crc = ~crc;
+	while (n--)
+		crc = crc_table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+	return ~crc;
+}
+
+static void put_be32(unsigned char *p, uint32_t v)
+{
+	p[0] = v >> 24;
+	p[1] = v >> 16;
+	p[2] = v >> 8;
+	p[3] = v;
+}
+
+/* Write out or keep encoded bytes */
+static void encoder_emit(struct encoder *e, const void *data, size_t n)
+{
+	if (e->f) {
+		if (n && fwrite(data, n, 1, e->f) != 1)
+			error("write failed");
+		return;
+	}
+	if (e->mem_len + n > e->mem_size) {
+		e->mem_size = 2 * (e->mem_len + n);
+		e->mem = realloc(e->mem, e->mem_size);
+		if (!e->mem)
+			error("memory allocation failed");
+	}
+	memcpy(e->mem + e->mem_len, data, n);
+	e->mem_len += n;
+}
+
+static void png_chunk(struct encoder *e, const char *type, const unsigned char *data, size_t n)
+{
+	unsigned char head[8], tail[4];
+
+	put_be32(head, n);
+	memcpy(head + 4, type, 4);
+	put_be32(tail, crc32(crc32(0, head + 4, 4), data, n));
+	encoder_emit(e, head, 8);
+	encoder_emit(e, data, n);
+	encoder_emit(e, tail, 4);
+}
+
+/* Emit the buffer, as an IDAT chunk for PNG */
+static void encoder_flush(struct encoder *e)
+{
+	if (!e->len)
+		return;
+	if (e->format == IMAGE_QOI)
+		encoder_emit(e, e->buf, e->len);
+	else
+		png_chunk(e, "IDAT", e->buf, e->len);
+	e->len = 0;
+}
+
+/* QOI */
+
+static void qoi_run(struct encoder *e)
+{
+	if (e->run) {
+		e->buf[e->len++] = 0xc0 | (e->run - 1);
+		e->run = 0;
+	}
+}
+
+static void qoi_rows(struct encoder *e, const unsigned char *rgb, int pixels)
+{
+	unsigned char *out = e->buf + e->len;
+	unsigned char pr = e->prev[0], pg = e->prev[1], pb = e->prev[2];
+	int run = e->run;
+	int i;
+
+	for (i = 0; i < pixels; i++, rgb += 3) {
+		unsigned char r = rgb[0], g = rgb[1], b = rgb[2];
+		uint32_t px = r | g << 8 | b << 16 | 0xffu << 24;
+		unsigned int h;
+		signed char dr, dg, db, dr_dg, db_dg;
+
+		if (r == pr && g == pg && b == pb) {
+			if (++run == 62) {
+				*out++ = 0xc0 | (run - 1);
+				run = 0;
+			}
+			continue;
+		}
+		if (run) {
+			*out++ = 0xc0 | (run - 1);
+			run = 0;
+		}
+
+		h = (r * 3 + g * 5 + b * 7 + 255 * 11) % 64;
+		if (e->index[h] == px) {
+			*out++ = h;
+		} else {
+			e->index[h] = px;
+			dr = r - pr;
+			dg = g - pg;
+			db = b - pb;
+			dr_dg = dr - dg;
+			db_dg = db - dg;
+			if (dr >= -2 && dr <= 1 && dg >= -2 && dg <= 1 && db >= -2 && db <= 1) {
+				*out++ = 0x40 | (dr + 2) << 4 | (dg + 2) << 2 | (db + 2);
+			} else if (dg >= -32 && dg <= 31 && dr_dg >= -8 && dr_dg <= 7 &&
+				   db_dg >= -8 && db_dg <= 7) {
+				*out++ = 0x80 | (dg + 32);
+				*out++ = (dr_dg + 8) << 4 | (db_dg + 8);
+			} else {
+				*out++ = 0xfe;
+				*out++ = r;
+				*out++ = g;
+				*out++ = b;
+			}
+		}
+		pr = r;
+		pg = g;
+		pb = b;
+	}
+
+	e->prev[0] = pr;
+	e->prev[1] = pg;
+	e->prev[2] = pb;
+	e->run = run;
+	e->len = out - e->buf;
+}
+
+/* PNG */
+
+static void adler32(struct encoder *e, const unsigned char *p, size_t n)
+{
+	uint32_t a = e->adler_a, b = e->adler_b;
+
+	while (n) {
+		/* Largest run that can not overflow b */
+		size_t k = n < 5552 ? n : 5552;
+		n -= k;
+		while (k--) {
+			a += *p++;
+			b += a;
+		}
+		a %= 65521;
+		b %= 65521;
+	}
+	e->adler_a = a;
+	e->adler_b = b;
+}
+
+static inline void put_bits(struct encoder *e, uint32_t code, int bits)
+{
+	e->bits |= (uint64_t)code << e->nbits;
+	e->nbits += bits;
+	if (e->nbits >= 32) {
+		unsigned char *p = e->buf + e->len;
+		p[0] = e->bits;
+		p[1] = e->bits >> 8;
+		p[2] = e->bits >> 16;
+		p[3] = e->bits >> 24;
+		e->len += 4;
+		e->bits >>= 32;
+		e->nbits -= 32;
+	}
+}
+
+/* Literals, and runs of the previous byte as matches at distance 1 */
+static void deflate_rle(struct encoder *e, const unsigned char *p, size_t n)
+{
+	size_t i = 0;
+
+	while (i < n) {
+		int c = p[i];
+
+		if (c == e->last) {
+			size_t run = 1;
+			while (i + run < n && run < 258 && p[i + run] == c)
+				run++;
+			if (run >= 3) {
+				put_bits(e, len_code[run], len_bits[run]);
+				i += run;
+				continue;
+			}
+		}
+		put_bits(e, lit_code[c], lit_bits[c]);
+		e->last = c;
+		i++;
+	}
+}
+
+static void stored_block(struct encoder *e, int final)
+{
+	unsigned char *p = e->buf + e->len;
+
+	p[0] = final;
+	p[1] = e->block_len;
+	p[2] = e->block_len >> 8;
+	p[3] = ~e->block_len;
+	p[4] = ~e->block_len >> 8;
+	memcpy(p + 5, e->block, e->block_len);
+	e->len += 5 + e->block_len;
+	e->block_len = 0;
+}
+
+static void deflate_stored(struct encoder *e, const unsigned char *p, size_t n)
+{
+	while (n) {
+		size_t k = STORED_BLOCK - e->block_len;
+		if (k > n)
+			k = n;
+		memcpy(e->block + e->block_len, p, k);
+		e->block_len += k;
+		p += k;
+		n -= k;
+		if (e->block_len == STORED_BLOCK)
+			stored_block(e, 0);
+	}
+}
+
+static void png_row(struct encoder *e, const unsigned char *rgb)
+{
+	size_t n = (size_t)e->width * e->bpp;
+	unsigned char *row = e->row + 1;
+	size_t i;
+
+	if (e->bpp == 6) {
+		const unsigned short *s = (const unsigned short *)rgb;
+		int shift = 16 - e->depth;
+
+		/* PNG has no maxval: scale to 16 bits, replicating the high bits */
+		for (i = 0; i < n / 2; i++) {
+			unsigned int v = s[i] << shift | s[i] >> (e->depth - shift);
+			row[2*i] = v >> 8;
+			row[2*i + 1] = v;
+		}
+	} else {
+		memcpy(row, rgb, n);
+	}
+
+	if (e->format == IMAGE_PNG) {
+		/* Sub filter, from the right so the left samples are intact */
+		for (i = n; i-- > (size_t)e->bpp; )
+			row[i] -= row[i - e->bpp];
+		e->row[0] = 1;
+	} else {
+		e->row[0] = 0;
+	}
+
+	adler32(e, e->row, n + 1);
+	if (e->format == IMAGE_PNG)
+		deflate_rle(e, e->row, n + 1);
+	else
+		deflate_stored(e, e->row, n + 1);
+}
+
+/* Interface */
+
+struct encoder *encoder_create(enum image_format format, int width, int height, int depth,
+			       FILE *f)
+{
+	int bpp = depth > 8 ? 6 : 3;
+	struct encoder *e;
+	size_t row = (size_t)width * bpp + 1;
+	unsigned char head[25];
+
+	pthread_once(&encoder_once, encoder_init);
+
+	if (format == IMAGE_QOI && bpp != 3)
+		error("QOI output is 8 bit only");
+
+	e = calloc(1, sizeof(*e));
+	if (!e)
+		error("memory allocation failed");
+	e->format = format;
+	e->width = width;
+	e->height = height;
+	e->bpp = bpp;
+	e->depth = depth;
+	e->f = f;
+
+	/* A row takes at most 4 bytes per QOI pixel or 9 bits per deflated
+	 * byte. A stored row may complete a block begun by earlier rows. */
+	if (format == IMAGE_QOI)
+		e->row_bound = (size_t)width * 4 + 8;
+	else if (format == IMAGE_PNG)
+		e->row_bound = row + row / 8 + 16;
+	else
+		e->row_bound = row + STORED_BLOCK + 5 * (row / STORED_BLOCK + 2);
+	e->size = ENCODER_BUFFER;
+	if (e->size < 2 * e->row_bound)
+		e->size = 2 * e->row_bound;
+	e->buf = malloc(e->size);
+	if (!e->buf)
+		error("memory allocation failed");
+
+	if (format == IMAGE_QOI) {
+		memcpy(head, "qoif", 4);
+		put_be32(head + 4, width);
+		put_be32(head + 8, height);
+		head[12] = 3;		/* RGB */
+		head[13] = 0;		/* sRGB */
+		encoder_emit(e, head, 14);
+		return e;
+	}
+
+	e->row = malloc(row);
+	if (format == IMAGE_PNG_STORED)
+		e->block = malloc(STORED_BLOCK);
+	if (!e->row || (format == IMAGE_PNG_STORED && !e->block))
+		error("memory allocation failed");
+	e->adler_a = 1;
+	e->last = -1;
+
+	encoder_emit(e, "\x89PNG\r\n\x1a\n", 8);
+	put_be32(head, width);
+	put_be32(head + 4, height);
+	head[8] = bpp == 6 ? 16 : 8;
+	head[9] = 2;			/* Truecolour */
+	head[10] = 0;			/* Deflate */
+	head[11] = 0;			/* Adaptive filtering */
+	head[12] = 0;			/* No interlace */
+	png_chunk(e, "IHDR", head, 13);
+	if (depth != 8 && depth != 16) {
+		head[0] = head[1] = head[2] = depth;
+		png_chunk(e, "sBIT", head, 3);
+	}
+
+	/* zlib header: deflate, 32 KiB window, fastest */
+	e->buf[e->len++] = 0x78;
+	e->buf[e->len++] = 0x01;
+	if (format == IMAGE_PNG)
+		put_bits(e, 3, 3);	/* Final block, fixed Huffman */
+	return e;
+}
+
+void encoder_rows(struct encoder *e, const unsigned char *rgb, int rows)
+{
+	size_t line = (size_t)e->width * e->bpp;
+
+	if (rows > e->height - e->rows)
+		rows = e->height - e->rows;
+	e->rows += rows;
+	while (rows--) {
+		if (e->len + e->row_bound > e->size)
+			encoder_flush(e);
+		if (e->format == IMAGE_QOI)
+			qoi_rows(e, rgb, e->width);
+		else
+			png_row(e, rgb);
+		rgb += line;
+	}
+}
+
+const unsigned char *encoder_finish(struct encoder *e, size_t *length)
+{
+	unsigned char *p;
+
+	if (e->rows != e->height)
+		error("encoder: image not complete");
+	if (e->len + e->block_len + 64 > e->size)
+		encoder_flush(e);
+
+	if (e->format == IMAGE_QOI) {
+		qoi_run(e);
+		memcpy(e->buf + e->len, "\0\0\0\0\0\0\0\1", 8);
+		e->len += 8;
+		encoder_flush(e);
+	} else {
+		if (e->format == IMAGE_PNG) {
+			put_bits(e, eob_code, eob_bits);
+			/* Pad to a byte */
+			while (e->nbits > 0) {
+				e->buf[e->len++] = e->bits;
+				e->bits >>= 8;
+				e->nbits -= 8;
+			}
+		} else {
+			stored_block(e, 1);
+		}
+		p = e->buf + e->len;
+		put_be32(p, e->adler_b << 16 | e->adler_a);
+		e->len += 4;
+		encoder_flush(e);
+		png_chunk(e, "IEND", NULL, 0);
+	}
+
+	if (e->f) {
+		*length = 0;
+		return NULL;
+	}
+	*length = e->mem_len;
+	return e->mem;
+}
+
+void encoder_destroy(struct encoder *e)
+{
+	if (!e)
+		return;
+	free(e->block);
+	free(e->row);
+	free(e->mem);
+	free(e->buf);
+	free(e);
+}
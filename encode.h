@@ -0,0 +1,54 @@
+/*
+ * raw2rgbpnm --- convert raw bayer images to RGB PNM for easier viewing
+ *
+ * Copyright (C) 2008--2011 Nokia Corporation
+ *
+ * Contact: Sakari Ailus <sakari.ailus@maxwell.research.nokia.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ */
+
+#ifndef __ENCODE_H__
+#define __ENCODE_H__
+
+#include <stdio.h>
+#include <stddef.h>
+
+enum image_format {
+	IMAGE_PNM,
+	IMAGE_QOI,		/* Quite OK Image format, 8 bit samples only */
+	IMAGE_PNG,		/* Sub filter, run length coded deflate */
+	IMAGE_PNG_STORED,	/* No filter, stored deflate blocks */
+};
+
+struct encoder;
+
+/* Start encoding an image of width x height RGB pixels. Samples of a
+ * depth of 8 bits are bytes, deeper ones are 16 bit in host byte order.
+ * PNM is not handled here. The encoded image is written to f as it is
+ * produced, or kept in memory if f is NULL. */
+struct encoder *encoder_create(enum image_format format, int width, int height, int depth,
+			       FILE *f);
+
+/* Encode the next rows of the image */
+void encoder_rows(struct encoder *e, const unsigned char *rgb, int rows);
+
+/* Complete the image. Returns the encoded image if it is kept in memory,
+ * valid until encoder_destroy(), else NULL. Write errors are fatal. */
+const unsigned char *encoder_finish(struct encoder *e, size_t *length);
+
+void encoder_destroy(struct encoder *e);
+
+#endif /* __ENCODE_H__ */
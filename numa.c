@@ -0,0 +1,147 @@
+/*
+ * raw2rgbpnm --- convert raw bayer images to RGB PNM for easier viewing
+ *
+ * Copyright (C) 2008--2011 Nokia Corporation
+ *
+ * Contact: Sakari Ailus <sakari.ailus@maxwell.research.nokia.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ */
+
+/*
+ * NUMA topology
+ *
+ * Nodes are read from /sys/devices/system/node. Memory is placed on the
+ * node of the thread that first touches it, so threads that allocate and
+ * fill their own buffers keep them local once they are pinned to a node.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <glob.h>
+#include <pthread.h>
+#include <sched.h>
+#include "utils.h"
+#include "numa.h"
+
+#define NUMA_MAX_NODES	64
+
+static pthread_once_t numa_once = PTHREAD_ONCE_INIT;
+static unsigned int numa_count = 1;
+static int numa_pin;			/* Pin threads to their nodes */
+static cpu_set_t numa_cpus[NUMA_MAX_NODES];
+static __thread unsigned int numa_node_self;
+
+/* Parse a CPU list such as "0-3,8-11". Returns 0 on success. */
+static int numa_parse_cpulist(const char *s, cpu_set_t *set)
+{
+	CPU_ZERO(set);
+	while (*s && *s != '\n') {
+		char *end;
+		long first, last;
+
+		first = last = strtol(s, &end, 10);
+		if (end == s || first < 0)
+			return -1;
+		if (*end == '-') {
+			s = end + 1;
+			last = strtol(s, &end, 10);
+			if (end == s || last < first)
+				return -1;
+		}
+		for (; first <= last && first < CPU_SETSIZE; first++)
+			CPU_SET(first, set);
+		s = end;
+		if (*s == ',')
+			s++;
+		else if (*s && *s != '\n')
+			return -1;
+	}
+	return CPU_COUNT(set) ? 0 : -1;
+}
+
+static void numa_fake(const char *topology)
+{
+	char *s = strdup(topology), *node, *save;
+
+	if (!s)
+		error("memory allocation failed");
+	numa_count = 0;
+	for (node = strtok_r(s, ";", &save); node; node = strtok_r(NULL, ";", &save)) {
+		if (numa_count == NUMA_MAX_NODES)
+			error("too many NUMA nodes in RAW2RGBPNM_NUMA");
+		if (numa_parse_cpulist(node, &numa_cpus[numa_count++]))
+			error("bad CPU list `%s' in RAW2RGBPNM_NUMA", node);
+	}
+	if (numa_count == 0)
+		error("no nodes in RAW2RGBPNM_NUMA");
+	free(s);
+}
+
+static void numa_init(void)
+{
+	const char *fake = getenv("RAW2RGBPNM_NUMA");
+	char line[4096];
+	unsigned int n = 0;
+	glob_t g;
+	size_t i;
+
+	if (fake && *fake) {
+		numa_fake(fake);
+		numa_pin = 1;
+		return;
+	}
+
+	if (glob("/sys/devices/system/node/node[0-9]*/cpulist", 0, NULL, &g))
+		return;
+	for (i = 0; i < g.gl_pathc && n < NUMA_MAX_NODES; i++) {
+		FILE *f = fopen(g.gl_pathv[i], "r");
+		if (!f)
+			continue;
+		/* Memory-only nodes have an empty CPU list */
+		if (fgets(line, sizeof(line), f) && !numa_parse_cpulist(line, &numa_cpus[n]))
+			n++;
+		fclose(f);
+	}
+	globfree(&g);
+
+	if (n > 1) {
+		numa_count = n;
+		numa_pin = 1;
+	}
+}
+
+unsigned int numa_nodes(void)
+{
+	pthread_once(&numa_once, numa_init);
+	return numa_count;
+}
+
+void numa_bind(unsigned int node)
+{
+	pthread_once(&numa_once, numa_init);
+	node %= numa_count;
+	numa_node_self = node;
+	/* Failure only costs locality, e.g. when the CPUs are not ours */
+	if (numa_pin)
+		pthread_setaffinity_np(pthread_self(), sizeof(numa_cpus[node]), &numa_cpus[node]);
+}
+
+unsigned int numa_this_node(void)
+{
+	return numa_node_self;
+}
@@ -0,0 +1,39 @@
+/*
+ * raw2rgbpnm --- convert raw bayer images to RGB PNM for easier viewing
+ *
+ * Copyright (C) 2008--2011 Nokia Corporation
+ *
+ * Contact: Sakari Ailus <sakari.ailus@maxwell.research.nokia.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ */
+
+#ifndef __NUMA_H__
+#define __NUMA_H__
+
+/* Number of NUMA nodes, 1 if the machine is not NUMA or the topology can
+ * not be read. The topology can be faked for testing by setting
+ * RAW2RGBPNM_NUMA to the CPU lists of the nodes separated by semicolons,
+ * e.g. "0-3;4-7" or "0;0" for two nodes sharing CPU 0. */
+unsigned int numa_nodes(void);
+
+/* Pin the calling thread to the CPUs of a node and make it the node of
+ * the thread. A no-op on single node machines. */
+void numa_bind(unsigned int node);
+
+/* Node the calling thread is bound to, 0 if not bound */
+unsigned int numa_this_node(void);
+
+#endif /* __NUMA_H__ */
@@ -0,0 +1,259 @@
+/*
+ * raw2rgbpnm --- convert raw bayer images to RGB PNM for easier viewing
+ *
+ * Copyright (C) 2008--2011 Nokia Corporation
+ *
+ * Contact: Sakari Ailus <sakari.ailus@maxwell.research.nokia.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ */
+
+/*
+ * Work-stealing thread pool
+ *
+ * Work is an index range. Every worker owns a slice [head, tail) of it
+ * and consumes it from the head. An idle worker steals the upper half of
+ * another worker's slice, so neighbouring indices (neighbouring tiles,
+ * files, ...) tend to stay on the same worker.
+ *
+ * On NUMA machines the workers are spread over the nodes in contiguous
+ * groups and pinned there. Stealing tries the next workers first, which
+ * are on the same node unless the whole node has run dry.
+ */
+
+#include <stdlib.h>
+#include <pthread.h>
+#include "utils.h"
+#include "numa.h"
+#include "pool.h"
+
+struct pool_slice {
+	pthread_mutex_t lock;
+	unsigned int head;
+	unsigned int tail;
+} __attribute__((aligned(64)));
+
+struct pool {
+	unsigned int workers;
+	pthread_t *threads;
+	struct pool_slice *slices;
+
+	pthread_mutex_t lock;
+	pthread_cond_t start;
+	pthread_cond_t done;
+	unsigned int generation;	/* Bumped for each pool_run() */
+	unsigned int running;		/* Workers still busy with the current run */
+	int quit;
+
+	pool_func func;
+	void *arg;
+};
+
+struct pool_thread {
+	struct pool *pool;
+	unsigned int worker;
+};
+
+static int pool_take(struct pool_slice *s, unsigned int *index)
+{
+	int r = 0;
+
+	pthread_mutex_lock(&s->lock);
+	if (s->head < s->tail) {
+		*index = s->head++;
+		r = 1;
+	}
+	pthread_mutex_unlock(&s->lock);
+	return r;
+}
+
+/* Move the upper half of some other worker's slice into our own */
+static int pool_steal(struct pool *pool, unsigned int worker)
+{
+	struct pool_slice *own = &pool->slices[worker];
+	unsigned int i;
+
+	for (i = 1; i < pool->workers; i++) {
+		struct pool_slice *victim = &pool->slices[(worker + i) % pool->workers];
+		unsigned int head, tail;
+
+		pthread_mutex_lock(&victim->lock);
+		head = victim->head;
+		tail = victim->tail;
+		if (head < tail) {
+			head += (tail - head) / 2;
+			victim->tail = head;
+		}
+		pthread_mutex_unlock(&victim->lock);
+		if (head >= tail)
+			continue;
+
+		pthread_mutex_lock(&own->lock);
+		own->head = head;
+		own->tail = tail;
+		pthread_mutex_unlock(&own->lock);
+		return 1;
+	}
+
+	return 0;
+}
+
+static void pool_work(struct pool *pool, unsigned int worker)
+{
+	unsigned int index;
+
+	do {
+		while (pool_take(&pool->slices[worker], &index))
+			pool->func(pool->arg, index, worker);
+	} while (pool_steal(pool, worker));
+}
+
+static void *pool_thread(void *arg)
+{
+	struct pool_thread *t = arg;
+	struct pool *pool = t->pool;
+	unsigned int worker = t->worker;
+	unsigned int generation = 0;
+
+	free(t);
+
+	numa_bind(pool_worker_node(pool, worker));
+
+	pthread_mutex_lock(&pool->lock);
+	for (;;) {
+		while (!pool->quit && pool->generation == generation)
+			pthread_cond_wait(&pool->start, &pool->lock);
+		if (pool->quit)
+			break;
+		generation = pool->generation;
+		pthread_mutex_unlock(&pool->lock);
+
+		pool_work(pool, worker);
+
+		pthread_mutex_lock(&pool->lock);
+		if (--pool->running == 0)
+			pthread_cond_signal(&pool->done);
+	}
+	pthread_mutex_unlock(&pool->lock);
+
+	return NULL;
+}
+
+struct pool *pool_create(unsigned int workers)
+{
+	struct pool *pool;
+	unsigned int i;
+
+	if (workers < 1)
+		workers = 1;
+
+	pool = calloc(1, sizeof(*pool));
+	if (!pool)
+		error("memory allocation failed");
+	pool->workers = workers;
+	pool->threads = calloc(workers, sizeof(*pool->threads));
+	if (!pool->threads)
+		error("memory allocation failed");
+	if (posix_memalign((void **)&pool->slices, 64, workers * sizeof(*pool->slices)))
+		error("memory allocation failed");
+
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->start, NULL);
+	pthread_cond_init(&pool->done, NULL);
+	for (i = 0; i < workers; i++) {
+		pthread_mutex_init(&pool->slices[i].lock, NULL);
+		pool->slices[i].head = pool->slices[i].tail = 0;
+	}
+
+	/* Worker 0 is the thread calling pool_run() */
+	numa_bind(0);
+	for (i = 1; i < workers; i++) {
+		struct pool_thread *t = malloc(sizeof(*t));
+		if (!t)
+			error("memory allocation failed");
+		t->pool = pool;
+		t->worker = i;
+		if (pthread_create(&pool->threads[i], NULL, pool_thread, t))
+			error("pthread_create failed");
+	}
+
+	return pool;
+}
+
+void pool_destroy(struct pool *pool)
+{
+	unsigned int i;
+
+	if (!pool)
+		return;
+
+	pthread_mutex_lock(&pool->lock);
+	pool->quit = 1;
+	pthread_cond_broadcast(&pool->start);
+	pthread_mutex_unlock(&pool->lock);
+
+	for (i = 1; i < pool->workers; i++)
+		pthread_join(pool->threads[i], NULL);
+	for (i = 0; i < pool->workers; i++)
+		pthread_mutex_destroy(&pool->slices[i].lock);
+	pthread_cond_destroy(&pool->done);
+	pthread_cond_destroy(&pool->start);
+	pthread_mutex_destroy(&pool->lock);
+	free(pool->slices);
+	free(pool->threads);
+	free(pool);
+}
+
+unsigned int pool_workers(const struct pool *pool)
+{
+	return pool ? pool->workers : 1;
+}
+
+unsigned int pool_worker_node(const struct pool *pool, unsigned int worker)
+{
+	return (unsigned long long)worker * numa_nodes() / pool_workers(pool);
+}
+
+void pool_run(struct pool *pool, pool_func func, void *arg, unsigned int count)
+{
+	unsigned int i;
+
+	if (!pool || pool->workers == 1 || count <= 1) {
+		for (i = 0; i < count; i++)
+			func(arg, i, 0);
+		return;
+	}
+
+	/* Slices are only touched by workers while a run is active */
+	for (i = 0; i < pool->workers; i++) {
+		pool->slices[i].head = (unsigned long long)count * i / pool->workers;
+		pool->slices[i].tail = (unsigned long long)count * (i + 1) / pool->workers;
+	}
+
+	pthread_mutex_lock(&pool->lock);
+	pool->func = func;
+	pool->arg = arg;
+	pool->running = pool->workers - 1;
+	pool->generation++;
+	pthread_cond_broadcast(&pool->start);
+	pthread_mutex_unlock(&pool->lock);
+
+	pool_work(pool, 0);
+
+	pthread_mutex_lock(&pool->lock);
+	while (pool->running)
+		pthread_cond_wait(&pool->done, &pool->lock);
+	pthread_mutex_unlock(&pool->lock);
+}
@@ -0,0 +1,45 @@
+/*
+ * raw2rgbpnm --- convert raw bayer images to RGB PNM for easier viewing
+ *
+ * Copyright (C) 2008--2011 Nokia Corporation
+ *
+ * Contact: Sakari Ailus <sakari.ailus@maxwell.research.nokia.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ */
+
+#ifndef __POOL_H__
+#define __POOL_H__
+
+struct pool;
+
+/* Called once for every index in [0, count). worker is the number of
+ * the calling worker thread, 0 <= worker < pool_workers(). */
+typedef void (*pool_func)(void *arg, unsigned int index, unsigned int worker);
+
+struct pool *pool_create(unsigned int workers);
+void pool_destroy(struct pool *pool);
+unsigned int pool_workers(const struct pool *pool);
+
+/* NUMA node a worker is pinned to */
+unsigned int pool_worker_node(const struct pool *pool, unsigned int worker);
+
+/* Run func for all indices and return when every call has finished.
+ * Each worker starts with a contiguous slice of the index range and
+ * steals half of a busy worker's remaining slice when its own runs out.
+ * The calling thread takes part as worker 0. Not reentrant. */
+void pool_run(struct pool *pool, pool_func func, void *arg, unsigned int count);
+
+#endif /* __POOL_H__ */
@@ -27,18 +27,65 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <getopt.h>
 #include <string.h>
 #include <sys/types.h>
 #include <limits.h>
+#include <glob.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <endian.h>
 #include <linux/videodev2.h>
 #include "utils.h"
+#include "arena.h"
+#include "encode.h"
+#include "numa.h"
+#include "pool.h"
 #include "raw_to_rgb.h"
+#include "unpack.h"
 #include "yuv_to_rgb.h"
 
+#if defined(__i386__) || defined(__x86_64__)
+#include <tmmintrin.h>
+#define YUV_SSSE3
+#define YUV_SSSE3_FUNC	__attribute__((target("ssse3")))
+#endif
+
 #ifndef V4L2_PIX_FMT_SGRBG10
 #define V4L2_PIX_FMT_SGRBG10		v4l2_fourcc('B','A','1','0') /* 10bit raw bayer  */
 #endif
 
+#ifndef V4L2_PIX_FMT_SGBRG16
+#define V4L2_PIX_FMT_SGBRG16		v4l2_fourcc('G','B','1','6') /* 16  GBGB.. RGRG.. */
+#define V4L2_PIX_FMT_SGRBG16		v4l2_fourcc('G','R','1','6') /* 16  GRGR.. BGBG.. */
+#define V4L2_PIX_FMT_SRGGB16		v4l2_fourcc('R','G','1','6') /* 16  RGRG.. GBGB.. */
+#endif
+
+/* MIPI packed 12 and 14 bit raw bayer */
+#ifndef V4L2_PIX_FMT_SBGGR12P
+#define V4L2_PIX_FMT_SBGGR12P		v4l2_fourcc('p','B','C','C')
+#define V4L2_PIX_FMT_SGBRG12P		v4l2_fourcc('p','G','C','C')
+#define V4L2_PIX_FMT_SGRBG12P		v4l2_fourcc('p','g','C','C')
+#define V4L2_PIX_FMT_SRGGB12P		v4l2_fourcc('p','R','C','C')
+#endif
+#ifndef V4L2_PIX_FMT_SBGGR14P
+#define V4L2_PIX_FMT_SBGGR14P		v4l2_fourcc('p','B','E','E')
+#define V4L2_PIX_FMT_SGBRG14P		v4l2_fourcc('p','G','E','E')
+#define V4L2_PIX_FMT_SGRBG14P		v4l2_fourcc('p','g','E','E')
+#define V4L2_PIX_FMT_SRGGB14P		v4l2_fourcc('p','R','E','E')
+#endif
+
+/* 10 bit YUV in the high bits of 16 bit little endian samples */
+#ifndef V4L2_PIX_FMT_P010
+#define V4L2_PIX_FMT_P010		v4l2_fourcc('P','0','1','0') /* 24  Y/CbCr 4:2:0 */
+#endif
+#ifndef V4L2_PIX_FMT_P210
+#define V4L2_PIX_FMT_P210		v4l2_fourcc('P','2','1','0') /* 32  Y/CbCr 4:2:2 */
+#endif
+#ifndef V4L2_PIX_FMT_Y210
+#define V4L2_PIX_FMT_Y210		v4l2_fourcc('Y','2','1','0') /* 32  YUYV 4:2:2 */
+#endif
+
 #define DEFAULT_BGR 0
 
 #define SIZE(x)		(sizeof(x)/sizeof((x)[0]))
@@ -49,7 +96,18 @@ char *progname = "yuv_to_rgbpnm";
 
 static int swaprb = 0;
 static int highbits = 0;			/* Bayer RAW10 formats use high bits for data */
+static int deep = 0;				/* Keep more than 8 bits in the output */
+static int out_bpp = 3;				/* Bytes per output pixel */
+static int out_maxval = 255;
 static int brightness = 256;			/* 24.8 fixed point */
+static enum image_format out_format = IMAGE_PNM;
+static const struct yuv_matrix *matrix = &yuv_bt601;
+static int bin = 1;				/* Bayer pixels binned per output pixel, each way */
+static int crop_size[2], crop_pos[2];		/* Crop of the input, none if crop_size[0] is 0 */
+static int scale_size[2];			/* Downscaled output size, none if 0 */
+static int thumb_size[2];			/* Size of thumbnails, none if 0 */
+static int frame_rate[2] = {25, 1};		/* Y4M frames per second, as a fraction */
+static FILE *stats_file;			/* Where to write frame statistics */
 
 static const struct format_info {
 	__u32 fmt;
@@ -74,8 +132,8 @@ static const struct format_info {
 	{ V4L2_PIX_FMT_VYUY,     16,  "VYUY (16  YUV 4:2:2)", 1, 2 },
 	{ V4L2_PIX_FMT_YUYV,     16,  "YUYV (16  YUV 4:2:2)", 0, 1 },
 	{ V4L2_PIX_FMT_YVYU,     16,  "YVYU (16  YUV 4:2:2)", 0, 3 },
-	{ V4L2_PIX_FMT_YUV410,   -1,  "YUV410P (9  YUV 4:1:0 planar)", 0, 0 },
-	{ V4L2_PIX_FMT_YVU410,   -1,  "YVU410P (9  YVU 4:1:0 planar)", 0, 1 },
+	{ V4L2_PIX_FMT_YUV410,   9,  "YUV410P (9  YUV 4:1:0 planar)", 0, 0 },
+	{ V4L2_PIX_FMT_YVU410,   9,  "YVU410P (9  YVU 4:1:0 planar)", 0, 1 },
 	{ V4L2_PIX_FMT_YUV411P,  12,  "YUV411P (12  YUV 4:1:1 planar)", 0, 0 },
 	{ V4L2_PIX_FMT_YUV420,   12,  "YUV420P (12  YUV 4:2:0 planar)", 0, 0 },
 	{ V4L2_PIX_FMT_YVU420,   12,  "YVU420P (12  YVU 4:2:2 planar)", 0, 1 },
@@ -88,12 +146,17 @@ static const struct format_info {
 	{ V4L2_PIX_FMT_NV21,     12,  "NV21 (12  Y/CrCb 4:2:0)", 0, 0 },
 	{ V4L2_PIX_FMT_NV16,     16,  "NV16 (16  Y/CbCr 4:2:2)", 0, 0 },
 	{ V4L2_PIX_FMT_NV61,     16,  "NV61 (16  Y/CrCb 4:2:2)", 0, 1 },
-	{ V4L2_PIX_FMT_YYUV,     12,  "YYUV (16  YUV 4:2:2)", 0, 0 },
-	{ V4L2_PIX_FMT_HI240,    8,  "HI240 (8  8-bit color)", 0, 0 },
-//	{ V4L2_PIX_FMT_HM12,     8,  "HM12 (8  YUV 4:2:0 16x16 macroblocks)", 0, 0 },
+	{ V4L2_PIX_FMT_HM12,     12,  "HM12 (12  Y/CbCr 4:2:0 16x16 macroblocks)", 0, 0 },
+	{ V4L2_PIX_FMT_NV12MT_16X16, 12, "NV12MT16 (12  Y/CbCr 4:2:0 16x16 macroblocks)", 0, 0 },
+	{ V4L2_PIX_FMT_NV12MT,   12,  "NV12MT (12  Y/CbCr 4:2:0 64x32 macroblocks)", 0, 0 },
+	{ V4L2_PIX_FMT_P010,     24,  "P010 (24  Y/CbCr 4:2:0 10bit)", 0, 0 },
+	{ V4L2_PIX_FMT_P210,     32,  "P210 (32  Y/CbCr 4:2:2 10bit)", 0, 0 },
+	{ V4L2_PIX_FMT_Y210,     32,  "Y210 (32  YUYV 4:2:2 10bit)", 0, 0 },
+	{ V4L2_PIX_FMT_YYUV,     16,  "YYUV (16  YUV 4:2:2)", 0, 0 },
 	{ V4L2_PIX_FMT_SBGGR8,   8,  "SBGGR8 (8  BGBG.. GRGR..)", 0, 0 },
 	{ V4L2_PIX_FMT_SGBRG8,   8,  "SGBRG8 (8  GBGB.. RGRG..)", 0, 0 },
 	{ V4L2_PIX_FMT_SGRBG8,   8,  "SGRBG8 (8 GRGR.. BGBG..)", 0, 0 },
+	{ V4L2_PIX_FMT_SRGGB8,   8,  "SRGGB8 (8  RGRG.. GBGB..)", 0, 0 },
 	{ V4L2_PIX_FMT_MJPEG,    0,  "MJPEG (Motion-JPEG)", 0, 0 },
 	{ V4L2_PIX_FMT_JPEG,     0,  "JPEG (JFIF JPEG)", 0, 0 },
 	{ V4L2_PIX_FMT_DV,       0,  "DV (1394)", 0, 0 },
@@ -103,10 +166,34 @@ static const struct format_info {
 	{ V4L2_PIX_FMT_PWC1,     -1,  "PWC1 (pwc older webcam)", 0, 0 },
 	{ V4L2_PIX_FMT_PWC2,     -1,  "PWC2 (pwc newer webcam)", 0, 0 },
 	{ V4L2_PIX_FMT_ET61X251, -1,  "ET61X251 (ET61X251 compression)", 0, 0 },
+	{ V4L2_PIX_FMT_SBGGR10,  16,  "SBGGR10 (10bit raw bayer BGBG.. GRGR..)", 0, 0 },
+	{ V4L2_PIX_FMT_SGBRG10,  16,  "SGBRG10 (10bit raw bayer GBGB.. RGRG..)", 0, 0 },
 	{ V4L2_PIX_FMT_SGRBG10,  16,  "SGRBG10 (10bit raw bayer)", 0, 0 },
+	{ V4L2_PIX_FMT_SRGGB10,  16,  "SRGGB10 (10bit raw bayer RGRG.. GBGB..)", 0, 0 },
+	{ V4L2_PIX_FMT_SBGGR10P, 10,  "SBGGR10P (10bit MIPI packed bayer BGBG.. GRGR..)", 0, 0 },
+	{ V4L2_PIX_FMT_SGBRG10P, 10,  "SGBRG10P (10bit MIPI packed bayer GBGB.. RGRG..)", 0, 0 },
+	{ V4L2_PIX_FMT_SGRBG10P, 10,  "SGRBG10P (10bit MIPI packed bayer GRGR.. BGBG..)", 0, 0 },
+	{ V4L2_PIX_FMT_SRGGB10P, 10,  "SRGGB10P (10bit MIPI packed bayer RGRG.. GBGB..)", 0, 0 },
+	{ V4L2_PIX_FMT_SBGGR10DPCM8,    8, "SBGGR10DPCM8 (10bit raw bayer BGBG.. GRGR.. DPCM compressed to 8 bits)", 0, 0 },
+	{ V4L2_PIX_FMT_SGBRG10DPCM8,    8, "SGBRG10DPCM8 (10bit raw bayer GBGB.. RGRG.. DPCM compressed to 8 bits)", 0, 0 },
 	{ V4L2_PIX_FMT_SGRBG10DPCM8,    8, "SGRBG10DPCM8 (10bit raw bayer DPCM compressed to 8 bits)", 0, 0 },
+	{ V4L2_PIX_FMT_SRGGB10DPCM8,    8, "SRGGB10DPCM8 (10bit raw bayer RGRG.. GBGB.. DPCM compressed to 8 bits)", 0, 0 },
+	{ V4L2_PIX_FMT_SBGGR12,  16,  "SBGGR12 (12bit raw bayer BGBG.. GRGR..)", 0, 0 },
+	{ V4L2_PIX_FMT_SGBRG12,  16,  "SGBRG12 (12bit raw bayer GBGB.. RGRG..)", 0, 0 },
 	{ V4L2_PIX_FMT_SGRBG12,  16,  "SGRBG12 (12bit raw bayer)", 0, 0 },
+	{ V4L2_PIX_FMT_SRGGB12,  16,  "SRGGB12 (12bit raw bayer RGRG.. GBGB..)", 0, 0 },
+	{ V4L2_PIX_FMT_SBGGR12P, 12,  "SBGGR12P (12bit MIPI packed bayer BGBG.. GRGR..)", 0, 0 },
+	{ V4L2_PIX_FMT_SGBRG12P, 12,  "SGBRG12P (12bit MIPI packed bayer GBGB.. RGRG..)", 0, 0 },
+	{ V4L2_PIX_FMT_SGRBG12P, 12,  "SGRBG12P (12bit MIPI packed bayer GRGR.. BGBG..)", 0, 0 },
+	{ V4L2_PIX_FMT_SRGGB12P, 12,  "SRGGB12P (12bit MIPI packed bayer RGRG.. GBGB..)", 0, 0 },
+	{ V4L2_PIX_FMT_SBGGR14P, 14,  "SBGGR14P (14bit MIPI packed bayer BGBG.. GRGR..)", 0, 0 },
+	{ V4L2_PIX_FMT_SGBRG14P, 14,  "SGBRG14P (14bit MIPI packed bayer GBGB.. RGRG..)", 0, 0 },
+	{ V4L2_PIX_FMT_SGRBG14P, 14,  "SGRBG14P (14bit MIPI packed bayer GRGR.. BGBG..)", 0, 0 },
+	{ V4L2_PIX_FMT_SRGGB14P, 14,  "SRGGB14P (14bit MIPI packed bayer RGRG.. GBGB..)", 0, 0 },
 	{ V4L2_PIX_FMT_SBGGR16,  16,  "SBGGR16 (16 BGBG.. GRGR..)", 0, 0 },
+	{ V4L2_PIX_FMT_SGBRG16,  16,  "SGBRG16 (16 GBGB.. RGRG..)", 0, 0 },
+	{ V4L2_PIX_FMT_SGRBG16,  16,  "SGRBG16 (16 GRGR.. BGBG..)", 0, 0 },
+	{ V4L2_PIX_FMT_SRGGB16,  16,  "SRGGB16 (16 RGRG.. GBGB..)", 0, 0 },
 };
 
 static void *xalloc(int size)
@@ -128,6 +215,19 @@ static const struct format_info *get_format_info(__u32 f)
 	return NULL;
 }
 
+/* Format by the first word of its name */
+static const struct format_info *find_format(const char *name)
+{
+	unsigned int i, j;
+
+	for (i=0; i<SIZE(v4l2_pix_fmt_str); i++) {
+		for (j=0; v4l2_pix_fmt_str[i].name[j]!=' ' && v4l2_pix_fmt_str[i].name[j]!=0; j++);
+		if (memcmp(v4l2_pix_fmt_str[i].name, name, j)==0 && name[j]==0)
+			return &v4l2_pix_fmt_str[i];
+	}
+	return NULL;
+}
+
 static const int resolutions[][2] = {
 	{ 176, 144 },		/* QCIF */
 	{ 320, 240 },		/* QVGA */
@@ -141,61 +241,88 @@ static const int resolutions[][2] = {
 	{ 2592, 1968 },		/* 5 MP + a bit extra */
 };
 
-/* Read and return raw image data at given bits per pixel (bpp) depth.
- * size should be set correctly before calling this function.
- * If set to {-1,-1}, try to guess image file resolution.
- * If framenum is set to nonnegative value, assume that input file contains
- * multiple frames and return the given frame. In that case frame size must be given.
+/* Return the size of an open file and rewind it */
+static long long file_length(FILE *f)
+{
+	long long file_size;
+
+	if (fseeko(f, 0, SEEK_END) != 0) error("fseek");
+	file_size = ftello(f);
+	if (file_size == -1) error("ftell");
+	if (fseeko(f, 0, SEEK_SET) != 0) error("fseek");
+	return file_size;
+}
+
+/* Check image size against the file size. If size is {-1,-1}, try to
+ * guess image file resolution. framenum is as for read_raw_data().
+ * Returns the number of padding bytes at the end of each line.
  */
-static unsigned char *read_raw_data(char *filename, int framenum, int size[2], int bpp)
+static unsigned int raw_layout(long long file_size, int framenum, int size[2], int bpp)
 {
-	/* Get file size */
 	unsigned int line_length;
 	unsigned int padding = 0;
-	unsigned char *b = NULL;
+	long long frame_bits;
 	unsigned int i;
-	int offset;
-	FILE *f = fopen(filename, "rb");
-	if (!f) error("fopen failed");
-	int r = fseek(f, 0, SEEK_END);
-	if (r!=0) error("fseek");
-	int file_size = ftell(f);
-	if (file_size==-1) error("ftell");
-	r = fseek(f, 0, SEEK_SET);
-	if (r!=0) error("fseek");
 
 	/* Check image resolution */
 	if (size[0]<=0 || size[1]<=0) {
 		if (framenum>=0) error("can not automatically detect frame size with multiple frames");
 		for (i=0; i<SIZE(resolutions); i++)
-			if (resolutions[i][0]*resolutions[i][1]*bpp==file_size*8) break;
+			if ((long long)resolutions[i][0]*resolutions[i][1]*bpp==file_size*8) break;
 		if (i >= SIZE(resolutions)) error("can't guess raw image file resolution");
 		size[0] = resolutions[i][0];
 		size[1] = resolutions[i][1];
 	}
 
-	if (framenum<0 && (file_size*8 < size[0]*size[1]*bpp)) error("out of input data");
-	if (framenum<0 && (file_size*8 > size[0]*size[1]*bpp)) printf("warning: too large image file\n");
+	frame_bits = (long long)size[0] * size[1] * bpp;
+	if (framenum<0 && (file_size*8 < frame_bits)) error("out of input data");
+	if (framenum<0 && (file_size*8 > frame_bits)) printf("warning: too large image file\n");
 	if (framenum < 0 && (file_size % size[1] == 0)) {
 		line_length = size[0] * bpp / 8;
 		padding = file_size / size[1] - line_length;
 		printf("%u padding bytes detected at end of line\n", padding);
-	} else if ((file_size * 8) % (size[0] * size[1] * bpp) != 0) {
+	} else if ((file_size * 8) % frame_bits != 0) {
 		printf("warning: input size not multiple of frame size\n");
 	}
 
+	return padding;
+}
+
+/* Read and return raw image data at given bits per pixel (bpp) depth.
+ * The returned buffer comes from the frame arena, release it with arena_free().
+ * size should be set correctly before calling this function.
+ * If set to {-1,-1}, try to guess image file resolution.
+ * If framenum is set to nonnegative value, assume that input file contains
+ * multiple frames and return the given frame. In that case frame size must be given.
+ */
+static unsigned char *read_raw_data(char *filename, int framenum, int size[2], int bpp)
+{
+	unsigned int line_length;
+	unsigned int padding;
+	unsigned char *b = NULL;
+	unsigned int i;
+	long long file_size, frame_size, offset;
+	int r;
+	FILE *f = fopen(filename, "rb");
+	if (!f) error("fopen failed");
+
+	file_size = file_length(f);
+	padding = raw_layout(file_size, framenum, size, bpp);
+	line_length = size[0] * bpp / 8;
+	frame_size = ((long long)size[0]*size[1]*bpp+7)/8;
+
 	/* Go to the correct position in the file */
 	if (framenum>=0) printf("Reading frame %i...\n", framenum);
 	if (framenum<0) framenum = 0;
-	offset = framenum*size[0]*size[1]*bpp/8;
-	r = fseek(f, offset, SEEK_SET);
+	offset = (long long)framenum*size[0]*size[1]*bpp/8;
+	r = fseeko(f, offset, SEEK_SET);
 	if (r!=0) error("fseek");
-	if ((file_size-offset)*8 < size[0]*size[1]*bpp) goto out;
+	if ((file_size-offset)*8 < (long long)size[0]*size[1]*bpp) goto out;
 
 	/* Read data */
-	b = xalloc((size[0]*size[1]*bpp+7)/8);
+	b = arena_alloc(frame_size);
 	if (padding == 0) {
-		r = fread(b, (size[0]*size[1]*bpp+7)/8, 1, f);
+		r = fread(b, frame_size, 1, f);
 		if (r != 1)
 			error("fread");
 	} else {
@@ -212,406 +339,3241 @@ out:	fclose(f);
 	return b;
 }
 
-static void raw_to_rgb(const struct format_info *info,
-		       unsigned char *src, int src_size[2], unsigned char *rgb)
+static enum qc_bayer_phase bayer_phase(__u32 fmt)
 {
-	unsigned int src_stride = src_size[0] * info->bpp / 8;
-	unsigned int rgb_stride = src_size[0] * 3;
-	unsigned char *src_luma, *src_chroma;
-	unsigned char *src_cb, *src_cr;
-	unsigned char *buf;
-	unsigned int pixel;
-	int r, g, b, a, cr, cb;
-	int src_x, src_y;
-	int dst_x, dst_y;
-	int color_pos = 1;
-	int y_pos;
-	int cb_pos;
-	int cr_pos;
-	int shift = 0;
+	switch (fmt) {
+	case V4L2_PIX_FMT_SBGGR8:
+	case V4L2_PIX_FMT_SBGGR10:
+	case V4L2_PIX_FMT_SBGGR10P:
+	case V4L2_PIX_FMT_SBGGR10DPCM8:
+	case V4L2_PIX_FMT_SBGGR12:
+	case V4L2_PIX_FMT_SBGGR12P:
+	case V4L2_PIX_FMT_SBGGR14P:
+	case V4L2_PIX_FMT_SBGGR16:
+		return QC_BAYER_BGGR;
+	case V4L2_PIX_FMT_SGBRG8:
+	case V4L2_PIX_FMT_SGBRG10:
+	case V4L2_PIX_FMT_SGBRG10P:
+	case V4L2_PIX_FMT_SGBRG10DPCM8:
+	case V4L2_PIX_FMT_SGBRG12:
+	case V4L2_PIX_FMT_SGBRG12P:
+	case V4L2_PIX_FMT_SGBRG14P:
+	case V4L2_PIX_FMT_SGBRG16:
+		return QC_BAYER_GBRG;
+	case V4L2_PIX_FMT_SRGGB8:
+	case V4L2_PIX_FMT_SRGGB10:
+	case V4L2_PIX_FMT_SRGGB10P:
+	case V4L2_PIX_FMT_SRGGB10DPCM8:
+	case V4L2_PIX_FMT_SRGGB12:
+	case V4L2_PIX_FMT_SRGGB12P:
+	case V4L2_PIX_FMT_SRGGB14P:
+	case V4L2_PIX_FMT_SRGGB16:
+		return QC_BAYER_RGGB;
+	default:
+		return QC_BAYER_GRBG;
+	}
+}
+
+/* Bayer formats of each sample layout, in the order of enum qc_bayer_phase */
+static const __u32 bayer_formats[][4] = {
+	{ V4L2_PIX_FMT_SGRBG8, V4L2_PIX_FMT_SGBRG8, V4L2_PIX_FMT_SBGGR8, V4L2_PIX_FMT_SRGGB8 },
+	{ V4L2_PIX_FMT_SGRBG10, V4L2_PIX_FMT_SGBRG10, V4L2_PIX_FMT_SBGGR10, V4L2_PIX_FMT_SRGGB10 },
+	{ V4L2_PIX_FMT_SGRBG10P, V4L2_PIX_FMT_SGBRG10P, V4L2_PIX_FMT_SBGGR10P, V4L2_PIX_FMT_SRGGB10P },
+	{ V4L2_PIX_FMT_SGRBG10DPCM8, V4L2_PIX_FMT_SGBRG10DPCM8,
+	  V4L2_PIX_FMT_SBGGR10DPCM8, V4L2_PIX_FMT_SRGGB10DPCM8 },
+	{ V4L2_PIX_FMT_SGRBG12, V4L2_PIX_FMT_SGBRG12, V4L2_PIX_FMT_SBGGR12, V4L2_PIX_FMT_SRGGB12 },
+	{ V4L2_PIX_FMT_SGRBG12P, V4L2_PIX_FMT_SGBRG12P, V4L2_PIX_FMT_SBGGR12P, V4L2_PIX_FMT_SRGGB12P },
+	{ V4L2_PIX_FMT_SGRBG14P, V4L2_PIX_FMT_SGBRG14P, V4L2_PIX_FMT_SBGGR14P, V4L2_PIX_FMT_SRGGB14P },
+	{ V4L2_PIX_FMT_SGRBG16, V4L2_PIX_FMT_SGBRG16, V4L2_PIX_FMT_SBGGR16, V4L2_PIX_FMT_SRGGB16 },
+};
+
+/* The Bayer format of an image whose origin is moved by dx columns and
+ * dy rows, NULL if info is not a Bayer format */
+static const struct format_info *bayer_shift(const struct format_info *info, int dx, int dy)
+{
+	/* By the row and column of red */
+	static const enum qc_bayer_phase phases[2][2] = {
+		{ QC_BAYER_RGGB, QC_BAYER_GRBG },
+		{ QC_BAYER_GBRG, QC_BAYER_BGGR },
+	};
+	unsigned int i, p;
+
+	for (i = 0; i < SIZE(bayer_formats); i++) {
+		for (p = 0; p < 4; p++) {
+			int rx = p == QC_BAYER_GRBG || p == QC_BAYER_BGGR;
+			int ry = p == QC_BAYER_GBRG || p == QC_BAYER_BGGR;
+
+			if (bayer_formats[i][p] == info->fmt)
+				return get_format_info(bayer_formats[i][phases[ry ^ (dy & 1)][rx ^ (dx & 1)]]);
+		}
+	}
+	return NULL;
+}
+
+static int is_bayer(const struct format_info *info)
+{
+	return bayer_shift(info, 0, 0) != NULL;
+}
+
+/* Size of the RGB image converted from an input frame of given size */
+static void output_size(const int size[2], int out[2])
+{
+	const int *in = crop_size[0] ? crop_size : size;
+
+	if (scale_size[0]) {
+		out[0] = scale_size[0];
+		out[1] = scale_size[1];
+		return;
+	}
+	out[0] = in[0] / bin;
+	out[1] = in[1] / bin;
+}
 
+/* Significant bits in the bayer or YUV samples of a format */
+static int sample_depth(const struct format_info *info)
+{
 	switch (info->fmt) {
-	case V4L2_PIX_FMT_VYUY:
-	case V4L2_PIX_FMT_YVYU:
-	case V4L2_PIX_FMT_UYVY:
-	case V4L2_PIX_FMT_YUYV:		/* Packed YUV 4:2:2 */
-		y_pos = info->y_pos;
-		cb_pos = info->cb_pos;
-		cr_pos = (info->cb_pos + 2) % 4;
+	case V4L2_PIX_FMT_SBGGR16:
+	case V4L2_PIX_FMT_SGBRG16:
+	case V4L2_PIX_FMT_SGRBG16:
+	case V4L2_PIX_FMT_SRGGB16:
+		return highbits ? 10 : 16;
+	case V4L2_PIX_FMT_SBGGR14P:
+	case V4L2_PIX_FMT_SGBRG14P:
+	case V4L2_PIX_FMT_SGRBG14P:
+	case V4L2_PIX_FMT_SRGGB14P:
+		return 14;
+	case V4L2_PIX_FMT_SBGGR12:
+	case V4L2_PIX_FMT_SGBRG12:
+	case V4L2_PIX_FMT_SGRBG12:
+	case V4L2_PIX_FMT_SRGGB12:
+		return highbits ? 10 : 12;
+	case V4L2_PIX_FMT_SBGGR12P:
+	case V4L2_PIX_FMT_SGBRG12P:
+	case V4L2_PIX_FMT_SGRBG12P:
+	case V4L2_PIX_FMT_SRGGB12P:
+		return 12;
+	case V4L2_PIX_FMT_SBGGR10:
+	case V4L2_PIX_FMT_SGBRG10:
+	case V4L2_PIX_FMT_SGRBG10:
+	case V4L2_PIX_FMT_SRGGB10:
+	case V4L2_PIX_FMT_SBGGR10P:
+	case V4L2_PIX_FMT_SGBRG10P:
+	case V4L2_PIX_FMT_SGRBG10P:
+	case V4L2_PIX_FMT_SRGGB10P:
+	case V4L2_PIX_FMT_SBGGR10DPCM8:
+	case V4L2_PIX_FMT_SGBRG10DPCM8:
+	case V4L2_PIX_FMT_SGRBG10DPCM8:
+	case V4L2_PIX_FMT_SRGGB10DPCM8:
+	case V4L2_PIX_FMT_P010:
+	case V4L2_PIX_FMT_P210:
+	case V4L2_PIX_FMT_Y210:
+		return 10;
+	default:
+		return 8;
+	}
+}
 
-		for (src_y = 0, dst_y = 0; dst_y < src_size[1]; src_y++, dst_y++) {
-			for (src_x = 0, dst_x = 0; dst_x < src_size[0]; ) {
-				cb = src[src_y*src_stride + src_x*4 + cb_pos];
-				cr = src[src_y*src_stride + src_x*4 + cr_pos];
+/* Packed Bayer conversion
+ *
+ * Packed or DPCM compressed samples are unpacked and demosaiced a strip
+ * of rows at a time, so the unpacked samples only ever live in a small
+ * buffer that stays in cache. As in strip-mined conversion, every strip
+ * carries two rows of halo on either side and pairs its rows as the
+ * whole frame does (see strip_rows()), which makes the result identical
+ * to unpacking the whole frame first.
+ * Strips are independent and are spread over the worker pool.
+ */
 
-				a  = src[src_y*src_stride + src_x*4 + y_pos];
-				yuv_to_rgb(a,cb,cr, &r, &g, &b);
-				rgb[dst_y*rgb_stride+3*dst_x+0] = swaprb ? b : r;
-				rgb[dst_y*rgb_stride+3*dst_x+1] = g;
-				rgb[dst_y*rgb_stride+3*dst_x+2] = swaprb ? r : b;
-				dst_x++;
+/* Smallest frame all demosaic algorithms handle, in rows */
+#define STRIP_MIN_ROWS	6
 
-				a  = src[src_y*src_stride + src_x*4 + y_pos + 2];
-				yuv_to_rgb(a,cb,cr, &r, &g, &b);
-				rgb[dst_y*rgb_stride+3*dst_x+0] = swaprb ? b : r;
-				rgb[dst_y*rgb_stride+3*dst_x+1] = g;
-				rgb[dst_y*rgb_stride+3*dst_x+2] = swaprb ? r : b;
-				dst_x++;
+/* Rows [y0, y1) to convert for the strip of rows [y, y + rows) of a
+ * frame, with halo rows on either side, such that the strip is
+ * demosaiced in the same row pairs and direction as the whole frame.
+ * y is even. BGGR and RGGB frames of an odd height are converted top
+ * down from their second row (see qc_imag_bay2rgb_phase()), so their
+ * strips take an odd number of rows too, ending on an odd row, and two
+ * more rows of halo above for the row left over at their top. A strip
+ * is at most rows + 2 * halo + 3 or STRIP_MIN_ROWS + 1 rows tall. */
+static void strip_rows(enum qc_bayer_phase phase, int height, int y, int rows, int halo,
+		       int *y0, int *y1)
+{
+	int odd = halo && (phase == QC_BAYER_BGGR || phase == QC_BAYER_RGGB) && (height & 1);
 
-				src_x++;
-			}
-		}
-		break;
+	*y0 = MAX(0, y - halo - 2*odd);
+	*y1 = MIN(height, y + rows + halo + odd);
+	if (halo && *y1 - *y0 < STRIP_MIN_ROWS) {
+		/* Widen the halo of a short strip at either end */
+		*y0 = MAX(0, (*y1 - STRIP_MIN_ROWS - odd) & ~1);
+		*y1 = MIN(height, MAX(*y1, *y0 + STRIP_MIN_ROWS + odd));
+	}
+}
 
-	case V4L2_PIX_FMT_NV21:
-		color_pos = 0;
-	case V4L2_PIX_FMT_NV12:
-		src_luma = src;
-		src_chroma = &src[src_size[0] * src_size[1]];
-		src_stride = src_stride * 8 / 12;
+/* Unpacked samples and RGB output of a strip, in bytes */
+#define BAYER_STRIP_BYTES	(256 * 1024)
 
-		for (src_y = 0, dst_y = 0; dst_y < src_size[1]; src_y++, dst_y++) {
-			cr = 0;
+typedef void (*bayer_unpack_func)(const unsigned char *src, unsigned short *dst, int width);
 
-			for (dst_x = 0, src_x = 0; dst_x < src_size[0]; ) {
-				a  = src_luma[dst_y*src_stride + dst_x];
-				cb = src_chroma[(dst_y/2)*src_stride + dst_x + 1 - color_pos];
-				yuv_to_rgb(a,cb,cr, &r, &g, &b);
-				rgb[src_y*rgb_stride+3*src_x+0] = swaprb ? b : r;
-				rgb[src_y*rgb_stride+3*src_x+1] = g;
-				rgb[src_y*rgb_stride+3*src_x+2] = swaprb ? r : b;
-				src_x++;
-				dst_x++;
+struct bayer_strips {
+	const unsigned char *src;
+	unsigned int src_stride;
+	int *size;
+	unsigned char *rgb;
+	int rows;
+	bayer_unpack_func unpack;
+	int depth;
+	enum qc_bayer_phase phase;
+	int bgr;
+};
 
-				a  = src_luma[dst_y*src_stride + dst_x];
-				cr = src_chroma[(dst_y/2)*src_stride + dst_x + color_pos - 1];
-				yuv_to_rgb(a,cb,cr, &r, &g, &b);
-				rgb[src_y*rgb_stride+3*src_x+0] = swaprb ? b : r;
-				rgb[src_y*rgb_stride+3*src_x+1] = g;
-				rgb[src_y*rgb_stride+3*src_x+2] = swaprb ? r : b;
-				src_x++;
-				dst_x++;
-			}
-		}
-		break;
+static void bayer_strip(void *arg, unsigned int index, unsigned int worker)
+{
+	struct bayer_strips *s = arg;
+	int width = s->size[0], height = s->size[1];
+	int y = index * s->rows, y0, y1, rows, i;
+	unsigned short *bay;
+	unsigned char *rgb;
 
-	case V4L2_PIX_FMT_NV16:
-	case V4L2_PIX_FMT_NV61:
-		src_luma = src;
-		src_chroma = &src[src_size[0] * src_size[1]];
-		src_stride = src_stride * 8 / 16;
+	(void)worker;
 
-		cb_pos = info->cb_pos;
-		cr_pos = 1 - info->cb_pos;
+	/* Binned strips need no halo and start on a multiple of bin */
+	strip_rows(s->phase, height, y, s->rows, bin > 1 ? 0 : 2, &y0, &y1);
+	rows = MIN(s->rows, height - y);
 
-		for (src_y = 0, dst_y = 0; dst_y < src_size[1]; src_y++, dst_y++) {
-			for (dst_x = 0, src_x = 0; dst_x < src_size[0]; ) {
-				cb = src_chroma[dst_y*src_stride + dst_x + cb_pos];
-				cr = src_chroma[dst_y*src_stride + dst_x + cr_pos];
+	bay = arena_alloc((size_t)(y1 - y0) * width * 2);
 
-				a  = src_luma[dst_y*src_stride + dst_x];
-				yuv_to_rgb(a,cb,cr, &r, &g, &b);
-				rgb[src_y*rgb_stride+3*src_x+0] = swaprb ? b : r;
-				rgb[src_y*rgb_stride+3*src_x+1] = g;
-				rgb[src_y*rgb_stride+3*src_x+2] = swaprb ? r : b;
-				src_x++;
-				dst_x++;
+	for (i = 0; i < y1 - y0; i++) {
+		unsigned short *p = bay + i * width;
+		int x;
 
-				a  = src_luma[dst_y*src_stride + dst_x];
-				yuv_to_rgb(a,cb,cr, &r, &g, &b);
-				rgb[src_y*rgb_stride+3*src_x+0] = swaprb ? b : r;
-				rgb[src_y*rgb_stride+3*src_x+1] = g;
-				rgb[src_y*rgb_stride+3*src_x+2] = swaprb ? r : b;
-				src_x++;
-				dst_x++;
+		s->unpack(s->src + (size_t)(y0 + i) * s->src_stride, p, width);
+		if (brightness != 256) {
+			for (x = 0; x < width; x++) {
+				long v = ((long)p[x] * brightness) >> 8;
+				p[x] = MIN(v, (1 << s->depth) - 1);
 			}
 		}
-		break;
+	}
 
-	case V4L2_PIX_FMT_YUV411P:
-		src_luma = src;
-		src_cb = &src[src_size[0] * src_size[1]];
-		src_cr = &src[src_size[0] * src_size[1] / 4 * 5];
-		src_stride = src_stride * 8 / 12;
+	if (bin > 1) {
+		int line = width / bin * out_bpp;
 
-		for (src_y = 0, dst_y = 0; dst_y < src_size[1]; src_y++, dst_y++) {
-			for (dst_x = 0, src_x = 0; dst_x < src_size[0]; ) {
-				a  = src_luma[dst_y*src_stride + dst_x];
-				cb = src_cb[dst_y*src_stride/4 + dst_x/4];
-				cr = src_cr[dst_y*src_stride/4 + dst_x/4];
+		qc_imag_bay2rgb_bin((unsigned char *)bay, width * 2, s->rgb + (size_t)(y / bin) * line,
+				    line, width, y1 - y0, out_bpp, s->depth, bin, s->phase, s->bgr);
+		arena_free(bay);
+		return;
+	}
 
-				yuv_to_rgb(a,cb,cr, &r, &g, &b);
-				rgb[src_y*rgb_stride+3*src_x+0] = swaprb ? b : r;
-				rgb[src_y*rgb_stride+3*src_x+1] = g;
-				rgb[src_y*rgb_stride+3*src_x+2] = swaprb ? r : b;
-				src_x++;
-				dst_x++;
-			}
-		}
-		break;
+	rgb = arena_alloc((size_t)(y1 - y0) * width * out_bpp);
+	qc_imag_bay2rgb16((unsigned char *)bay, width * 2, rgb, width * out_bpp, width, y1 - y0,
+			  out_bpp, s->depth, s->phase, s->bgr);
+	memcpy(s->rgb + (size_t)y * width * out_bpp, rgb + (size_t)(y - y0) * width * out_bpp,
+	       (size_t)rows * width * out_bpp);
 
-	case V4L2_PIX_FMT_YUV420:
-	case V4L2_PIX_FMT_YVU420:
-		src_luma = src;
-		if (info->cb_pos == 0) {
-			src_cb = &src[src_size[0] * src_size[1]];
-			src_cr = &src[src_size[0] * src_size[1] / 4 * 5];
-		} else {
-			src_cr = &src[src_size[0] * src_size[1]];
-			src_cb = &src[src_size[0] * src_size[1] / 4 * 5];
-		}
-		src_stride = src_stride * 8 / 12;
+	arena_free(rgb);
+	arena_free(bay);
+}
 
-		for (src_y = 0, dst_y = 0; dst_y < src_size[1]; src_y++, dst_y++) {
-			for (dst_x = 0, src_x = 0; dst_x < src_size[0]; ) {
-				a  = src_luma[dst_y*src_stride + dst_x];
-				cb = src_cb[(dst_y/2)*src_stride/2 + dst_x/2];
-				cr = src_cr[(dst_y/2)*src_stride/2 + dst_x/2];
+static void bayer_packed_to_rgb(const struct format_info *info,
+				const unsigned char *src, unsigned int src_stride,
+				int size[2], unsigned char *rgb, bayer_unpack_func unpack)
+{
+	struct pool *pool = qc_get_pool();
+	struct bayer_strips s;
 
-				yuv_to_rgb(a,cb,cr, &r, &g, &b);
-				rgb[src_y*rgb_stride+3*src_x+0] = swaprb ? b : r;
-				rgb[src_y*rgb_stride+3*src_x+1] = g;
-				rgb[src_y*rgb_stride+3*src_x+2] = swaprb ? r : b;
-				src_x++;
-				dst_x++;
-			}
-		}
-		break;
+	s.src = src;
+	s.src_stride = src_stride;
+	s.size = size;
+	s.rgb = rgb;
+	s.unpack = unpack;
+	s.depth = sample_depth(info);
+	s.phase = bayer_phase(info->fmt);
+	s.bgr = swaprb;
+	s.rows = MAX(2, BAYER_STRIP_BYTES / (size[0] * (2 + out_bpp)) - 4) & ~1;
+	s.rows = MAX(bin, s.rows & ~(bin - 1));
 
-	case V4L2_PIX_FMT_YUV422P:
-	case V4L2_PIX_FMT_YVU422M:
-		src_luma = src;
-		if (info->cb_pos == 0) {
-			src_cb = &src[src_size[0] * src_size[1]];
-			src_cr = &src[src_size[0] * src_size[1] / 2 * 3];
-		} else {
-			src_cr = &src[src_size[0] * src_size[1]];
-			src_cb = &src[src_size[0] * src_size[1] / 2 * 3];
-		}
-		src_stride = src_stride * 8 / 16;
+	/* Strips are converted on one thread each */
+	qc_set_pool(NULL);
+	pool_run(pool, bayer_strip, &s, (size[1] + s.rows - 1) / s.rows);
+	qc_set_pool(pool);
+}
 
-		for (src_y = 0, dst_y = 0; dst_y < src_size[1]; src_y++, dst_y++) {
-			for (dst_x = 0, src_x = 0; dst_x < src_size[0]; ) {
-				a  = src_luma[dst_y*src_stride + dst_x];
-				cb = src_cb[dst_y*src_stride/2 + dst_x/2];
-				cr = src_cr[dst_y*src_stride/2 + dst_x/2];
+#ifdef YUV_SSSE3
+/* Byte shuffle taking component comp of eight RGB pixels of size byte
+ * samples, one component per register, to output register reg */
+YUV_SSSE3_FUNC
+static __m128i rgb_interleave_mask(int reg, int comp, int size)
+{
+	signed char m[16];
+	int j, at;
 
-				yuv_to_rgb(a,cb,cr, &r, &g, &b);
-				rgb[src_y*rgb_stride+3*src_x+0] = swaprb ? b : r;
-				rgb[src_y*rgb_stride+3*src_x+1] = g;
-				rgb[src_y*rgb_stride+3*src_x+2] = swaprb ? r : b;
-				src_x++;
-				dst_x++;
+	for (j = 0; j < 16; j++) {
+		at = reg * 16 + j;
+		m[j] = (at / size) % 3 == comp ? at / (3 * size) * size + at % size : -1;
+	}
+
+	return _mm_loadu_si128((const __m128i *)m);
+}
+
+/* Eight pixels per iteration. Every product of a 16 bit sample and a
+ * matrix coefficient is summed in 32 bits by pmaddwd: the Y term and the
+ * rounding from (c, 1) pairs, the chroma terms from (d, e) pairs. The
+ * results are exact, so rows match the scalar code. */
+YUV_SSSE3_FUNC
+static int yuv_lanes_to_rgb_ssse3(const struct yuv_matrix *m, const short *ly, const short *lu,
+				  const short *lv, int width, int depth, unsigned char *rgb, int swap)
+{
+	int out_depth = out_bpp == 6 ? depth : 8;
+	int shift = RGBSHIFT + depth - out_depth;
+	const __m128i yoff = _mm_set1_epi16(16 << (depth - 8));
+	const __m128i coff = _mm_set1_epi16(128 << (depth - 8));
+	const __m128i one = _mm_set1_epi16(1);
+	const __m128i ky = _mm_setr_epi16(m->y, 1 << (shift - 1), m->y, 1 << (shift - 1),
+					  m->y, 1 << (shift - 1), m->y, 1 << (shift - 1));
+	const __m128i kr = _mm_setr_epi16(0, m->rv, 0, m->rv, 0, m->rv, 0, m->rv);
+	const __m128i kg = _mm_setr_epi16(-m->gu, -m->gv, -m->gu, -m->gv,
+					  -m->gu, -m->gv, -m->gu, -m->gv);
+	const __m128i kb = _mm_setr_epi16(m->bu, 0, m->bu, 0, m->bu, 0, m->bu, 0);
+	const __m128i max = _mm_set1_epi16((1 << out_depth) - 1);
+	int size = out_bpp == 6 ? 2 : 1;
+	__m128i mask[3][3];
+	int x, i, k;
+
+	for (i = 0; i < size + 1; i++)
+		for (k = 0; k < 3; k++)
+			mask[i][k] = rgb_interleave_mask(i, k, size);
+
+	for (x = 0; x + 8 <= width; x += 8) {
+		__m128i c = _mm_sub_epi16(_mm_loadu_si128((const __m128i *)(ly + x)), yoff);
+		__m128i d = _mm_sub_epi16(_mm_loadu_si128((const __m128i *)(lu + x)), coff);
+		__m128i e = _mm_sub_epi16(_mm_loadu_si128((const __m128i *)(lv + x)), coff);
+		__m128i c1[2], de[2], ch[3], t;
+
+		c1[0] = _mm_unpacklo_epi16(c, one);
+		c1[1] = _mm_unpackhi_epi16(c, one);
+		de[0] = _mm_unpacklo_epi16(d, e);
+		de[1] = _mm_unpackhi_epi16(d, e);
+		for (k = 0; k < 3; k++) {
+			const __m128i kc = k == 0 ? kr : k == 1 ? kg : kb;
+			__m128i h[2];
+
+			for (i = 0; i < 2; i++) {
+				t = _mm_madd_epi16(c1[i], ky);
+				t = _mm_add_epi32(t, _mm_madd_epi16(de[i], kc));
+				h[i] = _mm_srai_epi32(t, shift);
 			}
+			t = _mm_packs_epi32(h[0], h[1]);
+			t = _mm_min_epi16(_mm_max_epi16(t, _mm_setzero_si128()), max);
+			ch[swap && k != 1 ? 2 - k : k] = size == 2 ? t : _mm_packus_epi16(t, t);
 		}
-		break;
 
-	case V4L2_PIX_FMT_YUV444M:
-	case V4L2_PIX_FMT_YVU444M:
-		src_luma = src;
-		if (info->cb_pos == 0) {
-			src_cb = &src[src_size[0] * src_size[1]];
-			src_cr = &src[src_size[0] * src_size[1] * 2];
-		} else {
-			src_cr = &src[src_size[0] * src_size[1]];
-			src_cb = &src[src_size[0] * src_size[1] * 2];
+		for (i = 0; i < size + 1; i++) {
+			t = _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(ch[0], mask[i][0]),
+						      _mm_shuffle_epi8(ch[1], mask[i][1])),
+					 _mm_shuffle_epi8(ch[2], mask[i][2]));
+			if (size == 1 && i == 1)
+				_mm_storel_epi64((__m128i *)(rgb + 3 * x + 16), t);
+			else
+				_mm_storeu_si128((__m128i *)(rgb + 3 * size * x + 16 * i), t);
 		}
-		src_stride = src_stride * 8 / 24;
+	}
 
-		for (src_y = 0, dst_y = 0; dst_y < src_size[1]; src_y++, dst_y++) {
-			for (dst_x = 0, src_x = 0; dst_x < src_size[0]; ) {
-				a  = src_luma[dst_y*src_stride + dst_x];
-				cb = src_cb[dst_y*src_stride + dst_x];
-				cr = src_cr[dst_y*src_stride + dst_x];
+	return x;
+}
+#endif
 
-				yuv_to_rgb(a,cb,cr, &r, &g, &b);
-				rgb[src_y*rgb_stride+3*src_x+0] = swaprb ? b : r;
-				rgb[src_y*rgb_stride+3*src_x+1] = g;
-				rgb[src_y*rgb_stride+3*src_x+2] = swaprb ? r : b;
-				src_x++;
-				dst_x++;
+/* Convert a row of separate Y, Cb and Cr lanes of depth bits. Where the
+ * CPU has SSSE3, eight pixels at a time are converted in vectors, the
+ * scalar loops handle the rest of the row and other CPUs. */
+static void yuv_lanes_to_rgb(const short *ly, const short *lu, const short *lv, int width,
+			     int depth, unsigned char *rgb, int swap)
+{
+	const struct yuv_matrix m = *matrix;	/* Not aliased by the stores */
+	int ro = swap ? 2 : 0, bo = 2 - ro;
+	int x = 0;
+
+#ifdef YUV_SSSE3
+	if (__builtin_cpu_supports("ssse3"))
+		x = yuv_lanes_to_rgb_ssse3(&m, ly, lu, lv, width, depth, rgb, swap);
+#endif
+	if (out_bpp == 6) {
+		unsigned short *out = (unsigned short *)rgb;
+		for (; x < width; x++) {
+			int r, g, b;
+			yuv_to_rgb_matrix(&m, depth, depth, ly[x], lu[x], lv[x], &r, &g, &b);
+			out[3*x + ro] = r;
+			out[3*x + 1] = g;
+			out[3*x + bo] = b;
+		}
+	} else {
+		for (; x < width; x++) {
+			int r, g, b;
+			yuv_to_rgb_matrix(&m, depth, 8, ly[x], lu[x], lv[x], &r, &g, &b);
+			rgb[3*x + ro] = r;
+			rgb[3*x + 1] = g;
+			rgb[3*x + bo] = b;
+		}
+	}
+}
+
+/*
+ * P010 and P210 are NV12 and NV16 with 16 bit samples, Y210 is YUYV with
+ * 16 bit samples, all holding 10 bits in the high bits. Every row is
+ * unpacked into Y, Cb and Cr lanes of 16 bit first.
+ */
+#ifdef YUV_SSSE3
+/* Eight pixels per iteration, the chroma pair of every two pixels is
+ * doubled by the shuffles */
+YUV_SSSE3_FUNC
+static int yuv10_lanes_ssse3(const uint16_t *luma, const uint16_t *chroma, int step,
+			     short *ly, short *lu, short *lv, int width)
+{
+	const __m128i cb = _mm_setr_epi8(0, 1, 0, 1, 4, 5, 4, 5, 8, 9, 8, 9, 12, 13, 12, 13);
+	const __m128i cr = _mm_setr_epi8(2, 3, 2, 3, 6, 7, 6, 7, 10, 11, 10, 11, 14, 15, 14, 15);
+	/* Y210 takes every other sample of two loads */
+	const __m128i y2 = _mm_setr_epi8(0, 1, 4, 5, 8, 9, 12, 13, -1, -1, -1, -1, -1, -1, -1, -1);
+	const __m128i cb2 = _mm_setr_epi8(2, 3, 2, 3, 10, 11, 10, 11, -1, -1, -1, -1, -1, -1, -1, -1);
+	const __m128i cr2 = _mm_setr_epi8(6, 7, 6, 7, 14, 15, 14, 15, -1, -1, -1, -1, -1, -1, -1, -1);
+	__m128i y, u, v;
+	int x;
+
+	for (x = 0; x + 8 <= width; x += 8) {
+		if (step == 1) {
+			__m128i c = _mm_loadu_si128((const __m128i *)(chroma + x));
+			y = _mm_loadu_si128((const __m128i *)(luma + x));
+			u = _mm_shuffle_epi8(c, cb);
+			v = _mm_shuffle_epi8(c, cr);
+		} else {
+			__m128i a = _mm_loadu_si128((const __m128i *)(luma + 2 * x));
+			__m128i b = _mm_loadu_si128((const __m128i *)(luma + 2 * x + 8));
+			y = _mm_unpacklo_epi64(_mm_shuffle_epi8(a, y2), _mm_shuffle_epi8(b, y2));
+			u = _mm_unpacklo_epi64(_mm_shuffle_epi8(a, cb2), _mm_shuffle_epi8(b, cb2));
+			v = _mm_unpacklo_epi64(_mm_shuffle_epi8(a, cr2), _mm_shuffle_epi8(b, cr2));
+		}
+		_mm_storeu_si128((__m128i *)(ly + x), _mm_srli_epi16(y, 6));
+		_mm_storeu_si128((__m128i *)(lu + x), _mm_srli_epi16(u, 6));
+		_mm_storeu_si128((__m128i *)(lv + x), _mm_srli_epi16(v, 6));
+	}
+
+	return x;
+}
+#endif
+
+static void yuv10_to_rgb(const struct format_info *info, unsigned char *src, int size[2],
+			 unsigned char *rgb, int swap)
+{
+	const uint16_t *in = (const uint16_t *)src;
+	int width = size[0], height = size[1];
+	short *lanes = xalloc(width * 3 * sizeof(*lanes));
+	short *ly = lanes, *lu = lanes + width, *lv = lanes + 2 * width;
+	int x, y;
+
+	for (y = 0; y < height; y++) {
+		const uint16_t *luma, *chroma;
+		int step;
+
+		switch (info->fmt) {
+		case V4L2_PIX_FMT_P010:
+			luma = in + (size_t)y * width;
+			chroma = in + (size_t)width * height + (size_t)(y / 2) * width;
+			step = 1;
+			break;
+		case V4L2_PIX_FMT_P210:
+			luma = in + (size_t)y * width;
+			chroma = in + (size_t)width * height + (size_t)y * width;
+			step = 1;
+			break;
+		default:			/* Y210: Y0 Cb Y1 Cr */
+			luma = in + (size_t)y * width * 2;
+			chroma = luma + 1;
+			step = 2;
+			break;
+		}
+
+		x = 0;
+#ifdef YUV_SSSE3
+		if (__builtin_cpu_supports("ssse3"))
+			x = yuv10_lanes_ssse3(luma, chroma, step, ly, lu, lv, width);
+#endif
+		for (; x < width; x++) {
+			ly[x] = le16toh(luma[x * step]) >> 6;
+			lu[x] = le16toh(chroma[(x / 2) * 2 * step]) >> 6;
+			lv[x] = le16toh(chroma[(x / 2) * 2 * step + step]) >> 6;
+		}
+		yuv_lanes_to_rgb(ly, lu, lv, width, 10, rgb + (size_t)y * width * out_bpp, swap);
+	}
+
+	free(lanes);
+}
+
+/*
+ * YUV layouts described by data
+ *
+ * A row of a plane is a sequence of blocks of the same number of bytes,
+ * each holding the samples of a few neighbouring pixels. The descriptor
+ * gives the byte offset of every sample within its block. Chroma planes
+ * follow the luma plane, chroma samples in the luma plane are in the
+ * same row as the luma samples. New packed or planar layouts of 8 bit
+ * samples only need an entry here.
+ *
+ * The packed 4:2:2 and planar formats also have hand written loops for
+ * contiguous frames, their entries are used for frames read from separate
+ * planes and for repacking.
+ */
+struct yuv_desc {
+	__u32 fmt;
+	unsigned char hsub, vsub;	/* Chroma subsampling */
+	unsigned char width;		/* Pixels in a block */
+	unsigned char plane[3];		/* Plane of Y, Cb and Cr */
+	unsigned char bytes[3];		/* Block size in each plane */
+	unsigned char y[8];		/* Luma sample offsets */
+	unsigned char cb[4], cr[4];	/* Chroma sample offsets */
+};
+
+static const struct yuv_desc yuv_descs[] = {
+	{ V4L2_PIX_FMT_YUYV,   2, 1, 2, { 0, 0, 0 }, { 4 },
+	  { 0, 2 }, { 1 }, { 3 } },
+	{ V4L2_PIX_FMT_YVYU,   2, 1, 2, { 0, 0, 0 }, { 4 },
+	  { 0, 2 }, { 3 }, { 1 } },
+	{ V4L2_PIX_FMT_UYVY,   2, 1, 2, { 0, 0, 0 }, { 4 },
+	  { 1, 3 }, { 0 }, { 2 } },
+	{ V4L2_PIX_FMT_VYUY,   2, 1, 2, { 0, 0, 0 }, { 4 },
+	  { 1, 3 }, { 2 }, { 0 } },
+	/* Y41P: U0 Y0 V0 Y1 U4 Y2 V4 Y3 Y4 Y5 Y6 Y7 */
+	{ V4L2_PIX_FMT_Y41P,   4, 1, 8, { 0, 0, 0 }, { 12 },
+	  { 1, 3, 5, 7, 8, 9, 10, 11 }, { 0, 4 }, { 2, 6 } },
+	{ V4L2_PIX_FMT_YYUV,   2, 1, 2, { 0, 0, 0 }, { 4 },
+	  { 0, 1 }, { 2 }, { 3 } },
+	{ V4L2_PIX_FMT_YUV410, 4, 4, 4, { 0, 1, 2 }, { 4, 1, 1 },
+	  { 0, 1, 2, 3 }, { 0 }, { 0 } },
+	{ V4L2_PIX_FMT_YVU410, 4, 4, 4, { 0, 2, 1 }, { 4, 1, 1 },
+	  { 0, 1, 2, 3 }, { 0 }, { 0 } },
+	{ V4L2_PIX_FMT_YUV411P, 4, 1, 4, { 0, 1, 2 }, { 4, 1, 1 },
+	  { 0, 1, 2, 3 }, { 0 }, { 0 } },
+	{ V4L2_PIX_FMT_YUV420, 2, 2, 2, { 0, 1, 2 }, { 2, 1, 1 },
+	  { 0, 1 }, { 0 }, { 0 } },
+	{ V4L2_PIX_FMT_YVU420, 2, 2, 2, { 0, 2, 1 }, { 2, 1, 1 },
+	  { 0, 1 }, { 0 }, { 0 } },
+	{ V4L2_PIX_FMT_YUV422P, 2, 1, 2, { 0, 1, 2 }, { 2, 1, 1 },
+	  { 0, 1 }, { 0 }, { 0 } },
+	{ V4L2_PIX_FMT_YVU422M, 2, 1, 2, { 0, 2, 1 }, { 2, 1, 1 },
+	  { 0, 1 }, { 0 }, { 0 } },
+	{ V4L2_PIX_FMT_YUV444M, 1, 1, 1, { 0, 1, 2 }, { 1, 1, 1 },
+	  { 0 }, { 0 }, { 0 } },
+	{ V4L2_PIX_FMT_YVU444M, 1, 1, 1, { 0, 2, 1 }, { 1, 1, 1 },
+	  { 0 }, { 0 }, { 0 } },
+	{ V4L2_PIX_FMT_NV12,   2, 2, 2, { 0, 1, 1 }, { 2, 2 },
+	  { 0, 1 }, { 0 }, { 1 } },
+	{ V4L2_PIX_FMT_NV21,   2, 2, 2, { 0, 1, 1 }, { 2, 2 },
+	  { 0, 1 }, { 1 }, { 0 } },
+	{ V4L2_PIX_FMT_NV16,   2, 1, 2, { 0, 1, 1 }, { 2, 2 },
+	  { 0, 1 }, { 0 }, { 1 } },
+	{ V4L2_PIX_FMT_NV61,   2, 1, 2, { 0, 1, 1 }, { 2, 2 },
+	  { 0, 1 }, { 1 }, { 0 } },
+};
+
+/* Base and stride of every plane of a frame */
+struct planes {
+	unsigned char *base[3];
+	int stride[3];
+};
+
+static const struct yuv_desc *get_yuv_desc(__u32 fmt)
+{
+	unsigned int i;
+
+	for (i = 0; i < SIZE(yuv_descs); i++)
+		if (yuv_descs[i].fmt == fmt)
+			return &yuv_descs[i];
+	return NULL;
+}
+
+static int desc_planes(const struct yuv_desc *d)
+{
+	return MAX(d->plane[1], d->plane[2]) + 1;
+}
+
+/* Bytes and rows of a plane without padding */
+static int desc_row_bytes(const struct yuv_desc *d, int size[2], int plane)
+{
+	return size[0] / d->width * d->bytes[plane];
+}
+
+static int desc_rows(const struct yuv_desc *d, int size[2], int plane)
+{
+	return plane == 0 ? size[1] : size[1] / d->vsub;
+}
+
+/* Planes of a contiguous frame */
+static void desc_contiguous(const struct yuv_desc *d, unsigned char *src, int size[2],
+			    struct planes *pl)
+{
+	int p;
+
+	for (p = 0; p < desc_planes(d); p++) {
+		pl->base[p] = p ? pl->base[p - 1] + pl->stride[p - 1] * desc_rows(d, size, p - 1) : src;
+		pl->stride[p] = desc_row_bytes(d, size, p);
+	}
+}
+
+static size_t desc_frame_bytes(const struct yuv_desc *d, int size[2])
+{
+	size_t bytes = 0;
+	int p;
+
+	for (p = 0; p < desc_planes(d); p++)
+		bytes += (size_t)desc_rows(d, size, p) * desc_row_bytes(d, size, p);
+	return bytes;
+}
+
+/* Row of component c (Y, Cb or Cr) for the pixels of row y */
+static unsigned char *desc_row(const struct yuv_desc *d, const struct planes *pl, int c, int y)
+{
+	int plane = d->plane[c];
+	int r = plane == d->plane[0] ? y : y / d->vsub;
+
+	return pl->base[plane] + (size_t)r * pl->stride[plane];
+}
+
+/* Offsets of the Y, Cb and Cr samples of every pixel within its rows */
+static void desc_offsets(const struct yuv_desc *d, int width, int *yo, int *uo, int *vo)
+{
+	int x;
+
+	for (x = 0; x < width; x++) {
+		int block = x / d->width, i = x % d->width;
+		yo[x] = block * d->bytes[d->plane[0]] + d->y[i];
+		uo[x] = block * d->bytes[d->plane[1]] + d->cb[i / d->hsub];
+		vo[x] = block * d->bytes[d->plane[2]] + d->cr[i / d->hsub];
+	}
+}
+
+#ifdef YUV_SSSE3
+/* Gather eight pixels of every component per iteration. Blocks are at
+ * most eight pixels wide and divide eight, so the samples of the next
+ * eight pixels are always the same number of bytes further on and one
+ * shuffle takes them from a 16 byte load into 16 bit lanes. Stop while
+ * a load would still run past the last sample of the row, or at once if
+ * the samples of eight pixels span more than 16 bytes. */
+YUV_SSSE3_FUNC
+static int desc_gather_ssse3(const struct yuv_desc *d, const unsigned char *row[3],
+			     const int *off[3], short *lane[3], int width)
+{
+	__m128i mask[3];
+	int base[3], step[3];
+	int groups = width / 8;
+	int p, i, g;
+
+	if (groups == 0)
+		return 0;
+	for (p = 0; p < 3; p++) {
+		const int *o = off[p];
+		signed char m[16];
+		int lo = o[0], hi = o[0], last = 0;
+
+		for (i = 1; i < 8; i++) {
+			lo = MIN(lo, o[i]);
+			hi = MAX(hi, o[i]);
+		}
+		if (hi - lo >= 16)
+			return 0;
+		for (i = 0; i < 8; i++) {
+			m[2*i] = o[i] - lo;
+			m[2*i + 1] = -1;
+		}
+		for (i = MAX(0, width - 8); i < width; i++)
+			last = MAX(last, o[i]);
+		mask[p] = _mm_loadu_si128((const __m128i *)m);
+		base[p] = lo;
+		step[p] = 8 / d->width * d->bytes[d->plane[p]];
+		while (groups > 0 && base[p] + (groups - 1) * step[p] + 16 > last + 1)
+			groups--;
+	}
+
+	for (g = 0; g < groups; g++)
+		for (p = 0; p < 3; p++) {
+			__m128i v = _mm_loadu_si128((const __m128i *)(row[p] + base[p] + g * step[p]));
+			_mm_storeu_si128((__m128i *)(lane[p] + 8 * g), _mm_shuffle_epi8(v, mask[p]));
+		}
+
+	return groups * 8;
+}
+#endif
+
+/* Convert any layout with a descriptor. The offset of every sample of a
+ * row is computed once, a row is then gathered into lanes and converted
+ * like the 10 bit formats. */
+static void yuv_desc_to_rgb(const struct format_info *info, const struct yuv_desc *d,
+			    const struct planes *pl, int size[2], unsigned char *rgb, int swap)
+{
+	int width = size[0], height = size[1];
+	int *offsets, *yo, *uo, *vo;
+	short *lanes, *ly, *lu, *lv;
+	int p, x, y;
+
+	if (width % d->width || height % d->vsub)
+		error("%s needs a size in whole blocks of %ix%i", info->name, d->width, d->vsub);
+
+	offsets = xalloc(width * 3 * sizeof(*offsets));
+	yo = offsets;
+	uo = offsets + width;
+	vo = offsets + 2 * width;
+	desc_offsets(d, width, yo, uo, vo);
+
+	lanes = xalloc(width * 3 * sizeof(*lanes));
+	ly = lanes;
+	lu = lanes + width;
+	lv = lanes + 2 * width;
+	for (y = 0; y < height; y++) {
+		const unsigned char *row[3];
+
+		for (p = 0; p < 3; p++)
+			row[p] = desc_row(d, pl, p, y);
+		x = 0;
+#ifdef YUV_SSSE3
+		if (__builtin_cpu_supports("ssse3")) {
+			const int *off[3] = { yo, uo, vo };
+			short *lane[3] = { ly, lu, lv };
+			x = desc_gather_ssse3(d, row, off, lane, width);
+		}
+#endif
+		for (; x < width; x++) {
+			ly[x] = row[0][yo[x]];
+			lu[x] = row[1][uo[x]];
+			lv[x] = row[2][vo[x]];
+		}
+		yuv_lanes_to_rgb(ly, lu, lv, width, 8, rgb + (size_t)y * width * out_bpp, swap);
+	}
+
+	free(lanes);
+	free(offsets);
+}
+
+/*
+ * Direct YUV to YUV repacking
+ *
+ * Luma is moved sample by sample. Chroma is resampled to the output
+ * subsampling with a box filter: every output chroma sample is the mean
+ * of the input chroma of the pixels it covers, so 4:2:2 to 4:2:0 averages
+ * pairs of rows and 4:2:0 to 4:2:2 repeats them. Every row is gathered
+ * into Y, Cb and Cr lanes of one sample per pixel. Chroma lanes are summed
+ * over the rows of an output chroma row, the sums are then averaged over
+ * the columns of every output sample and the lanes are interleaved into
+ * the output planes. Where the CPU has SSSE3, every step works on eight
+ * pixels at a time, the scalar loops handle the rest of a row.
+ */
+#ifdef YUV_SSSE3
+/* Add the chroma lane of a row to the sums of its output chroma row */
+YUV_SSSE3_FUNC
+static int repack_sum_ssse3(unsigned short *sum, const short *lane, int width, int first)
+{
+	int x;
+
+	for (x = 0; x + 8 <= width; x += 8) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(lane + x));
+		if (!first)
+			v = _mm_add_epi16(v, _mm_loadu_si128((const __m128i *)(sum + x)));
+		_mm_storeu_si128((__m128i *)(sum + x), v);
+	}
+
+	return x;
+}
+
+/* Average the sums of hsub neighbouring pixels into eight output samples
+ * per iteration: phaddw adds neighbouring pairs, once for 2:1 and twice
+ * for 4:1 */
+YUV_SSSE3_FUNC
+static int repack_average_ssse3(const unsigned short *sum, unsigned char *out, int samples,
+				int hsub, int n)
+{
+	const __m128i round = _mm_set1_epi16(n / 2);
+	int shift = __builtin_ctz(n);
+	int k;
+
+	for (k = 0; k + 8 <= samples; k += 8) {
+		const __m128i *p = (const __m128i *)(sum + k * hsub);
+		__m128i v = _mm_loadu_si128(p);
+
+		if (hsub == 2)
+			v = _mm_hadd_epi16(v, _mm_loadu_si128(p + 1));
+		else if (hsub == 4)
+			v = _mm_hadd_epi16(_mm_hadd_epi16(v, _mm_loadu_si128(p + 1)),
+					   _mm_hadd_epi16(_mm_loadu_si128(p + 2),
+							  _mm_loadu_si128(p + 3)));
+		v = _mm_srli_epi16(_mm_add_epi16(v, round), shift);
+		_mm_storel_epi64((__m128i *)(out + k), _mm_packus_epi16(v, v));
+	}
+
+	return k;
+}
+
+/* Interleave eight pixels per iteration into their block of a plane, with
+ * one shuffle per component in the plane. The 16 byte store runs into the
+ * next block, which the next iteration or the scalar code after the loop
+ * writes over, so stop while it would still run past the row. Nothing is
+ * done unless the components fill every byte of a block. */
+YUV_SSSE3_FUNC
+static int repack_interleave_ssse3(const struct yuv_desc *d, int plane, unsigned char *row,
+				   const int *off[3], const short *ly, const unsigned char *chroma[3],
+				   int width, int row_bytes)
+{
+	int step = 8 / d->width * d->bytes[plane];
+	signed char m[3][16];
+	__m128i mask[3];
+	int used = 0, c, i, g;
+
+	if (width < 8 || step > 16)
+		return 0;
+	memset(m, -1, sizeof(m));
+	for (c = 0; c < 3; c++) {
+		int samples = c ? 8 / d->hsub : 8, sub = c ? d->hsub : 1;
+
+		if (d->plane[c] != plane || (c && !chroma[c]))
+			continue;
+		for (i = 0; i < samples; i++) {
+			m[c][off[c][i * sub]] = i;
+			used += 1;
+		}
+		mask[c] = _mm_loadu_si128((const __m128i *)m[c]);
+	}
+	if (used != step)
+		return 0;
+
+	for (g = 0; 8 * g + 8 <= width && g * step + 16 <= row_bytes; g++) {
+		__m128i v = _mm_setzero_si128(), s;
+
+		for (c = 0; c < 3; c++) {
+			if (d->plane[c] != plane || (c && !chroma[c]))
+				continue;
+			if (c == 0) {
+				s = _mm_loadu_si128((const __m128i *)(ly + 8 * g));
+				s = _mm_packus_epi16(s, s);
+			} else {
+				s = _mm_loadl_epi64((const __m128i *)(chroma[c] + 8 / d->hsub * g));
 			}
+			v = _mm_or_si128(v, _mm_shuffle_epi8(s, mask[c]));
 		}
-		break;
+		_mm_storeu_si128((__m128i *)(row + g * step), v);
+	}
+
+	return 8 * g;
+}
+#endif
+
+static void yuv_repack(const struct yuv_desc *in, const struct planes *src,
+		       const struct yuv_desc *out, const struct planes *dst, int size[2])
+{
+	int width = size[0], height = size[1];
+	int hsub = out->hsub, vsub = out->vsub, n = hsub * vsub;
+	int *offsets, *iy, *iu, *iv, *oy, *ou, *ov;
+	short *lanes, *ly, *lu, *lv;
+	unsigned short *sums, *su, *sv;
+	unsigned char *cu, *cv;
+	int c, p, x, y;
+
+	offsets = xalloc(width * 6 * sizeof(*offsets));
+	iy = offsets;
+	iu = offsets + width;
+	iv = offsets + 2 * width;
+	oy = offsets + 3 * width;
+	ou = offsets + 4 * width;
+	ov = offsets + 5 * width;
+	desc_offsets(in, width, iy, iu, iv);
+	desc_offsets(out, width, oy, ou, ov);
+
+	lanes = xalloc(width * 3 * sizeof(*lanes));
+	ly = lanes;
+	lu = lanes + width;
+	lv = lanes + 2 * width;
+	sums = xalloc(width * 2 * sizeof(*sums));
+	su = sums;
+	sv = sums + width;
+	/* The vector loads of the last output chroma samples run on by 8 */
+	cu = xalloc((width / hsub + 8) * 2);
+	cv = cu + width / hsub + 8;
+
+	for (y = 0; y < height; y++) {
+		const unsigned char *row[3];
+		const int *ioff[3] = { iy, iu, iv }, *ooff[3] = { oy, ou, ov };
+		const unsigned char *chroma[3] = { NULL, NULL, NULL };
+		int first = y % vsub == 0;
+
+		for (c = 0; c < 3; c++)
+			row[c] = desc_row(in, src, c, y);
+		x = 0;
+#ifdef YUV_SSSE3
+		if (__builtin_cpu_supports("ssse3")) {
+			short *lane[3] = { ly, lu, lv };
+			x = desc_gather_ssse3(in, row, ioff, lane, width);
+		}
+#endif
+		for (; x < width; x++) {
+			ly[x] = row[0][iy[x]];
+			lu[x] = row[1][iu[x]];
+			lv[x] = row[2][iv[x]];
+		}
+
+		for (c = 1; c < 3; c++) {
+			unsigned short *sum = c == 1 ? su : sv;
+			const short *lane = c == 1 ? lu : lv;
+
+			x = 0;
+#ifdef YUV_SSSE3
+			if (__builtin_cpu_supports("ssse3"))
+				x = repack_sum_ssse3(sum, lane, width, first);
+#endif
+			for (; x < width; x++)
+				sum[x] = first ? lane[x] : sum[x] + lane[x];
+		}
+
+		if (y % vsub == vsub - 1) {
+			for (c = 1; c < 3; c++) {
+				const unsigned short *sum = c == 1 ? su : sv;
+				unsigned char *avg = c == 1 ? cu : cv;
+				int k = 0, i;
+
+#ifdef YUV_SSSE3
+				if (__builtin_cpu_supports("ssse3"))
+					k = repack_average_ssse3(sum, avg, width / hsub, hsub, n);
+#endif
+				for (; k < width / hsub; k++) {
+					int v = n / 2;
+					for (i = 0; i < hsub; i++)
+						v += sum[k * hsub + i];
+					avg[k] = v / n;
+				}
+			}
+			chroma[1] = cu;
+			chroma[2] = cv;
+		}
+
+		for (p = 0; p < desc_planes(out); p++) {
+			unsigned char *w;
+
+			/* Chroma planes are written once per output chroma row */
+			if (p != out->plane[0] && !chroma[1])
+				continue;
+			c = p == out->plane[0] ? 0 : out->plane[1] == p ? 1 : 2;
+			w = desc_row(out, dst, c, y);
+			x = 0;
+#ifdef YUV_SSSE3
+			if (__builtin_cpu_supports("ssse3"))
+				x = repack_interleave_ssse3(out, p, w, ooff, ly, chroma, width,
+							    desc_row_bytes(out, size, p));
+#endif
+			for (; x < width; x++) {
+				if (p == out->plane[0])
+					w[oy[x]] = ly[x];
+				if (x % hsub || !chroma[1])
+					continue;
+				if (p == out->plane[1])
+					w[ou[x]] = cu[x / hsub];
+				if (p == out->plane[2])
+					w[ov[x]] = cv[x / hsub];
+			}
+		}
+	}
+
+	free(cu);
+	free(sums);
+	free(lanes);
+	free(offsets);
+}
+
+/*
+ * Multi-planar input
+ *
+ * The planes of a frame may come from separate files, or from regions of
+ * files given by an offset and a stride, as multi-planar buffers are
+ * dumped. Each plane is read into a buffer of its own and handed to the
+ * descriptor engine as it is. Frame n of a plane follows frame n-1 of the
+ * same plane.
+ */
+struct plane_source {
+	char *file;
+	long long offset;
+	int stride;			/* 0 if rows are not padded */
+};
+
+static struct plane_source plane_src[3];
+static int plane_count;
+
+static int plane_stride(const struct yuv_desc *d, int size[2], int plane)
+{
+	int row = desc_row_bytes(d, size, plane);
+	int stride = plane_src[plane].stride;
+
+	if (stride && stride < row) error("plane %i stride is less than %i bytes", plane, row);
+	return stride ? stride : row;
+}
+
+/* Check the planes against the format and return the number of frames */
+static unsigned int plane_frames(const struct format_info *info, int size[2])
+{
+	const struct yuv_desc *d = get_yuv_desc(info->fmt);
+	unsigned int frames = ~0u;
+	int p;
+
+	if (!d) error("format %s can not be read from planes", info->name);
+	if (plane_count != desc_planes(d))
+		error("format %s has %i planes", info->name, desc_planes(d));
+	if (size[0] <= 0 || size[1] <= 0) error("planes need the image size");
+
+	for (p = 0; p < plane_count; p++) {
+		int stride = plane_stride(d, size, p), rows = desc_rows(d, size, p);
+		long long length = (long long)(rows - 1) * stride + desc_row_bytes(d, size, p);
+		long long file_size;
+		FILE *f = fopen(plane_src[p].file, "rb");
+
+		if (!f) error("fopen failed");
+		file_size = file_length(f) - plane_src[p].offset;
+		fclose(f);
+		if (file_size < length) error("out of input data in plane %i", p);
+		frames = MIN(frames, (file_size - length) / ((long long)rows * stride) + 1);
+	}
+	return frames;
+}
+
+/* Read the planes of a frame into buffers from the frame arena */
+static void read_planes(const struct format_info *info, int framenum, int size[2],
+			struct planes *pl)
+{
+	const struct yuv_desc *d = get_yuv_desc(info->fmt);
+	int p;
+
+	for (p = 0; p < plane_count; p++) {
+		int stride = plane_stride(d, size, p), rows = desc_rows(d, size, p);
+		size_t length = (size_t)(rows - 1) * stride + desc_row_bytes(d, size, p);
+		FILE *f = fopen(plane_src[p].file, "rb");
+
+		if (!f) error("fopen failed");
+		if (fseeko(f, plane_src[p].offset + (long long)framenum * rows * stride, SEEK_SET))
+			error("fseek");
+		pl->base[p] = arena_alloc(length);
+		pl->stride[p] = stride;
+		if (fread(pl->base[p], length, 1, f) != 1)
+			error("out of input data in plane %i", p);
+		fclose(f);
+	}
+}
+
+static void free_planes(struct planes *pl)
+{
+	int p;
+
+	for (p = 0; p < 3; p++)
+		arena_free(pl->base[p]);
+	memset(pl, 0, sizeof(*pl));
+}
+
+static void planes_to_rgb(const struct format_info *info, const struct planes *pl, int size[2],
+			  unsigned char *rgb)
+{
+	yuv_desc_to_rgb(info, get_yuv_desc(info->fmt), pl, size, rgb, swaprb);
+}
+
+/* Convert a rectangle of 4:2:0 Y/CbCr. Rows are strided, so a rectangle
+ * may be a tile of a plane as well as a whole NV12 image. */
+static void nv12_rect_to_rgb(const unsigned char *luma, int luma_stride,
+			     const unsigned char *chroma, int chroma_stride,
+			     unsigned char *rgb, int rgb_stride, int width, int height, int swap)
+{
+	const struct yuv_matrix m = *matrix;
+	int ro = swap ? 2 : 0, bo = 2 - ro;
+	int x, y;
+
+	for (y = 0; y < height; y++) {
+		const unsigned char *l = luma + y * luma_stride;
+		const unsigned char *c = chroma + (y / 2) * chroma_stride;
+		unsigned char *out = rgb + y * rgb_stride;
+
+		for (x = 0; x < width; x++) {
+			int r, g, b;
+			yuv_to_rgb_matrix(&m, 8, 8, l[x], c[x & ~1], c[x | 1], &r, &g, &b);
+			out[3*x + ro] = r;
+			out[3*x + 1] = g;
+			out[3*x + bo] = b;
+		}
+	}
+}
+
+/* Memory index of tile x, y of a plane. NV12MT tiles go in Z shapes over
+ * two rows of tiles, flipped every other pair of columns; a last unpaired
+ * row is in raster order. */
+static int tile_index(int zflip, int x, int y, int x_tiles, int y_tiles)
+{
+	int i;
+
+	if (!zflip)
+		return y * x_tiles + x;
+	i = (y & ~1) * x_tiles + x;
+	if (y & 1)
+		i += (x & ~3) + 2;
+	else if ((y_tiles & 1) == 0 || y != y_tiles - 1)
+		i += (x + 2) & ~3;
+	return i;
+}
+
+/*
+ * Macroblock tiled NV12: HM12 and NV12MT_16X16 hold both planes in 16x16
+ * tiles in raster order, NV12MT in 64x32 tiles in Z order. A chroma tile
+ * covers two luma tiles on top of each other. The luma tiles are walked in
+ * memory order and converted straight from the tiles, each along with the
+ * half of its chroma tile, so both planes are read a contiguous tile at a
+ * time and no linear copy of the image is made.
+ */
+static void nv12_tiled_to_rgb(const struct format_info *info, unsigned char *src, int size[2],
+			      unsigned char *rgb, int swap)
+{
+	int zflip = info->fmt == V4L2_PIX_FMT_NV12MT;
+	int tw = zflip ? 64 : 16, th = zflip ? 32 : 16;
+	int x_tiles = size[0] / tw, y_tiles = size[1] / th;
+	int uv_tiles = y_tiles / 2;
+	int rgb_stride = size[0] * 3;
+	unsigned char *chroma = src + (size_t)size[0] * size[1];
+	int *tiles;
+	int n, x, y;
+
+	/* Zflip tiles come in pairs of columns, and every tile of chroma
+	 * covers two rows of luma tiles */
+	if (size[0] % (zflip ? 2 * tw : tw) || size[1] % (2 * th))
+		error("%s needs a size in whole blocks of %ix%i", info->name,
+		      zflip ? 2 * tw : tw, 2 * th);
+
+	/* Tile of every memory index */
+	tiles = xalloc(x_tiles * y_tiles * sizeof(*tiles));
+	for (y = 0; y < y_tiles; y++)
+		for (x = 0; x < x_tiles; x++)
+			tiles[tile_index(zflip, x, y, x_tiles, y_tiles)] = y * x_tiles + x;
+
+	for (n = 0; n < x_tiles * y_tiles; n++) {
+		const unsigned char *luma = src + (size_t)n * tw * th;
+		const unsigned char *c;
+
+		x = tiles[n] % x_tiles;
+		y = tiles[n] / x_tiles;
+		c = chroma + (size_t)tile_index(zflip, x, y / 2, x_tiles, uv_tiles) * tw * th
+		    + (y & 1) * (th / 2) * tw;
+		nv12_rect_to_rgb(luma, tw, c, tw, rgb + (size_t)y * th * rgb_stride + x * tw * 3,
+				 rgb_stride, tw, th, swap);
+	}
+
+	free(tiles);
+}
+
+static void raw_to_rgb(const struct format_info *info,
+		       unsigned char *src, int src_size[2], unsigned char *rgb)
+{
+	unsigned int src_stride = src_size[0] * info->bpp / 8;
+	unsigned int rgb_stride = src_size[0] / bin * out_bpp;
+	unsigned char *src_luma, *src_chroma;
+	unsigned char *src_cb, *src_cr;
+	unsigned int pixel;
+	int r, g, b, a, cr, cb;
+	int src_x, src_y;
+	int dst_x, dst_y;
+	int color_pos = 1;
+	int y_pos;
+	int cb_pos;
+	int cr_pos;
+	int shift = 0;
+	int depth;
+	int swap = swaprb;
+	struct planes planes;
+
+	switch (info->fmt) {
+	case V4L2_PIX_FMT_VYUY:
+	case V4L2_PIX_FMT_YVYU:
+	case V4L2_PIX_FMT_UYVY:
+	case V4L2_PIX_FMT_YUYV:		/* Packed YUV 4:2:2 */
+		y_pos = info->y_pos;
+		cb_pos = info->cb_pos;
+		cr_pos = (info->cb_pos + 2) % 4;
 
-	case V4L2_PIX_FMT_Y12:
-		shift += 2;
-	case V4L2_PIX_FMT_Y10:
-		shift += 2;
 		for (src_y = 0, dst_y = 0; dst_y < src_size[1]; src_y++, dst_y++) {
 			for (src_x = 0, dst_x = 0; dst_x < src_size[0]; ) {
-				a = (src[src_y*src_stride + src_x*2+0] |
-				     (src[src_y*src_stride + src_x*2+1] << 8)) >> shift;
-				rgb[dst_y*rgb_stride+3*dst_x+0] = a;
-				rgb[dst_y*rgb_stride+3*dst_x+1] = a;
-				rgb[dst_y*rgb_stride+3*dst_x+2] = a;
-				src_x++;
+				cb = src[src_y*src_stride + src_x*4 + cb_pos];
+				cr = src[src_y*src_stride + src_x*4 + cr_pos];
+
+				a  = src[src_y*src_stride + src_x*4 + y_pos];
+				yuv_to_rgb_matrix(matrix, 8, 8, a, cb, cr, &r, &g, &b);
+				rgb[dst_y*rgb_stride+3*dst_x+0] = swap ? b : r;
+				rgb[dst_y*rgb_stride+3*dst_x+1] = g;
+				rgb[dst_y*rgb_stride+3*dst_x+2] = swap ? r : b;
 				dst_x++;
-			}
+
+				a  = src[src_y*src_stride + src_x*4 + y_pos + 2];
+				yuv_to_rgb_matrix(matrix, 8, 8, a, cb, cr, &r, &g, &b);
+				rgb[dst_y*rgb_stride+3*dst_x+0] = swap ? b : r;
+				rgb[dst_y*rgb_stride+3*dst_x+1] = g;
+				rgb[dst_y*rgb_stride+3*dst_x+2] = swap ? r : b;
+				dst_x++;
+
+				src_x++;
+			}
+		}
+		break;
+
+	case V4L2_PIX_FMT_NV21:
+		color_pos = 0;
+	case V4L2_PIX_FMT_NV12:
+		src_luma = src;
+		src_chroma = &src[src_size[0] * src_size[1]];
+		src_stride = src_stride * 8 / 12;
+
+		for (src_y = 0, dst_y = 0; dst_y < src_size[1]; src_y++, dst_y++) {
+			cr = 0;
+
+			for (dst_x = 0, src_x = 0; dst_x < src_size[0]; ) {
+				a  = src_luma[dst_y*src_stride + dst_x];
+				cb = src_chroma[(dst_y/2)*src_stride + dst_x + 1 - color_pos];
+				yuv_to_rgb_matrix(matrix, 8, 8, a, cb, cr, &r, &g, &b);
+				rgb[src_y*rgb_stride+3*src_x+0] = swap ? b : r;
+				rgb[src_y*rgb_stride+3*src_x+1] = g;
+				rgb[src_y*rgb_stride+3*src_x+2] = swap ? r : b;
+				src_x++;
+				dst_x++;
+
+				a  = src_luma[dst_y*src_stride + dst_x];
+				cr = src_chroma[(dst_y/2)*src_stride + dst_x + color_pos - 1];
+				yuv_to_rgb_matrix(matrix, 8, 8, a, cb, cr, &r, &g, &b);
+				rgb[src_y*rgb_stride+3*src_x+0] = swap ? b : r;
+				rgb[src_y*rgb_stride+3*src_x+1] = g;
+				rgb[src_y*rgb_stride+3*src_x+2] = swap ? r : b;
+				src_x++;
+				dst_x++;
+			}
+		}
+		break;
+
+	case V4L2_PIX_FMT_NV16:
+	case V4L2_PIX_FMT_NV61:
+		src_luma = src;
+		src_chroma = &src[src_size[0] * src_size[1]];
+		src_stride = src_stride * 8 / 16;
+
+		cb_pos = info->cb_pos;
+		cr_pos = 1 - info->cb_pos;
+
+		for (src_y = 0, dst_y = 0; dst_y < src_size[1]; src_y++, dst_y++) {
+			for (dst_x = 0, src_x = 0; dst_x < src_size[0]; ) {
+				cb = src_chroma[dst_y*src_stride + dst_x + cb_pos];
+				cr = src_chroma[dst_y*src_stride + dst_x + cr_pos];
+
+				a  = src_luma[dst_y*src_stride + dst_x];
+				yuv_to_rgb_matrix(matrix, 8, 8, a, cb, cr, &r, &g, &b);
+				rgb[src_y*rgb_stride+3*src_x+0] = swap ? b : r;
+				rgb[src_y*rgb_stride+3*src_x+1] = g;
+				rgb[src_y*rgb_stride+3*src_x+2] = swap ? r : b;
+				src_x++;
+				dst_x++;
+
+				a  = src_luma[dst_y*src_stride + dst_x];
+				yuv_to_rgb_matrix(matrix, 8, 8, a, cb, cr, &r, &g, &b);
+				rgb[src_y*rgb_stride+3*src_x+0] = swap ? b : r;
+				rgb[src_y*rgb_stride+3*src_x+1] = g;
+				rgb[src_y*rgb_stride+3*src_x+2] = swap ? r : b;
+				src_x++;
+				dst_x++;
+			}
+		}
+		break;
+
+	case V4L2_PIX_FMT_P010:
+	case V4L2_PIX_FMT_P210:
+	case V4L2_PIX_FMT_Y210:
+		yuv10_to_rgb(info, src, src_size, rgb, swap);
+		break;
+
+	case V4L2_PIX_FMT_HM12:
+	case V4L2_PIX_FMT_NV12MT_16X16:
+	case V4L2_PIX_FMT_NV12MT:
+		nv12_tiled_to_rgb(info, src, src_size, rgb, swap);
+		break;
+
+	case V4L2_PIX_FMT_Y41P:
+	case V4L2_PIX_FMT_YYUV:
+	case V4L2_PIX_FMT_YUV410:
+	case V4L2_PIX_FMT_YVU410:
+		desc_contiguous(get_yuv_desc(info->fmt), src, src_size, &planes);
+		yuv_desc_to_rgb(info, get_yuv_desc(info->fmt), &planes, src_size, rgb, swap);
+		break;
+
+	case V4L2_PIX_FMT_YUV411P:
+		src_luma = src;
+		src_cb = &src[src_size[0] * src_size[1]];
+		src_cr = &src[src_size[0] * src_size[1] / 4 * 5];
+		src_stride = src_stride * 8 / 12;
+
+		for (src_y = 0, dst_y = 0; dst_y < src_size[1]; src_y++, dst_y++) {
+			for (dst_x = 0, src_x = 0; dst_x < src_size[0]; ) {
+				a  = src_luma[dst_y*src_stride + dst_x];
+				cb = src_cb[dst_y*src_stride/4 + dst_x/4];
+				cr = src_cr[dst_y*src_stride/4 + dst_x/4];
+
+				yuv_to_rgb_matrix(matrix, 8, 8, a, cb, cr, &r, &g, &b);
+				rgb[src_y*rgb_stride+3*src_x+0] = swap ? b : r;
+				rgb[src_y*rgb_stride+3*src_x+1] = g;
+				rgb[src_y*rgb_stride+3*src_x+2] = swap ? r : b;
+				src_x++;
+				dst_x++;
+			}
+		}
+		break;
+
+	case V4L2_PIX_FMT_YUV420:
+	case V4L2_PIX_FMT_YVU420:
+		src_luma = src;
+		if (info->cb_pos == 0) {
+			src_cb = &src[src_size[0] * src_size[1]];
+			src_cr = &src[src_size[0] * src_size[1] / 4 * 5];
+		} else {
+			src_cr = &src[src_size[0] * src_size[1]];
+			src_cb = &src[src_size[0] * src_size[1] / 4 * 5];
+		}
+		src_stride = src_stride * 8 / 12;
+
+		for (src_y = 0, dst_y = 0; dst_y < src_size[1]; src_y++, dst_y++) {
+			for (dst_x = 0, src_x = 0; dst_x < src_size[0]; ) {
+				a  = src_luma[dst_y*src_stride + dst_x];
+				cb = src_cb[(dst_y/2)*src_stride/2 + dst_x/2];
+				cr = src_cr[(dst_y/2)*src_stride/2 + dst_x/2];
+
+				yuv_to_rgb_matrix(matrix, 8, 8, a, cb, cr, &r, &g, &b);
+				rgb[src_y*rgb_stride+3*src_x+0] = swap ? b : r;
+				rgb[src_y*rgb_stride+3*src_x+1] = g;
+				rgb[src_y*rgb_stride+3*src_x+2] = swap ? r : b;
+				src_x++;
+				dst_x++;
+			}
+		}
+		break;
+
+	case V4L2_PIX_FMT_YUV422P:
+	case V4L2_PIX_FMT_YVU422M:
+		src_luma = src;
+		if (info->cb_pos == 0) {
+			src_cb = &src[src_size[0] * src_size[1]];
+			src_cr = &src[src_size[0] * src_size[1] / 2 * 3];
+		} else {
+			src_cr = &src[src_size[0] * src_size[1]];
+			src_cb = &src[src_size[0] * src_size[1] / 2 * 3];
+		}
+		src_stride = src_stride * 8 / 16;
+
+		for (src_y = 0, dst_y = 0; dst_y < src_size[1]; src_y++, dst_y++) {
+			for (dst_x = 0, src_x = 0; dst_x < src_size[0]; ) {
+				a  = src_luma[dst_y*src_stride + dst_x];
+				cb = src_cb[dst_y*src_stride/2 + dst_x/2];
+				cr = src_cr[dst_y*src_stride/2 + dst_x/2];
+
+				yuv_to_rgb_matrix(matrix, 8, 8, a, cb, cr, &r, &g, &b);
+				rgb[src_y*rgb_stride+3*src_x+0] = swap ? b : r;
+				rgb[src_y*rgb_stride+3*src_x+1] = g;
+				rgb[src_y*rgb_stride+3*src_x+2] = swap ? r : b;
+				src_x++;
+				dst_x++;
+			}
+		}
+		break;
+
+	case V4L2_PIX_FMT_YUV444M:
+	case V4L2_PIX_FMT_YVU444M:
+		src_luma = src;
+		if (info->cb_pos == 0) {
+			src_cb = &src[src_size[0] * src_size[1]];
+			src_cr = &src[src_size[0] * src_size[1] * 2];
+		} else {
+			src_cr = &src[src_size[0] * src_size[1]];
+			src_cb = &src[src_size[0] * src_size[1] * 2];
+		}
+		src_stride = src_stride * 8 / 24;
+
+		for (src_y = 0, dst_y = 0; dst_y < src_size[1]; src_y++, dst_y++) {
+			for (dst_x = 0, src_x = 0; dst_x < src_size[0]; ) {
+				a  = src_luma[dst_y*src_stride + dst_x];
+				cb = src_cb[dst_y*src_stride + dst_x];
+				cr = src_cr[dst_y*src_stride + dst_x];
+
+				yuv_to_rgb_matrix(matrix, 8, 8, a, cb, cr, &r, &g, &b);
+				rgb[src_y*rgb_stride+3*src_x+0] = swap ? b : r;
+				rgb[src_y*rgb_stride+3*src_x+1] = g;
+				rgb[src_y*rgb_stride+3*src_x+2] = swap ? r : b;
+				src_x++;
+				dst_x++;
+			}
+		}
+		break;
+
+	case V4L2_PIX_FMT_Y12:
+		shift += 2;
+	case V4L2_PIX_FMT_Y10:
+		shift += 2;
+		for (src_y = 0, dst_y = 0; dst_y < src_size[1]; src_y++, dst_y++) {
+			for (src_x = 0, dst_x = 0; dst_x < src_size[0]; ) {
+				a = (src[src_y*src_stride + src_x*2+0] |
+				     (src[src_y*src_stride + src_x*2+1] << 8)) >> shift;
+				rgb[dst_y*rgb_stride+3*dst_x+0] = a;
+				rgb[dst_y*rgb_stride+3*dst_x+1] = a;
+				rgb[dst_y*rgb_stride+3*dst_x+2] = a;
+				src_x++;
+				dst_x++;
+			}
+		}
+		break;
+
+	case V4L2_PIX_FMT_GREY:
+		for (src_y = 0, dst_y = 0; dst_y < src_size[1]; src_y++, dst_y++) {
+			for (src_x = 0, dst_x = 0; dst_x < src_size[0]; ) {
+				a = src[src_y*src_stride + src_x];
+				rgb[dst_y*rgb_stride+3*dst_x+0] = a;
+				rgb[dst_y*rgb_stride+3*dst_x+1] = a;
+				rgb[dst_y*rgb_stride+3*dst_x+2] = a;
+				src_x++;
+				dst_x++;
+			}
+		}
+		break;
+
+	case V4L2_PIX_FMT_SBGGR16:
+	case V4L2_PIX_FMT_SGBRG16:
+	case V4L2_PIX_FMT_SGRBG16:
+	case V4L2_PIX_FMT_SRGGB16:
+	case V4L2_PIX_FMT_SBGGR12:
+	case V4L2_PIX_FMT_SGBRG12:
+	case V4L2_PIX_FMT_SGRBG12:
+	case V4L2_PIX_FMT_SRGGB12:
+	case V4L2_PIX_FMT_SBGGR10:
+	case V4L2_PIX_FMT_SGBRG10:
+	case V4L2_PIX_FMT_SGRBG10:
+	case V4L2_PIX_FMT_SRGGB10:
+		/* The demosaic works on the samples as they are, only the
+		 * high bits layout and brightness need a pass over them */
+		depth = sample_depth(info);
+		if (highbits || brightness != 256) {
+			for (dst_y=0; dst_y<src_size[1]; dst_y++) {
+				for (dst_x=0; dst_x<src_size[0]; dst_x++) {
+					unsigned short *p = (unsigned short *)&(src[src_stride*dst_y+dst_x*2]);
+					long v = *p;
+					if (highbits)
+						v >>= 6;
+					if (v >= (1<<depth))
+						printf("WARNING: bayer image pixel values out of range (%li)\n", v);
+					v *= brightness;
+					v >>= 8;
+					if (v >= (1<<depth)) v = (1<<depth)-1;
+					*p = v;
+				}
+			}
+		}
+
+		if (bin > 1)
+			qc_imag_bay2rgb_bin(src, src_stride, rgb, rgb_stride, src_size[0], src_size[1],
+					    out_bpp, depth, bin, bayer_phase(info->fmt), swap);
+		else
+			qc_imag_bay2rgb16(src, src_stride, rgb, rgb_stride, src_size[0], src_size[1], out_bpp,
+					  depth, bayer_phase(info->fmt), swap);
+		break;
+	case V4L2_PIX_FMT_SBGGR10P:
+	case V4L2_PIX_FMT_SGBRG10P:
+	case V4L2_PIX_FMT_SGRBG10P:
+	case V4L2_PIX_FMT_SRGGB10P:
+		if (src_size[0] % 4)
+			error("packed RAW10 width must be a multiple of 4");
+		bayer_packed_to_rgb(info, src, src_stride, src_size, rgb, unpack_raw10p);
+		break;
+	case V4L2_PIX_FMT_SBGGR10DPCM8:
+	case V4L2_PIX_FMT_SGBRG10DPCM8:
+	case V4L2_PIX_FMT_SGRBG10DPCM8:
+	case V4L2_PIX_FMT_SRGGB10DPCM8:
+		bayer_packed_to_rgb(info, src, src_stride, src_size, rgb, unpack_dpcm10_8);
+		break;
+	case V4L2_PIX_FMT_SBGGR12P:
+	case V4L2_PIX_FMT_SGBRG12P:
+	case V4L2_PIX_FMT_SGRBG12P:
+	case V4L2_PIX_FMT_SRGGB12P:
+		if (src_size[0] % 2)
+			error("packed RAW12 width must be a multiple of 2");
+		bayer_packed_to_rgb(info, src, src_stride, src_size, rgb, unpack_raw12p);
+		break;
+	case V4L2_PIX_FMT_SBGGR14P:
+	case V4L2_PIX_FMT_SGBRG14P:
+	case V4L2_PIX_FMT_SGRBG14P:
+	case V4L2_PIX_FMT_SRGGB14P:
+		if (src_size[0] % 4)
+			error("packed RAW14 width must be a multiple of 4");
+		bayer_packed_to_rgb(info, src, src_stride, src_size, rgb, unpack_raw14p);
+		break;
+	case V4L2_PIX_FMT_SBGGR8:
+	case V4L2_PIX_FMT_SGBRG8:
+	case V4L2_PIX_FMT_SGRBG8:
+	case V4L2_PIX_FMT_SRGGB8:
+		if (bin > 1)
+			qc_imag_bay2rgb_bin(src, src_stride, rgb, rgb_stride, src_size[0], src_size[1],
+					    3, 8, bin, bayer_phase(info->fmt), swap);
+		else
+			qc_imag_bay2rgb8(src, src_stride, rgb, rgb_stride, src_size[0], src_size[1], 3,
+					 bayer_phase(info->fmt), swap);
+		break;
+	case V4L2_PIX_FMT_RGB332:
+		for (src_y = 0, dst_y = 0; dst_y < src_size[1]; src_y++, dst_y++) {
+			for (src_x = 0, dst_x = 0; dst_x < src_size[0]; ) {
+				pixel = src[dst_y*src_stride + dst_x];
+				r = (pixel << 0) & 0xe0;
+				g = (pixel << 3) & 0xe0;
+				b = (pixel << 6) & 0xc0;
+				rgb[src_y*rgb_stride+3*src_x+0] = swap ? b : r;
+				rgb[src_y*rgb_stride+3*src_x+1] = g;
+				rgb[src_y*rgb_stride+3*src_x+2] = swap ? r : b;
+				src_x++;
+				dst_x++;
+			}
+		}
+		break;
+	case V4L2_PIX_FMT_RGB555:
+		for (src_y = 0, dst_y = 0; dst_y < src_size[1]; src_y++, dst_y++) {
+			for (src_x = 0, dst_x = 0; dst_x < src_size[0]; ) {
+				pixel = (src[dst_y*src_stride + dst_x*2 + 1] << 8)
+				      | src[dst_y*src_stride + dst_x*2 + 0];
+				r = (pixel >> 7) & 0xf8;
+				g = (pixel >> 2) & 0xf8;
+				b = (pixel << 3) & 0xf8;
+				rgb[src_y*rgb_stride+3*src_x+0] = swap ? b : r;
+				rgb[src_y*rgb_stride+3*src_x+1] = g;
+				rgb[src_y*rgb_stride+3*src_x+2] = swap ? r : b;
+				src_x++;
+				dst_x++;
+			}
+		}
+		break;
+	case V4L2_PIX_FMT_RGB565:
+		for (src_y = 0, dst_y = 0; dst_y < src_size[1]; src_y++, dst_y++) {
+			for (src_x = 0, dst_x = 0; dst_x < src_size[0]; ) {
+				pixel = (src[dst_y*src_stride + dst_x*2 + 1] << 8)
+				      | src[dst_y*src_stride + dst_x*2 + 0];
+				r = (pixel >> 8) & 0xf8;
+				g = (pixel >> 3) & 0xfc;
+				b = (pixel << 3) & 0xf8;
+				rgb[src_y*rgb_stride+3*src_x+0] = swap ? b : r;
+				rgb[src_y*rgb_stride+3*src_x+1] = g;
+				rgb[src_y*rgb_stride+3*src_x+2] = swap ? r : b;
+				src_x++;
+				dst_x++;
+			}
+		}
+		break;
+	case V4L2_PIX_FMT_BGR24:
+		swap = !swap;
+		/* Fallthrough */
+	case V4L2_PIX_FMT_RGB24:
+		for (src_y = 0, dst_y = 0; dst_y < src_size[1]; src_y++, dst_y++) {
+			for (src_x = 0, dst_x = 0; dst_x < src_size[0]; ) {
+				r = src[dst_y*src_stride + dst_x*3 + 0];
+				g = src[dst_y*src_stride + dst_x*3 + 1];
+				b = src[dst_y*src_stride + dst_x*3 + 2];
+				rgb[src_y*rgb_stride+3*src_x+0] = swap ? b : r;
+				rgb[src_y*rgb_stride+3*src_x+1] = g;
+				rgb[src_y*rgb_stride+3*src_x+2] = swap ? r : b;
+				src_x++;
+				dst_x++;
+			}
+		}
+		break;
+	case V4L2_PIX_FMT_BGR32:
+		for (src_y = 0, dst_y = 0; dst_y < src_size[1]; src_y++, dst_y++) {
+			for (src_x = 0, dst_x = 0; dst_x < src_size[0]; ) {
+				r = src[dst_y*src_stride + dst_x*4 + 2];
+				g = src[dst_y*src_stride + dst_x*4 + 1];
+				b = src[dst_y*src_stride + dst_x*4 + 0];
+				rgb[src_y*rgb_stride+3*src_x+0] = swap ? b : r;
+				rgb[src_y*rgb_stride+3*src_x+1] = g;
+				rgb[src_y*rgb_stride+3*src_x+2] = swap ? r : b;
+				src_x++;
+				dst_x++;
+			}
+		}
+		break;
+	case V4L2_PIX_FMT_RGB32:
+		for (src_y = 0, dst_y = 0; dst_y < src_size[1]; src_y++, dst_y++) {
+			for (src_x = 0, dst_x = 0; dst_x < src_size[0]; ) {
+				r = src[dst_y*src_stride + dst_x*4 + 1];
+				g = src[dst_y*src_stride + dst_x*4 + 2];
+				b = src[dst_y*src_stride + dst_x*4 + 3];
+				rgb[src_y*rgb_stride+3*src_x+0] = swap ? b : r;
+				rgb[src_y*rgb_stride+3*src_x+1] = g;
+				rgb[src_y*rgb_stride+3*src_x+2] = swap ? r : b;
+				src_x++;
+				dst_x++;
+			}
+		}
+		break;
+	default:
+		/* Not supported, output black */
+		memset(rgb, 0, rgb_stride * src_size[1]);
+		break;
+	}
+}
+
+/* Planes of a YUV frame, to copy the samples out as they are */
+struct yuv_layout {
+	const char *y4m;		/* Y4M colour space */
+	int planes;			/* 1 for greyscale, else 3 */
+	int hsub, vsub;			/* Chroma subsampling */
+	unsigned char *base[3];		/* Y, Cb, Cr */
+	int step[3];			/* Bytes between samples */
+	int stride[3];			/* Bytes between rows */
+};
+
+static void yuv_plane(struct yuv_layout *l, int plane, unsigned char *base, int step, int stride)
+{
+	l->base[plane] = base;
+	l->step[plane] = step;
+	l->stride[plane] = stride;
+}
+
+/* Describe the planes of a YUV frame in src. Returns -1 for formats
+ * that are not plain YUV. src may be NULL to get the subsampling only. */
+static int yuv_layout(const struct format_info *info, unsigned char *src, int size[2],
+		      struct yuv_layout *l)
+{
+	int w = size[0], h = size[1];
+	unsigned char *cb, *cr;
+
+	l->planes = 3;
+	switch (info->fmt) {
+	case V4L2_PIX_FMT_VYUY:
+	case V4L2_PIX_FMT_YVYU:
+	case V4L2_PIX_FMT_UYVY:
+	case V4L2_PIX_FMT_YUYV:
+		l->y4m = "422";
+		l->hsub = 2;
+		l->vsub = 1;
+		yuv_plane(l, 0, src + info->y_pos, 2, w * 2);
+		yuv_plane(l, 1, src + info->cb_pos, 4, w * 2);
+		yuv_plane(l, 2, src + (info->cb_pos + 2) % 4, 4, w * 2);
+		return 0;
+	case V4L2_PIX_FMT_NV12:
+	case V4L2_PIX_FMT_NV21:
+		l->y4m = "420mpeg2";
+		l->hsub = 2;
+		l->vsub = 2;
+		cb = src + w * h + (info->fmt == V4L2_PIX_FMT_NV21);
+		cr = src + w * h + (info->fmt == V4L2_PIX_FMT_NV12);
+		yuv_plane(l, 0, src, 1, w);
+		yuv_plane(l, 1, cb, 2, w);
+		yuv_plane(l, 2, cr, 2, w);
+		return 0;
+	case V4L2_PIX_FMT_NV16:
+	case V4L2_PIX_FMT_NV61:
+		l->y4m = "422";
+		l->hsub = 2;
+		l->vsub = 1;
+		yuv_plane(l, 0, src, 1, w);
+		yuv_plane(l, 1, src + w * h + info->cb_pos, 2, w);
+		yuv_plane(l, 2, src + w * h + 1 - info->cb_pos, 2, w);
+		return 0;
+	case V4L2_PIX_FMT_YUV411P:
+		l->y4m = "411";
+		l->hsub = 4;
+		l->vsub = 1;
+		yuv_plane(l, 0, src, 1, w);
+		yuv_plane(l, 1, src + w * h, 1, w / 4);
+		yuv_plane(l, 2, src + w * h / 4 * 5, 1, w / 4);
+		return 0;
+	case V4L2_PIX_FMT_YUV420:
+	case V4L2_PIX_FMT_YVU420:
+		l->y4m = "420mpeg2";
+		l->hsub = 2;
+		l->vsub = 2;
+		cb = src + w * h;
+		cr = src + w * h / 4 * 5;
+		break;
+	case V4L2_PIX_FMT_YUV422P:
+	case V4L2_PIX_FMT_YVU422M:
+		l->y4m = "422";
+		l->hsub = 2;
+		l->vsub = 1;
+		cb = src + w * h;
+		cr = src + w * h / 2 * 3;
+		break;
+	case V4L2_PIX_FMT_YUV444M:
+	case V4L2_PIX_FMT_YVU444M:
+		l->y4m = "444";
+		l->hsub = 1;
+		l->vsub = 1;
+		cb = src + w * h;
+		cr = src + w * h * 2;
+		break;
+	case V4L2_PIX_FMT_GREY:
+		l->y4m = "mono";
+		l->planes = 1;
+		l->hsub = 1;
+		l->vsub = 1;
+		yuv_plane(l, 0, src, 1, w);
+		return 0;
+	default:
+		return -1;
+	}
+
+	/* Three planes, Cr first if cb_pos is set */
+	yuv_plane(l, 0, src, 1, w);
+	yuv_plane(l, 1, info->cb_pos ? cr : cb, 1, w / l->hsub);
+	yuv_plane(l, 2, info->cb_pos ? cb : cr, 1, w / l->hsub);
+	return 0;
+}
+
+static void write_pnm_header(FILE *f, int size[2])
+{
+	fprintf(f, "P6\n%i %i\n%i\n", size[0], size[1], out_maxval);
+}
+
+/* Write rows of output. 16 bit samples are byte swapped in place to the
+ * big endian order of PNM, so the buffer can not be written again. */
+static int write_rows(FILE *f, unsigned char *rgb, int width, int rows)
+{
+	size_t n = (size_t)width * rows * out_bpp;
+
+	if (out_bpp == 6)
+		pack_be16((unsigned short *)rgb, rgb, n / 2);
+	return fwrite(rgb, n, 1, f) == 1 ? 0 : -1;
+}
+
+static const char *image_ext[] = {
+	[IMAGE_PNM] = "pnm",
+	[IMAGE_QOI] = "qoi",
+	[IMAGE_PNG] = "png",
+	[IMAGE_PNG_STORED] = "png",
+};
+
+/* Significant bits of the output samples */
+static int image_depth(void)
+{
+	int depth = 8;
+
+	while ((1 << depth) - 1 < out_maxval)
+		depth++;
+	return depth;
+}
+
+/* Start an image in f: a PNM header, or an encoder for other formats */
+static struct encoder *image_begin(FILE *f, int size[2])
+{
+	if (out_format == IMAGE_PNM) {
+		write_pnm_header(f, size);
+		return NULL;
+	}
+	return encoder_create(out_format, size[0], size[1], image_depth(), f);
+}
+
+/* Write the next rows of an image. PNM rows are clobbered as by write_rows(). */
+static void image_rows(FILE *f, struct encoder *e, unsigned char *rgb, int width, int rows)
+{
+	if (e)
+		encoder_rows(e, rgb, rows);
+	else if (write_rows(f, rgb, width, rows))
+		error("write failed");
+}
+
+static void image_end(struct encoder *e)
+{
+	size_t length;
+
+	if (e) {
+		encoder_finish(e, &length);
+		encoder_destroy(e);
+	}
+}
+
+/* An image file being written a few rows at a time */
+struct image_file {
+	FILE *f;
+	struct encoder *e;
+};
+
+static void image_open(struct image_file *img, const char *filename, int size[2])
+{
+	printf("Writing to file `%s'...\n", filename);
+	img->f = fopen(filename, "wb");
+	if (!img->f) error("file open failed");
+	img->e = image_begin(img->f, size);
+}
+
+static void image_close(struct image_file *img)
+{
+	image_end(img->e);
+	if (fclose(img->f)) error("write failed");
+}
+
+static void write_image(const char *filename, unsigned char *rgb, int size[2])
+{
+	struct image_file img;
+
+	image_open(&img, filename, size);
+	image_rows(img.f, img.e, rgb, size[0], size[1]);
+	image_close(&img);
+}
+
+/* Per channel statistics of a converted frame, gathered a few rows at a time */
+struct frame_stats {
+	unsigned int min[3];
+	unsigned int max[3];
+	unsigned int mean[3];
+	unsigned long long sum[3];
+	size_t pixels;
+};
+
+static void frame_stats_begin(struct frame_stats *st)
+{
+	int c;
+
+	for (c = 0; c < 3; c++) {
+		st->min[c] = UINT32_MAX;
+		st->max[c] = 0;
+		st->sum[c] = 0;
+	}
+	st->pixels = 0;
+}
+
+static void frame_stats_rows(struct frame_stats *st, const unsigned char *rgb, size_t stride,
+			     size_t width, int rows)
+{
+	size_t x;
+	int y, c;
+
+	for (y = 0; y < rows; y++, rgb += stride) {
+		for (x = 0; x < width; x++) {
+			for (c = 0; c < 3; c++) {
+				unsigned int v = out_bpp == 6 ? ((const unsigned short *)rgb)[x*3 + c]
+							      : rgb[x*3 + c];
+				st->min[c] = MIN(st->min[c], v);
+				st->max[c] = MAX(st->max[c], v);
+				st->sum[c] += v;
+			}
+		}
+	}
+	st->pixels += width * rows;
+}
+
+static void frame_stats_end(struct frame_stats *st)
+{
+	int c;
+
+	for (c = 0; c < 3; c++)
+		st->mean[c] = st->pixels ? (st->sum[c] + st->pixels / 2) / st->pixels : 0;
+}
+
+static void frame_stats(const unsigned char *rgb, size_t pixels, struct frame_stats *st)
+{
+	frame_stats_begin(st);
+	frame_stats_rows(st, rgb, 0, pixels, 1);
+	frame_stats_end(st);
+}
+
+/* Area downscaling
+ *
+ * A scaler box filters converted rows into an image of its output size
+ * as they are produced, so only a strip of rows at the input resolution
+ * is held at a time. Every output pixel is the mean of the input area
+ * under it, with the input pixels on its edges weighted by the part they
+ * cover. Positions are counted in units of 1 / (in * out) of the image,
+ * where an input pixel is out units wide and an output pixel in units,
+ * so all weights are integers. When downscaling, an input pixel covers
+ * at most two output pixels each way. A scaler to the input size just
+ * copies the rows. The output rows go to an image buffer, or to an image
+ * file as each is done.
+ *
+ * Combined with --bin, Bayer input is binned before scaling, so no
+ * demosaic is done at all.
+ */
+
+/* Converted input rows, of any width, kept per strip */
+#define SCALE_STRIP_BYTES	(256 * 1024)
+
+struct scaler {
+	int in[2], out[2];
+	int y;				/* Input rows taken */
+	int oy;				/* Output row being summed */
+	int *col;			/* Output column of each input column */
+	int *weight;			/* Part of an input column in that output column */
+	unsigned long long *row;	/* Input row summed into output columns */
+	unsigned long long *acc[2];	/* Output rows oy and oy + 1 */
+	unsigned char *rgb;
+	struct image_file *img;		/* Instead of rgb */
+	unsigned char *line;		/* Output row for img */
+	struct frame_stats *stats;	/* Of the output rows, or NULL */
+};
+
+static void scale_begin(struct scaler *sc, const int in[2], const int out[2], unsigned char *rgb,
+			struct image_file *img)
+{
+	int x, n;
+
+	if (out[0] > in[0] || out[1] > in[1])
+		error("can not scale the %ix%i image up to %ix%i", in[0], in[1], out[0], out[1]);
+
+	memset(sc, 0, sizeof(*sc));
+	sc->in[0] = in[0];
+	sc->in[1] = in[1];
+	sc->out[0] = out[0];
+	sc->out[1] = out[1];
+	sc->rgb = rgb;
+	sc->img = img;
+	if (img)
+		sc->line = xalloc((size_t)out[0] * out_bpp);
+	if (in[0] == out[0] && in[1] == out[1])
+		return;
+
+	sc->col = xalloc(in[0] * sizeof(*sc->col));
+	sc->weight = xalloc(in[0] * sizeof(*sc->weight));
+	for (x = 0; x < in[0]; x++) {
+		sc->col[x] = (long long)x * out[0] / in[0];
+		sc->weight[x] = MIN((long long)(sc->col[x] + 1) * in[0], (long long)(x + 1) * out[0])
+				- (long long)x * out[0];
+	}
+
+	/* One spare column for the zero weight past the last one */
+	n = (out[0] + 1) * 3;
+	sc->row = xalloc(n * sizeof(*sc->row));
+	sc->acc[0] = xalloc(n * sizeof(*sc->acc[0]));
+	sc->acc[1] = xalloc(n * sizeof(*sc->acc[1]));
+}
+
+/* Write out output row oy and start the next one */
+static void scale_emit(struct scaler *sc)
+{
+	unsigned long long area = (unsigned long long)sc->in[0] * sc->in[1];
+	unsigned long long *acc = sc->acc[0];
+	unsigned char *p = sc->img ? sc->line : sc->rgb + (size_t)sc->oy * sc->out[0] * out_bpp;
+	int i, n = sc->out[0] * 3;
+
+	for (i = 0; i < n; i++) {
+		unsigned int v = (acc[i] + area / 2) / area;
+		if (out_bpp == 6)
+			((unsigned short *)p)[i] = v;
+		else
+			p[i] = v;
+	}
+	if (sc->stats)
+		frame_stats_rows(sc->stats, p, 0, sc->out[0], 1);
+	if (sc->img)
+		image_rows(sc->img->f, sc->img->e, p, sc->out[0], 1);
+
+	memset(acc, 0, (n + 3) * sizeof(*acc));
+	sc->acc[0] = sc->acc[1];
+	sc->acc[1] = acc;
+	sc->oy++;
+}
+
+/* Take the next n input rows */
+static void scale_rows(struct scaler *sc, const unsigned char *rgb, size_t stride, int n)
+{
+	unsigned long long *row = sc->row;
+	size_t line = (size_t)sc->out[0] * out_bpp;
+	int w = sc->out[0] * 3 + 3;
+	int i, x, c, w0, w1;
+
+	if (!sc->col) {
+		n = MIN(n, sc->in[1] - sc->y);
+		if (sc->stats && n > 0)
+			frame_stats_rows(sc->stats, rgb, stride, sc->in[0], n);
+		for (; n > 0; n--, sc->y++, rgb += stride) {
+			if (!sc->img) {
+				memcpy(sc->rgb + sc->y * line, rgb, line);
+				continue;
+			}
+			/* image_rows() may clobber the row, which the
+			 * other outputs may still take */
+			memcpy(sc->line, rgb, line);
+			image_rows(sc->img->f, sc->img->e, sc->line, sc->out[0], 1);
+		}
+		return;
+	}
+
+	for (; n > 0 && sc->y < sc->in[1]; n--, sc->y++, rgb += stride) {
+		memset(row, 0, w * sizeof(*row));
+		for (x = 0; x < sc->in[0]; x++) {
+			unsigned long long *r = row + sc->col[x] * 3;
+			int wx0 = sc->weight[x], wx1 = sc->out[0] - wx0;
+
+			for (c = 0; c < 3; c++) {
+				unsigned int v = out_bpp == 6 ? ((const unsigned short *)rgb)[x*3 + c]
+							      : rgb[x*3 + c];
+				r[c] += (unsigned long long)v * wx0;
+				r[c + 3] += (unsigned long long)v * wx1;
+			}
+		}
+
+		/* Split the row between output rows oy and oy + 1 */
+		w0 = MIN((long long)(sc->oy + 1) * sc->in[1], (long long)(sc->y + 1) * sc->out[1])
+		     - (long long)sc->y * sc->out[1];
+		w1 = sc->out[1] - w0;
+		for (i = 0; i < w; i++) {
+			sc->acc[0][i] += row[i] * w0;
+			sc->acc[1][i] += row[i] * w1;
+		}
+		if ((long long)(sc->y + 1) * sc->out[1] >= (long long)(sc->oy + 1) * sc->in[1])
+			scale_emit(sc);
+	}
+}
+
+static void scale_end(struct scaler *sc)
+{
+	free(sc->line);
+	free(sc->acc[1]);
+	free(sc->acc[0]);
+	free(sc->row);
+	free(sc->weight);
+	free(sc->col);
+}
+
+/* Outputs of a frame
+ *
+ * One conversion of a frame feeds every output asked for: the image
+ * itself, a --thumbnail scaled down from the same rows, the --stats of
+ * the rows and the statistics of the image as output. Each output takes
+ * the rows of a strip while they are still in cache.
+ */
+struct frame_outputs {
+	unsigned char *rgb;		/* The image, output_size() large */
+	struct image_file *img;		/* Or the file to write it to */
+	struct image_file *thumb;	/* If thumb_size is set */
+	struct frame_stats *stats;	/* For --stats, or NULL */
+	struct frame_stats *out_stats;	/* Of the image after --scale, or NULL */
+};
+
+struct frame_rows {
+	struct scaler image;
+	struct scaler thumb;		/* If thumb_size is set */
+	struct frame_stats *stats;
+	struct frame_stats *out_stats;
+};
+
+/* in is the size of the converted rows, before --scale */
+static void frame_rows_begin(struct frame_rows *fr, const int in[2], const int out[2],
+			     const struct frame_outputs *o)
+{
+	scale_begin(&fr->image, in, out, o->rgb, o->img);
+	if (thumb_size[0])
+		scale_begin(&fr->thumb, in, thumb_size, NULL, o->thumb);
+	fr->stats = o->stats;
+	fr->out_stats = o->out_stats;
+	if (fr->stats)
+		frame_stats_begin(fr->stats);
+	/* Unscaled, the image has the statistics of the rows */
+	if (fr->out_stats && (fr->image.col || !fr->stats)) {
+		fr->image.stats = fr->out_stats;
+		frame_stats_begin(fr->out_stats);
+	}
+}
+
+static void frame_rows_put(struct frame_rows *fr, const unsigned char *rgb, size_t stride, int n)
+{
+	if (fr->stats)
+		frame_stats_rows(fr->stats, rgb, stride, fr->image.in[0], n);
+	if (thumb_size[0])
+		scale_rows(&fr->thumb, rgb, stride, n);
+	scale_rows(&fr->image, rgb, stride, n);
+}
+
+static void frame_rows_end(struct frame_rows *fr)
+{
+	if (fr->stats)
+		frame_stats_end(fr->stats);
+	if (fr->image.stats)
+		frame_stats_end(fr->image.stats);
+	else if (fr->out_stats)
+		*fr->out_stats = *fr->stats;
+	if (thumb_size[0])
+		scale_end(&fr->thumb);
+	scale_end(&fr->image);
+}
+
+static int strip_halo(const struct format_info *info);
+
+/* Raw rows of a frame, in memory or read a strip at a time from a file
+ * of a single frame */
+struct raw_rows {
+	unsigned char *src;		/* Or NULL to read from f */
+	FILE *f;
+	unsigned int padding;		/* Bytes after every row in f */
+};
+
+/* Copy rows y0 to y1 of line bytes each into dst */
+static void raw_rows_read(struct raw_rows *rr, size_t line, int y0, int y1, unsigned char *dst)
+{
+	int y;
+
+	if (rr->src) {
+		memcpy(dst, rr->src + y0 * line, (y1 - y0) * line);
+		return;
+	}
+	if (fseeko(rr->f, (long long)y0 * (line + rr->padding), SEEK_SET) != 0)
+		error("fseek");
+	if (rr->padding == 0) {
+		if (fread(dst, line, y1 - y0, rr->f) != (size_t)(y1 - y0))
+			error("fread");
+		return;
+	}
+	for (y = y0; y < y1; y++, dst += line) {
+		if (fread(dst, line, 1, rr->f) != 1)
+			error("fread");
+		if (fseeko(rr->f, rr->padding, SEEK_CUR) != 0)
+			error("fseek");
+	}
+}
+
+/* Bytes of the raw and converted rows held for strips of rows rows */
+static long long strip_bytes(const struct format_info *info, int size[2], int rows)
+{
+	int halo = bin > 1 ? 0 : MAX(0, strip_halo(info));
+	long long n = rows + 2*halo + STRIP_MIN_ROWS;
+
+	return n * (size[0] * info->bpp / 8) + n / bin * (size[0] / bin) * out_bpp;
+}
+
+/* Rows per strip for strips of at most bytes, but at least a 2x2 block of
+ * bins. Strips start on a block. */
+static int strip_height(const struct format_info *info, int size[2], long long bytes)
+{
+	int halo = bin > 1 ? 0 : MAX(0, strip_halo(info));
+	long long line = size[0] * info->bpp / 8 + (long long)(size[0] / bin) * out_bpp / bin;
+	long long rows = bytes / line - 2*halo - STRIP_MIN_ROWS;
+
+	rows = MIN(rows, size[1]);
+	return MAX(2 * bin, (int)rows) & ~(2 * bin - 1);
+}
+
+/* Convert a frame a strip of rows rows at a time, for the outputs in fr.
+ * The outputs take the converted rows and columns from win on, strips
+ * with none of their rows are not converted. */
+static void frame_rows_convert(const struct format_info *info, struct raw_rows *rr, int size[2],
+			       const int win[2], int rows, struct frame_rows *fr)
+{
+	int halo = bin > 1 ? 0 : strip_halo(info);
+	int in[2] = { size[0] / bin, size[1] / bin };
+	int end = win[1] + fr->image.in[1];
+	size_t in_line = size[0] * info->bpp / 8;
+	size_t line = (size_t)in[0] * out_bpp;
+	size_t skip = (size_t)win[0] * out_bpp;
+	unsigned char *strip_src, *strip_rgb;
+	int y, y0, y1, r0, r1;
+	int strip[2];
+
+	if (halo < 0) {
+		/* Rows can not be converted on their own */
+		strip_rgb = arena_alloc(line * in[1]);
+		raw_to_rgb(info, rr->src, size, strip_rgb);
+		frame_rows_put(fr, strip_rgb + win[1] * line + skip, line, fr->image.in[1]);
+		arena_free(strip_rgb);
+		return;
+	}
+
+	strip_src = arena_alloc((rows + 2*halo + STRIP_MIN_ROWS) * in_line);
+	strip_rgb = arena_alloc((rows + 2*halo + STRIP_MIN_ROWS) / bin * line);
+
+	for (y = 0; y < size[1]; y += rows) {
+		r0 = MAX(win[1], y / bin);
+		r1 = MIN(end, (y + MIN(rows, size[1] - y)) / bin);
+		if (r0 >= r1)
+			continue;
+		strip_rows(bayer_phase(info->fmt), size[1], y, rows, halo, &y0, &y1);
+
+		/* Conversion may change the samples in place, so the halo
+		 * rows shared with the next strip are converted from a copy */
+		raw_rows_read(rr, in_line, y0, y1, strip_src);
+		strip[0] = size[0];
+		strip[1] = y1 - y0;
+		raw_to_rgb(info, strip_src, strip, strip_rgb);
+		frame_rows_put(fr, strip_rgb + (r0 - y0 / bin) * line + skip, line, r1 - r0);
+	}
+
+	arena_free(strip_rgb);
+	arena_free(strip_src);
+}
+
+/* Convert a frame for the outputs in o. Without any but the image buffer
+ * the frame is converted whole. */
+static void frame_to_rgb(const struct format_info *info, unsigned char *src, int size[2],
+			 const struct frame_outputs *o)
+{
+	struct frame_rows fr;
+	struct raw_rows rr = { .src = src };
+	int in[2] = { size[0] / bin, size[1] / bin };
+	int win[2] = { 0, 0 };
+	int out[2];
+
+	if (o->rgb && !scale_size[0] && !thumb_size[0] && !o->stats && !o->out_stats) {
+		raw_to_rgb(info, src, size, o->rgb);
+		return;
+	}
+
+	output_size(size, out);
+	frame_rows_begin(&fr, in, out, o);
+	frame_rows_convert(info, &rr, size, win, strip_height(info, size, SCALE_STRIP_BYTES), &fr);
+	frame_rows_end(&fr);
+}
+
+/* Cropped conversion
+ *
+ * With --crop only the rows of the crop are read from the file, and of
+ * those rows only the bytes of its columns, unless the samples are DPCM
+ * coded along the whole row. The region read is widened by the halo of
+ * the demosaic and aligned to 2x2 blocks as for strips, so the cropped
+ * pixels come out exactly as from a whole frame conversion. Binning
+ * needs no halo and bins from the corner of the crop: a region starting
+ * on an odd row or column is converted as the Bayer format of the phase
+ * found there.
+ */
+struct region {
+	const struct format_info *info;	/* Format with the phase at the region origin */
+	int x, y;			/* Origin in the frame */
+	int size[2];
+	int win[2];			/* Origin of the crop in the converted region */
+};
+
+/* Columns a region starts on: a whole byte of the input and a whole
+ * block of pixels that share their chroma */
+static int crop_align(const struct format_info *info)
+{
+	const struct yuv_desc *d = get_yuv_desc(info->fmt);
+	int align = 1;
+
+	while (align * info->bpp % 8)
+		align *= 2;
+	if (d)
+		align = MAX(align, d->width);
+	if (info->fmt == V4L2_PIX_FMT_Y210)
+		align = MAX(align, 2);
+	return align;
+}
+
+static void crop_region(const struct format_info *info, int size[2], struct region *r)
+{
+	int halo = bin > 1 ? 0 : strip_halo(info);
+	int align[2] = { crop_align(info), 1 };
+	int start[2], end[2];
+	int i;
+
+	if (halo < 0)
+		error("format %s can not be cropped", info->name);
+	if (crop_pos[0] + crop_size[0] > size[0] || crop_pos[1] + crop_size[1] > size[1])
+		error("crop does not fit in the %ix%i image", size[0], size[1]);
+	if (halo) {
+		align[0] = MAX(align[0], 2);
+		align[1] = 2;
+	}
+
+	for (i = 0; i < 2; i++) {
+		start[i] = MAX(0, crop_pos[i] - halo) / align[i] * align[i];
+		end[i] = MIN(size[i], crop_pos[i] + crop_size[i] + halo);
+		if (halo && end[i] - start[i] < STRIP_MIN_ROWS) {
+			/* Too small for the demosaic, widen as for strips */
+			start[i] = MAX(0, end[i] - STRIP_MIN_ROWS) / align[i] * align[i];
+			end[i] = MIN(size[i], MAX(end[i], start[i] + STRIP_MIN_ROWS));
+		}
+		end[i] = MIN(size[i], (end[i] + align[i] - 1) / align[i] * align[i]);
+	}
+
+	if (halo && (bayer_phase(info->fmt) == QC_BAYER_BGGR || bayer_phase(info->fmt) == QC_BAYER_RGGB)) {
+		/* Demosaiced bottom up: rows pair up from the last row of the
+		 * frame, and with an odd number of rows the top row is left
+		 * over and converted on its own */
+		end[1] += (size[1] - end[1]) & 1;
+		if ((end[1] - start[1]) & 1)
+			start[1] = MAX(0, start[1] - 2);
+	}
+
+	switch (info->fmt) {
+	case V4L2_PIX_FMT_SBGGR10DPCM8:
+	case V4L2_PIX_FMT_SGBRG10DPCM8:
+	case V4L2_PIX_FMT_SGRBG10DPCM8:
+	case V4L2_PIX_FMT_SRGGB10DPCM8:
+		/* Samples are predicted from the start of the row */
+		start[0] = 0;
+		end[0] = size[0];
+		break;
+	}
+
+	if ((crop_pos[0] - start[0]) % bin)
+		error("%s can not be binned from column %i", info->name, crop_pos[0]);
+
+	r->x = start[0];
+	r->y = start[1];
+	for (i = 0; i < 2; i++) {
+		r->size[i] = end[i] - start[i];
+		r->win[i] = (crop_pos[i] - start[i]) / bin;
+	}
+	r->info = is_bayer(info) ? bayer_shift(info, r->x, r->y) : info;
+}
+
+/* Read the region of a frame that covers the crop, as read_raw_data()
+ * reads a whole frame. Rows are read with one pread() each, or all at
+ * once if the region spans whole rows. */
+static unsigned char *read_raw_region(char *filename, int framenum, int size[2],
+				      const struct format_info *info, struct region *r)
+{
+	unsigned int line_length, span;
+	unsigned char *b = NULL;
+	long long file_size, offset;
+	int i;
+	FILE *f = fopen(filename, "rb");
+	if (!f) error("fopen failed");
+
+	file_size = file_length(f);
+	line_length = size[0] * info->bpp / 8 + raw_layout(file_size, framenum, size, info->bpp);
+	crop_region(info, size, r);
+	span = r->size[0] * info->bpp / 8;
+
+	if (framenum>=0) printf("Reading frame %i...\n", framenum);
+	if (framenum<0) framenum = 0;
+	offset = (long long)framenum*size[0]*size[1]*info->bpp/8;
+	if ((file_size-offset)*8 < (long long)size[0]*size[1]*info->bpp) goto out;
+	offset += (long long)r->y * line_length + r->x * info->bpp / 8;
+
+	b = arena_alloc((size_t)span * r->size[1]);
+	if (span == line_length) {
+		if (pread(fileno(f), b, (size_t)span * r->size[1], offset) != (ssize_t)span * r->size[1])
+			error("read failed");
+	} else {
+		for (i = 0; i < r->size[1]; i++)
+			if (pread(fileno(f), b + (size_t)i * span, span,
+				  offset + (long long)i * line_length) != span)
+				error("read failed");
+	}
+out:	fclose(f);
+	return b;
+}
+
+/* Convert the crop of a frame for the outputs in o, a strip of the
+ * region at a time. Returns -1 if the file has no such frame. */
+static int crop_to_rgb(const struct format_info *info, char *filename, int framenum, int size[2],
+		       const struct frame_outputs *o)
+{
+	struct frame_rows fr;
+	struct raw_rows rr = { NULL };
+	struct region r;
+	int in[2] = { crop_size[0] / bin, crop_size[1] / bin };
+	int out[2];
+
+	rr.src = read_raw_region(filename, framenum, size, info, &r);
+	if (!rr.src)
+		return -1;
+	output_size(size, out);
+	frame_rows_begin(&fr, in, out, o);
+	frame_rows_convert(r.info, &rr, r.size, r.win,
+			   strip_height(r.info, r.size, SCALE_STRIP_BYTES), &fr);
+	frame_rows_end(&fr);
+	arena_free(rr.src);
+	return 0;
+}
+
+/* File of the thumbnail of an output file, or of its frame index if
+ * there are several: the extension is replaced by "-thumb" */
+static void thumb_name(char *buf, size_t len, const char *file_out, int index)
+{
+	const char *base, *ext;
+
+	base = strrchr(file_out, '/');
+	base = base ? base + 1 : file_out;
+	ext = strrchr(base, '.');
+	if (!ext || ext == base)
+		ext = base + strlen(base);
+	if (index < 0)
+		snprintf(buf, len, "%.*s-thumb.%s", (int)(ext - file_out), file_out,
+			 image_ext[out_format]);
+	else
+		snprintf(buf, len, "%.*s-thumb-%03i.%s", (int)(ext - file_out), file_out, index,
+			 image_ext[out_format]);
+}
+
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void write_stats(const char *name, const struct frame_stats *st)
+{
+	pthread_mutex_lock(&stats_lock);
+	if (fprintf(stats_file, "%s min %u %u %u max %u %u %u mean %u %u %u\n", name,
+		    st->min[0], st->min[1], st->min[2], st->max[0], st->max[1], st->max[2],
+		    st->mean[0], st->mean[1], st->mean[2]) < 0)
+		error("write failed");
+	pthread_mutex_unlock(&stats_lock);
+}
+
+/* Convert a single frame of file_in into the image file_out. With
+ * anything besides the image to output, the rows go from each strip
+ * straight to the files, and with max_mem the raw frame is also read a
+ * strip at a time. */
+static void convert_file(const struct format_info *info, char *file_in, int size[2],
+			 const char *file_out, long long max_mem)
+{
+	struct frame_outputs o = { NULL };
+	struct image_file img, thumb;
+	struct frame_stats stats;
+	struct frame_rows fr;
+	struct raw_rows rr = { NULL };
+	struct region r;
+	char thumbname[PATH_MAX];
+	int in[2], out[2];
+	int rows;
+
+	r.info = info;
+	r.win[0] = r.win[1] = 0;
+	if (crop_size[0]) {
+		rr.src = read_raw_region(file_in, -1, size, info, &r);
+		if (!rr.src) error("out of input data");
+		in[0] = crop_size[0] / bin;
+		in[1] = crop_size[1] / bin;
+	} else if (max_mem) {
+		if (strip_halo(info) < 0)
+			error("format %s can not be converted in strips", info->name);
+		rr.f = fopen(file_in, "rb");
+		if (!rr.f) error("fopen failed");
+		rr.padding = raw_layout(file_length(rr.f), -1, size, info->bpp);
+	} else {
+		rr.src = read_raw_data(file_in, -1, size, info->bpp);
+	}
+	if (!crop_size[0]) {
+		r.size[0] = size[0];
+		r.size[1] = size[1];
+		in[0] = size[0] / bin;
+		in[1] = size[1] / bin;
+	}
+	output_size(size, out);
+
+	if (rr.src && !crop_size[0] && !scale_size[0] && !thumb_size[0] && !stats_file) {
+		o.rgb = arena_alloc((size_t)out[0] * out[1] * out_bpp);
+		raw_to_rgb(info, rr.src, size, o.rgb);
+		arena_free(rr.src);
+		write_image(file_out, o.rgb, out);
+		arena_free(o.rgb);
+		return;
+	}
+
+	rows = strip_height(r.info, r.size, max_mem ? max_mem : SCALE_STRIP_BYTES);
+	if (max_mem) {
+		if (strip_bytes(info, size, rows) > max_mem)
+			printf("warning: memory budget too small, converting %i rows at a time\n", rows);
+		printf("Converting in strips of %i rows, %u KiB\n", rows,
+		       (unsigned int)((strip_bytes(info, size, rows) + 1023) / 1024));
+	}
+
+	image_open(&img, file_out, out);
+	o.img = &img;
+	if (thumb_size[0]) {
+		thumb_name(thumbname, sizeof(thumbname), file_out, -1);
+		image_open(&thumb, thumbname, thumb_size);
+		o.thumb = &thumb;
+	}
+	if (stats_file)
+		o.stats = &stats;
+
+	frame_rows_begin(&fr, in, out, &o);
+	frame_rows_convert(r.info, &rr, r.size, r.win, rows, &fr);
+	frame_rows_end(&fr);
+
+	image_close(&img);
+	if (thumb_size[0])
+		image_close(&thumb);
+	if (stats_file)
+		write_stats(file_in, &stats);
+	if (rr.f)
+		fclose(rr.f);
+	arena_free(rr.src);
+}
+
+/* Frame output
+ *
+ * Converted frames go to a sink. encode() is called by the worker that
+ * converted the frame, in parallel with the other workers, and leaves the
+ * bytes to write in the frame. write() is called for every frame in frame
+ * order. Streams keep all frames in one file, which may be stdout.
+ */
+enum stream_format {
+	STREAM_NONE,		/* A PNM file per frame */
+	STREAM_Y4M,		/* YUV4MPEG2 */
+	STREAM_RGB,		/* Headerless PNM pixel data */
+	STREAM_ARCHIVE,		/* Indexed archive */
+	STREAM_YUV,		/* Frames repacked to another YUV format */
+};
+
+struct out_frame {
+	unsigned int index;
+	unsigned char *src;	/* Raw input frame */
+	unsigned char *rgb;	/* Converted frame, if the sink uses it */
+	unsigned char *data;	/* Bytes to write */
+	size_t length;
+	unsigned char *buf;	/* Buffer holding data, if not rgb */
+	struct encoder *enc;	/* Encoder holding data */
+	struct planes planes;	/* Input planes, instead of src */
+	struct frame_stats stats;	/* Of rgb, if the sink asks for them */
+	struct frame_stats full_stats;	/* For --stats, of the rows as converted */
+	int ready;
+};
+
+struct sink {
+	const struct format_info *info;
+	int *size;
+	int out_size[2];	/* Size of the converted frames */
+	const char *file_out;
+	FILE *f;		/* Stream */
+	int rgb;		/* Frames are converted to RGB */
+	int stats;		/* The statistics of rgb are gathered */
+	struct yuv_layout yuv;	/* Y4M layout, of the input if rgb is not set */
+	const struct yuv_desc *yuv_in, *yuv_out;	/* Layouts to repack between */
+	struct archive_entry *index;	/* Archive index */
+	unsigned int entries;
+	unsigned long long offset;	/* Bytes written to the stream */
+	void (*encode)(struct sink *s, struct out_frame *f);
+	void (*write)(struct sink *s, struct out_frame *f);
+};
+
+static void rgb_encode(struct sink *s, struct out_frame *f)
+{
+	f->length = (size_t)s->out_size[0] * s->out_size[1] * out_bpp;
+	if (out_bpp == 6)
+		pack_be16((unsigned short *)f->rgb, f->rgb, f->length / 2);
+	f->data = f->rgb;
+}
+
+/* One image file per frame */
+static void file_encode(struct sink *s, struct out_frame *f)
+{
+	if (out_format == IMAGE_PNM) {
+		rgb_encode(s, f);
+		return;
+	}
+	f->enc = encoder_create(out_format, s->out_size[0], s->out_size[1], image_depth(), NULL);
+	encoder_rows(f->enc, f->rgb, s->out_size[1]);
+	f->data = (unsigned char *)encoder_finish(f->enc, &f->length);
+}
+
+static void file_write(struct sink *s, struct out_frame *f)
+{
+	char filename[PATH_MAX];
+	FILE *out;
+
+	snprintf(filename, sizeof(filename), "%s-%03i.%s", s->file_out, f->index,
+		 image_ext[out_format]);
+	printf("Writing to file `%s'...\n", filename);
+	out = fopen(filename, "wb");
+	if (!out) error("file open failed");
+	if (out_format == IMAGE_PNM)
+		write_pnm_header(out, s->out_size);
+	if (fwrite(f->data, f->length, 1, out) != 1) error("write failed");
+	if (fclose(out)) error("write failed");
+}
+
+static void stream_write(struct sink *s, struct out_frame *f)
+{
+	if (fwrite(f->data, f->length, 1, s->f) != 1)
+		error("write failed");
+}
+
+/* Indexed archive
+ *
+ * An archive keeps all frames of a conversion in one file that can be
+ * mapped and read at random:
+ *
+ *	header		struct archive_header, padded to ARCHIVE_ALIGN
+ *	frames		PNM pixel data of each frame, each padded to ARCHIVE_ALIGN
+ *	index		struct archive_entry for every frame, in frame order
+ *
+ * All fields are little endian. The header is written last, with the
+ * location of the index, so an archive whose header has no index was not
+ * finished. Frames are written with one large write each in frame order.
+ */
+#define ARCHIVE_MAGIC	"RAWRGBAR"
+#define ARCHIVE_ALIGN	4096
+
+struct archive_header {
+	char magic[8];
+	uint32_t version;		/* 1 */
+	uint32_t header_size;		/* sizeof(struct archive_header) */
+	uint32_t entry_size;		/* sizeof(struct archive_entry) */
+	uint32_t align;			/* Frames start on multiples of this */
+	uint32_t frames;
+	uint32_t input_format;		/* V4L2 fourcc of the raw input */
+	uint64_t index_offset;
+	uint32_t reserved[8];
+};
+
+struct archive_entry {
+	uint64_t offset;		/* Frame data from the start of the file */
+	uint64_t length;
+	uint32_t frame;			/* Input frame number */
+	uint32_t width;
+	uint32_t height;
+	uint32_t bpp;			/* Bytes per pixel, 3 or 6 */
+	uint32_t maxval;		/* As in PNM: 6 byte pixels are big endian */
+	uint32_t min[3];		/* Per channel, in output order */
+	uint32_t max[3];
+	uint32_t mean[3];
+};
+
+static void archive_pad(struct sink *s)
+{
+	static const unsigned char zero[ARCHIVE_ALIGN];
+	size_t pad = (ARCHIVE_ALIGN - s->offset % ARCHIVE_ALIGN) % ARCHIVE_ALIGN;
+
+	if (pad && fwrite(zero, pad, 1, s->f) != 1)
+		error("write failed");
+	s->offset += pad;
+}
+
+static void archive_header(struct sink *s, unsigned long long index_offset)
+{
+	struct archive_header h;
+
+	memset(&h, 0, sizeof(h));
+	memcpy(h.magic, ARCHIVE_MAGIC, sizeof(h.magic));
+	h.version = htole32(1);
+	h.header_size = htole32(sizeof(h));
+	h.entry_size = htole32(sizeof(struct archive_entry));
+	h.align = htole32(ARCHIVE_ALIGN);
+	h.frames = htole32(s->entries);
+	h.input_format = htole32(s->info->fmt);
+	h.index_offset = htole64(index_offset);
+	if (fwrite(&h, sizeof(h), 1, s->f) != 1)
+		error("write failed");
+}
+
+static void archive_write(struct sink *s, struct out_frame *f)
+{
+	struct archive_entry *e;
+	int c;
+
+	if ((s->entries & (s->entries - 1)) == 0) {
+		s->index = realloc(s->index, MAX(1, 2 * s->entries) * sizeof(*s->index));
+		if (!s->index) error("memory allocation failed");
+	}
+	e = &s->index[s->entries++];
+
+	archive_pad(s);
+	e->offset = htole64(s->offset);
+	e->length = htole64(f->length);
+	e->frame = htole32(f->index);
+	e->width = htole32(s->out_size[0]);
+	e->height = htole32(s->out_size[1]);
+	e->bpp = htole32(out_bpp);
+	e->maxval = htole32(out_maxval);
+	for (c = 0; c < 3; c++) {
+		e->min[c] = htole32(f->stats.min[c]);
+		e->max[c] = htole32(f->stats.max[c]);
+		e->mean[c] = htole32(f->stats.mean[c]);
+	}
+	stream_write(s, f);
+	s->offset += f->length;
+}
+
+static void archive_close(struct sink *s)
+{
+	unsigned long long index_offset;
+
+	archive_pad(s);
+	index_offset = s->offset;
+	if (s->entries && fwrite(s->index, sizeof(*s->index), s->entries, s->f) != s->entries)
+		error("write failed");
+	if (fseek(s->f, 0, SEEK_SET))
+		error("seek failed");
+	archive_header(s, index_offset);
+	free(s->index);
+}
+
+/* Copy one plane of l into dst, w by h samples */
+static unsigned char *y4m_plane(const struct yuv_layout *l, int plane, int w, int h,
+				unsigned char *dst)
+{
+	int x, y;
+
+	for (y = 0; y < h; y++) {
+		const unsigned char *p = l->base[plane] + (size_t)y * l->stride[plane];
+		if (l->step[plane] == 1) {
+			memcpy(dst, p, w);
+			dst += w;
+		} else {
+			for (x = 0; x < w; x++)
+				*dst++ = p[x * l->step[plane]];
+		}
+	}
+	return dst;
+}
+
+static void y4m_encode(struct sink *s, struct out_frame *f)
+{
+	const struct yuv_layout *l = &s->yuv;
+	struct yuv_layout in;
+	int w = s->out_size[0], h = s->out_size[1];
+	int cw = (w + l->hsub - 1) / l->hsub, ch = (h + l->vsub - 1) / l->vsub;
+	unsigned char *p;
+	int i;
+
+	f->length = 6 + (size_t)w * h + (l->planes - 1) * (size_t)cw * ch;
+	f->buf = arena_alloc(f->length);
+	f->data = f->buf;
+	memcpy(f->data, "FRAME\n", 6);
+	p = f->data + 6;
+
+	if (!s->rgb) {
+		yuv_layout(s->info, f->src, s->size, &in);
+		p = y4m_plane(&in, 0, w, h, p);
+		for (i = 1; i < in.planes; i++)
+			p = y4m_plane(&in, i, cw, ch, p);
+		return;
+	}
+
+	/* Converted to 4:4:4, planes written in one pass over the pixels */
+	for (i = 0; i < w * h; i++) {
+		const unsigned char *c = f->rgb + i * 3;
+		int y, u, v;
+
+		rgb_to_yuv(c[0], c[1], c[2], &y, &u, &v);
+		p[i] = y;
+		p[w * h + i] = u;
+		p[2 * w * h + i] = v;
+	}
+}
+
+/* Raw frames of another YUV format */
+static void yuv_encode(struct sink *s, struct out_frame *f)
+{
+	struct planes src, dst;
+
+	if (f->src)
+		desc_contiguous(s->yuv_in, f->src, s->size, &src);
+	else
+		src = f->planes;
+	f->length = desc_frame_bytes(s->yuv_out, s->size);
+	f->buf = arena_alloc(f->length);
+	f->data = f->buf;
+	desc_contiguous(s->yuv_out, f->buf, s->size, &dst);
+	yuv_repack(s->yuv_in, &src, s->yuv_out, &dst, s->size);
+}
+
+static void sink_init(struct sink *s, enum stream_format stream, const struct format_info *info,
+		      const struct format_info *out_info, int size[2], const char *file_out)
+{
+	memset(s, 0, sizeof(*s));
+	s->info = info;
+	s->size = size;
+	output_size(size, s->out_size);
+	s->file_out = file_out;
+	s->rgb = 1;
+	s->encode = file_encode;
+	s->write = file_write;
+	if (stream == STREAM_NONE)
+		return;
+	if (out_format != IMAGE_PNM)
+		error("--encode only applies to image files");
+	if (stream == STREAM_ARCHIVE && strcmp(file_out, "-") == 0)
+		error("archive output must be a file");
+
+	if (strcmp(file_out, "-") == 0) {
+		/* Keep the messages out of the stream */
+		int fd = dup(STDOUT_FILENO);
+		if (fd < 0 || dup2(STDERR_FILENO, STDOUT_FILENO) < 0)
+			error("dup failed");
+		s->f = fdopen(fd, "wb");
+	} else {
+		s->f = fopen(file_out, "wb");
+	}
+	if (!s->f) error("file open failed");
+	s->write = stream_write;
+
+	if (stream == STREAM_Y4M) {
+		if (!plane_count && !crop_size[0] && !scale_size[0] && !thumb_size[0] &&
+		    !stats_file && yuv_layout(info, NULL, size, &s->yuv) == 0) {
+			s->rgb = 0;
+		} else {
+			if (out_bpp != 3)
+				error("Y4M output is 8 bit only");
+			s->yuv.y4m = "444";
+			s->yuv.planes = 3;
+			s->yuv.hsub = s->yuv.vsub = 1;
+		}
+		s->encode = y4m_encode;
+		fprintf(s->f, "YUV4MPEG2 W%i H%i F%i:%i Ip A1:1 C%s\n",
+			s->out_size[0], s->out_size[1], frame_rate[0], frame_rate[1], s->yuv.y4m);
+	}
+
+	if (stream == STREAM_YUV) {
+		if (crop_size[0] || scale_size[0] || thumb_size[0] || stats_file)
+			error("--yuv repacks whole frames");
+		s->yuv_in = get_yuv_desc(info->fmt);
+		s->yuv_out = get_yuv_desc(out_info->fmt);
+		if (!s->yuv_in || !s->yuv_out)
+			error("can not repack %s to %s", info->name, out_info->name);
+		if (size[0] % s->yuv_in->width || size[0] % s->yuv_out->width ||
+		    size[1] % s->yuv_in->vsub || size[1] % s->yuv_out->vsub)
+			error("size does not fit the blocks of %s and %s", info->name, out_info->name);
+		s->rgb = 0;
+		s->encode = yuv_encode;
+	}
+
+	if (stream == STREAM_ARCHIVE) {
+		/* Placeholder until the index is written */
+		archive_header(s, 0);
+		s->offset = sizeof(struct archive_header);
+		s->stats = 1;
+		s->encode = rgb_encode;
+		s->write = archive_write;
+	}
+}
+
+static void sink_close(struct sink *s)
+{
+	if (s->write == archive_write)
+		archive_close(s);
+	if (s->f && fclose(s->f))
+		error("write failed");
+}
+
+/* Return the number of complete frames of given size in a file */
+static unsigned int count_frames(char *filename, int size[2], int bpp)
+{
+	long long frame_bits = (long long)size[0] * size[1] * bpp;
+	long long file_size;
+	FILE *f;
+
+	if (size[0]<=0 || size[1]<=0) error("can not automatically detect frame size with multiple frames");
+	f = fopen(filename, "rb");
+	if (!f) error("fopen failed");
+	file_size = file_length(f);
+	fclose(f);
+
+	if ((file_size * 8) % frame_bits != 0)
+		printf("warning: input size not multiple of frame size\n");
+	return file_size * 8 / frame_bits;
+}
+
+/* Frame parallel conversion of multi-frame input
+ *
+ * Every worker converts whole frames into buffers of its own. Frames are
+ * handed out in order, but may finish out of order; a finished frame is
+ * parked in the reorder window until all earlier frames have been written.
+ * The worker that completes the oldest outstanding frame writes out every
+ * frame that is then ready, so the output files appear in frame order.
+ * Workers never run more than a window of frames ahead of the writer,
+ * which bounds the number of frame buffers taken from the arena.
+ *
+ * Frames are dealt round robin into one queue per NUMA node. Workers read
+ * and convert the frames of their own node's queue, so that the input and
+ * output buffers are local to the node, and only take frames from another
+ * node when their own next frame is outside the window.
+ */
+struct frame_queue {
+	const struct format_info *info;
+	char *file_in;
+	struct sink *sink;
+	int *size;
+	unsigned int frames;
+
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	unsigned int nodes;
+	unsigned int *next_read;	/* Next frame to convert, per node */
+	unsigned int next_write;	/* Next frame to write out */
+	int writing;			/* A worker is writing frames out */
+	unsigned int window;
+	struct out_frame *done;		/* Converted frames, indexed by frame % window */
+};
+
+/* Take the next frame to convert, preferring the queue of the given node.
+ * Returns 0 if there is no frame within the window. */
+static int frame_queue_take(struct frame_queue *q, unsigned int node, unsigned int *frame)
+{
+	unsigned int limit = q->next_write + q->window;
+	unsigned int i, best = node;
+
+	if (limit > q->frames)
+		limit = q->frames;
+	if (q->next_read[node] >= limit) {
+		/* The oldest frame not taken yet is always within the window
+		 * unless all frames of the window are being converted */
+		for (i = 0; i < q->nodes; i++)
+			if (q->next_read[i] < q->next_read[best])
+				best = i;
+		if (q->next_read[best] >= limit)
+			return 0;
+	}
+	*frame = q->next_read[best];
+	q->next_read[best] += q->nodes;
+	return 1;
+}
+
+/* Nothing is left to take */
+static int frame_queue_empty(struct frame_queue *q)
+{
+	unsigned int i;
+
+	for (i = 0; i < q->nodes; i++)
+		if (q->next_read[i] < q->frames)
+			return 0;
+	return 1;
+}
+
+/* Write the statistics of a frame, in frame order */
+static void write_frame_stats(struct frame_queue *q, struct out_frame *f)
+{
+	char name[PATH_MAX];
+
+	if (stats_file) {
+		snprintf(name, sizeof(name), "%s:%u", q->file_in, f->index);
+		write_stats(name, &f->full_stats);
+	}
+}
+
+static void convert_frames_worker(void *arg, unsigned int index, unsigned int worker)
+{
+	struct frame_queue *q = arg;
+	struct sink *sink = q->sink;
+	unsigned int node = numa_this_node();
+	struct frame_outputs o = { NULL };
+	struct image_file thumb;
+	char name[PATH_MAX];
+	struct out_frame *f;
+	unsigned int n;
+
+	(void)index;
+	(void)worker;
+
+	pthread_mutex_lock(&q->lock);
+	for (;;) {
+		while (!frame_queue_take(q, node, &n)) {
+			if (frame_queue_empty(q))
+				goto out;
+			pthread_cond_wait(&q->cond, &q->lock);
 		}
-		break;
+		pthread_mutex_unlock(&q->lock);
 
-	case V4L2_PIX_FMT_GREY:
-		for (src_y = 0, dst_y = 0; dst_y < src_size[1]; src_y++, dst_y++) {
-			for (src_x = 0, dst_x = 0; dst_x < src_size[0]; ) {
-				a = src[src_y*src_stride + src_x];
-				rgb[dst_y*rgb_stride+3*dst_x+0] = a;
-				rgb[dst_y*rgb_stride+3*dst_x+1] = a;
-				rgb[dst_y*rgb_stride+3*dst_x+2] = a;
-				src_x++;
-				dst_x++;
-			}
+		/* The slot is ours until the frame is marked ready */
+		f = &q->done[n % q->window];
+		f->index = n;
+		f->rgb = NULL;
+		f->buf = NULL;
+		f->enc = NULL;
+		if (sink->rgb)
+			f->rgb = arena_alloc(sink->out_size[0]*sink->out_size[1]*out_bpp);
+		o.rgb = f->rgb;
+		o.stats = stats_file ? &f->full_stats : NULL;
+		o.out_stats = sink->stats ? &f->stats : NULL;
+		if (thumb_size[0]) {
+			/* A file of its own, so written here and not in frame order */
+			thumb_name(name, sizeof(name), sink->file_out, n);
+			image_open(&thumb, name, thumb_size);
+			o.thumb = &thumb;
 		}
-		break;
+		if (plane_count) {
+			f->src = NULL;
+			read_planes(q->info, n, q->size, &f->planes);
+			if (sink->rgb)
+				planes_to_rgb(q->info, &f->planes, q->size, f->rgb);
+			if (sink->stats)
+				frame_stats(f->rgb, (size_t)sink->out_size[0] * sink->out_size[1],
+					    &f->stats);
+		} else if (crop_size[0]) {
+			f->src = NULL;
+			if (crop_to_rgb(q->info, q->file_in, n, q->size, &o))
+				error("out of input data");
+		} else {
+			f->src = read_raw_data(q->file_in, n, q->size, q->info->bpp);
+			if (!f->src) error("out of input data");
+			if (sink->rgb)
+				frame_to_rgb(q->info, f->src, q->size, &o);
+		}
+		if (thumb_size[0])
+			image_close(&thumb);
+		sink->encode(sink, f);
 
-	case V4L2_PIX_FMT_SBGGR16:
-		printf("WARNING: bayer phase not supported -> expect bad colors\n");
-		shift += 4;
-	case V4L2_PIX_FMT_SGRBG12:
-		shift += 2;
-	case V4L2_PIX_FMT_SGRBG10:
-		for (dst_y=0; dst_y<src_size[1]; dst_y++) {
-			for (dst_x=0; dst_x<src_size[0]; dst_x++) {
-				unsigned short *p = (unsigned short *)&(src[src_stride*dst_y+dst_x*2]);
-				int v = *p;
-				if (highbits)
-					v >>= 6;
-				else
-					v >>= shift;
-				if (v<0 || v>=(1<<10))
-					printf("WARNING: bayer image pixel values out of range (%i)\n", v);
-				v *= brightness;
-				v >>= 8;
-				if (v < 0) v = 0;
-				if (v >= (1<<10)) v = (1<<10)-1;
-				*p = v;
-			}
+		pthread_mutex_lock(&q->lock);
+		f->ready = 1;
+		while (!q->writing && (f = &q->done[q->next_write % q->window])->ready) {
+			q->writing = 1;
+			pthread_mutex_unlock(&q->lock);
+
+			sink->write(sink, f);
+			write_frame_stats(q, f);
+			encoder_destroy(f->enc);
+			arena_free(f->buf);
+			arena_free(f->rgb);
+			arena_free(f->src);
+			free_planes(&f->planes);
+
+			pthread_mutex_lock(&q->lock);
+			f->ready = 0;
+			q->next_write++;
+			q->writing = 0;
+			pthread_cond_broadcast(&q->cond);
 		}
+	}
+out:
+	pthread_mutex_unlock(&q->lock);
+}
 
-		buf = malloc(src_size[0] * src_size[1] * 3);
-		if (buf==NULL) error("out of memory");
-		qc_imag_bay2rgb10(src, src_stride, buf, src_size[0]*3, src_size[0], src_size[1], 3);
-		for (dst_y=0; dst_y<src_size[1]; dst_y++) {
-			for (dst_x=0; dst_x<src_size[0]; dst_x++) {
-				unsigned char *p = buf + src_size[0]*3*dst_y + dst_x*3;
-				rgb[dst_y*rgb_stride+3*dst_x+0] = swaprb ? p[2] : p[0];
-				rgb[dst_y*rgb_stride+3*dst_x+1] = p[1];
-				rgb[dst_y*rgb_stride+3*dst_x+2] = swaprb ? p[0] : p[2];
-			}
+static void convert_frames(struct pool *pool, const struct format_info *info,
+			   char *file_in, struct sink *sink, int size[2], unsigned int frames)
+{
+	unsigned int workers = pool_workers(pool);
+	struct frame_queue q;
+	unsigned int i;
+
+	memset(&q, 0, sizeof(q));
+	q.info = info;
+	q.file_in = file_in;
+	q.sink = sink;
+	q.size = size;
+	q.frames = frames;
+	q.window = 2 * workers;
+	q.done = xalloc(q.window * sizeof(*q.done));
+	q.nodes = numa_nodes();
+	q.next_read = xalloc(q.nodes * sizeof(*q.next_read));
+	for (i = 0; i < q.nodes; i++)
+		q.next_read[i] = i;
+	pthread_mutex_init(&q.lock, NULL);
+	pthread_cond_init(&q.cond, NULL);
+
+	/* Frames are small enough to convert each on a single thread */
+	qc_set_pool(NULL);
+	pool_run(pool, convert_frames_worker, &q, workers);
+	qc_set_pool(pool);
+
+	free(q.next_read);
+	free(q.done);
+	pthread_cond_destroy(&q.cond);
+	pthread_mutex_destroy(&q.lock);
+}
+
+/* Batch conversion of many input files
+ *
+ * All files share the format, size and algorithm options. Each file is
+ * converted on a single worker with buffers from the arena, which are
+ * recycled from file to file. The pool hands every worker a run of
+ * files and lets idle workers steal from busy ones, so a few large files
+ * do not leave the other workers waiting.
+ */
+struct batch {
+	const struct format_info *info;
+	const char *outdir;
+	int size[2];		/* {-1,-1} to guess the size of each file */
+	char **inputs;
+	unsigned int count;
+	unsigned int alloc;
+};
+
+static void batch_add(struct batch *b, const char *name)
+{
+	if (b->count == b->alloc) {
+		b->alloc = b->alloc ? 2 * b->alloc : 64;
+		b->inputs = realloc(b->inputs, b->alloc * sizeof(*b->inputs));
+		if (!b->inputs) error("memory allocation failed");
+	}
+	b->inputs[b->count] = strdup(name);
+	if (!b->inputs[b->count]) error("memory allocation failed");
+	b->count++;
+}
+
+/* Add a file name, or all matches if it is a glob pattern */
+static void batch_add_pattern(struct batch *b, const char *pattern)
+{
+	glob_t g;
+	size_t i;
+
+	if (!strpbrk(pattern, "*?[")) {
+		batch_add(b, pattern);
+		return;
+	}
+	if (glob(pattern, 0, NULL, &g) != 0)
+		error("no files match `%s'", pattern);
+	for (i = 0; i < g.gl_pathc; i++)
+		batch_add(b, g.gl_pathv[i]);
+	globfree(&g);
+}
+
+/* Add file names listed one per line in a file, or stdin if "-" */
+static void batch_add_list(struct batch *b, const char *list)
+{
+	char line[PATH_MAX];
+	FILE *f = strcmp(list, "-") ? fopen(list, "r") : stdin;
+
+	if (!f) error("can not open file list `%s'", list);
+	while (fgets(line, sizeof(line), f)) {
+		line[strcspn(line, "\r\n")] = 0;
+		if (line[0])
+			batch_add(b, line);
+	}
+	if (f != stdin)
+		fclose(f);
+}
+
+/* Output files are named after the input file without its directory
+ * and extension. Returns the name and its length in len. */
+static const char *batch_stem(const char *input, int *len)
+{
+	const char *base, *ext;
+
+	base = strrchr(input, '/');
+	base = base ? base + 1 : input;
+	ext = strrchr(base, '.');
+	if (!ext || ext == base)
+		ext = base + strlen(base);
+	*len = ext - base;
+	return base;
+}
+
+static int batch_stem_cmp(const void *a, const void *b)
+{
+	const char *sa = *(const char * const *)a, *sb = *(const char * const *)b;
+	int la, lb, r;
+
+	sa = batch_stem(sa, &la);
+	sb = batch_stem(sb, &lb);
+	r = memcmp(sa, sb, MIN(la, lb));
+	return r ? r : la - lb;
+}
+
+/* Refuse inputs that would be written to the same output file */
+static void batch_check_names(struct batch *b)
+{
+	char **sorted;
+	unsigned int i;
+	int len;
+
+	sorted = xalloc(b->count * sizeof(*sorted));
+	memcpy(sorted, b->inputs, b->count * sizeof(*sorted));
+	qsort(sorted, b->count, sizeof(*sorted), batch_stem_cmp);
+	for (i = 1; i < b->count; i++) {
+		if (batch_stem_cmp(&sorted[i - 1], &sorted[i]) == 0) {
+			const char *stem = batch_stem(sorted[i], &len);
+			error("`%s' and `%s' would both be written to %s/%.*s.%s", sorted[i - 1],
+			      sorted[i], b->outdir, len, stem, image_ext[out_format]);
 		}
-		free(buf);
-		break;
+	}
+	free(sorted);
+}
+
+static void convert_batch_worker(void *arg, unsigned int index, unsigned int worker)
+{
+	struct batch *b = arg;
+	char filename[PATH_MAX];
+	const char *base;
+	int len;
+	int size[2] = { b->size[0], b->size[1] };
+
+	(void)worker;
+
+	base = batch_stem(b->inputs[index], &len);
+	snprintf(filename, sizeof(filename), "%s/%.*s.%s", b->outdir, len, base,
+		 image_ext[out_format]);
+	convert_file(b->info, b->inputs[index], size, filename, 0);
+}
+
+static void convert_batch(struct pool *pool, struct batch *b)
+{
+	unsigned int i;
+
+	qc_set_pool(NULL);
+	pool_run(pool, convert_batch_worker, b, b->count);
+	qc_set_pool(pool);
+
+	for (i = 0; i < b->count; i++)
+		free(b->inputs[i]);
+	free(b->inputs);
+}
+
+/* Strip-mined conversion
+ *
+ * Converts a frame a strip of rows at a time, so that only one input
+ * strip and one output strip are resident however tall the frame is.
+ * Every strip is read with a halo of rows above and below it, converted
+ * as a small frame of its own and only its inner rows are appended to
+ * the output. Strips start and end where the full frame has a 2x2 Bayer
+ * block boundary (see strip_rows()), so the row pairs of every algorithm
+ * line up with the full frame, and two rows of halo cover the reach of
+ * all demosaic algorithms: the inner rows come out exactly as they would
+ * from a whole frame conversion.
+ */
+
+/* Rows of halo needed around a strip, -1 if the format can't be strip-mined */
+static int strip_halo(const struct format_info *info)
+{
+	switch (info->fmt) {
 	case V4L2_PIX_FMT_SBGGR8:
 	case V4L2_PIX_FMT_SGBRG8:
-		printf("WARNING: bayer phase not supported -> expect bad colors\n");
 	case V4L2_PIX_FMT_SGRBG8:
-		/* FIXME: only SGRBG8 handled properly: color phase is ignored. */
-		buf = malloc(src_size[0] * src_size[1] * 3);
-		if (buf==NULL) error("out of memory");
-		qc_imag_bay2rgb8(src, src_stride, buf, src_size[0]*3, src_size[0], src_size[1], 3);
-		for (dst_y=0; dst_y<src_size[1]; dst_y++) {
-			for (dst_x=0; dst_x<src_size[0]; dst_x++) {
-				unsigned char *p = buf + src_size[0]*3*dst_y + dst_x*3;
-				rgb[dst_y*rgb_stride+3*dst_x+0] = swaprb ? p[2] : p[0];
-				rgb[dst_y*rgb_stride+3*dst_x+1] = p[1];
-				rgb[dst_y*rgb_stride+3*dst_x+2] = swaprb ? p[0] : p[2];
-			}
-		}
-		free(buf);
-		break;
-	case V4L2_PIX_FMT_RGB332:
-		for (src_y = 0, dst_y = 0; dst_y < src_size[1]; src_y++, dst_y++) {
-			for (src_x = 0, dst_x = 0; dst_x < src_size[0]; ) {
-				pixel = src[dst_y*src_stride + dst_x];
-				r = (pixel << 0) & 0xe0;
-				g = (pixel << 3) & 0xe0;
-				b = (pixel << 6) & 0xc0;
-				rgb[src_y*rgb_stride+3*src_x+0] = swaprb ? b : r;
-				rgb[src_y*rgb_stride+3*src_x+1] = g;
-				rgb[src_y*rgb_stride+3*src_x+2] = swaprb ? r : b;
-				src_x++;
-				dst_x++;
-			}
-		}
-		break;
-	case V4L2_PIX_FMT_RGB555:
-		for (src_y = 0, dst_y = 0; dst_y < src_size[1]; src_y++, dst_y++) {
-			for (src_x = 0, dst_x = 0; dst_x < src_size[0]; ) {
-				pixel = (src[dst_y*src_stride + dst_x*2 + 1] << 8)
-				      | src[dst_y*src_stride + dst_x*2 + 0];
-				r = (pixel >> 7) & 0xf8;
-				g = (pixel >> 2) & 0xf8;
-				b = (pixel << 3) & 0xf8;
-				rgb[src_y*rgb_stride+3*src_x+0] = swaprb ? b : r;
-				rgb[src_y*rgb_stride+3*src_x+1] = g;
-				rgb[src_y*rgb_stride+3*src_x+2] = swaprb ? r : b;
-				src_x++;
-				dst_x++;
-			}
-		}
-		break;
-	case V4L2_PIX_FMT_RGB565:
-		for (src_y = 0, dst_y = 0; dst_y < src_size[1]; src_y++, dst_y++) {
-			for (src_x = 0, dst_x = 0; dst_x < src_size[0]; ) {
-				pixel = (src[dst_y*src_stride + dst_x*2 + 1] << 8)
-				      | src[dst_y*src_stride + dst_x*2 + 0];
-				r = (pixel >> 8) & 0xf8;
-				g = (pixel >> 3) & 0xfc;
-				b = (pixel << 3) & 0xf8;
-				rgb[src_y*rgb_stride+3*src_x+0] = swaprb ? b : r;
-				rgb[src_y*rgb_stride+3*src_x+1] = g;
-				rgb[src_y*rgb_stride+3*src_x+2] = swaprb ? r : b;
-				src_x++;
-				dst_x++;
-			}
-		}
-		break;
-	case V4L2_PIX_FMT_BGR24:
-		swaprb = !swaprb;
+	case V4L2_PIX_FMT_SRGGB8:
+	case V4L2_PIX_FMT_SBGGR10:
+	case V4L2_PIX_FMT_SGBRG10:
+	case V4L2_PIX_FMT_SGRBG10:
+	case V4L2_PIX_FMT_SRGGB10:
+	case V4L2_PIX_FMT_SBGGR10P:
+	case V4L2_PIX_FMT_SGBRG10P:
+	case V4L2_PIX_FMT_SGRBG10P:
+	case V4L2_PIX_FMT_SRGGB10P:
+	case V4L2_PIX_FMT_SBGGR10DPCM8:
+	case V4L2_PIX_FMT_SGBRG10DPCM8:
+	case V4L2_PIX_FMT_SGRBG10DPCM8:
+	case V4L2_PIX_FMT_SRGGB10DPCM8:
+	case V4L2_PIX_FMT_SBGGR12:
+	case V4L2_PIX_FMT_SGBRG12:
+	case V4L2_PIX_FMT_SGRBG12:
+	case V4L2_PIX_FMT_SRGGB12:
+	case V4L2_PIX_FMT_SBGGR12P:
+	case V4L2_PIX_FMT_SGBRG12P:
+	case V4L2_PIX_FMT_SGRBG12P:
+	case V4L2_PIX_FMT_SRGGB12P:
+	case V4L2_PIX_FMT_SBGGR14P:
+	case V4L2_PIX_FMT_SGBRG14P:
+	case V4L2_PIX_FMT_SGRBG14P:
+	case V4L2_PIX_FMT_SRGGB14P:
+	case V4L2_PIX_FMT_SBGGR16:
+	case V4L2_PIX_FMT_SGBRG16:
+	case V4L2_PIX_FMT_SGRBG16:
+	case V4L2_PIX_FMT_SRGGB16:
+		return 2;
+	case V4L2_PIX_FMT_NV12:
+	case V4L2_PIX_FMT_NV21:
+	case V4L2_PIX_FMT_NV16:
+	case V4L2_PIX_FMT_NV61:
+	case V4L2_PIX_FMT_YUV411P:
+	case V4L2_PIX_FMT_YUV420:
+	case V4L2_PIX_FMT_YVU420:
+	case V4L2_PIX_FMT_YUV422P:
+	case V4L2_PIX_FMT_YVU422M:
+	case V4L2_PIX_FMT_YUV444M:
+	case V4L2_PIX_FMT_YVU444M:
+	case V4L2_PIX_FMT_P010:
+	case V4L2_PIX_FMT_P210:
+	case V4L2_PIX_FMT_YUV410:
+	case V4L2_PIX_FMT_YVU410:
+		return -1;		/* Planar, rows are not contiguous */
+	case V4L2_PIX_FMT_HM12:
+	case V4L2_PIX_FMT_NV12MT_16X16:
+	case V4L2_PIX_FMT_NV12MT:
+		return -1;		/* Tiled */
+	default:
+		return info->bpp > 0 ? 0 : -1;
+	}
+}
+
+/* Parse a size in bytes with an optional K, M or G suffix */
+static long long parse_bytes(const char *p)
+{
+	char *end;
+	long long v = strtoll(p, &end, 10);
+
+	switch (toupper(*end)) {
+	case 'G':
+		v *= 1024;
 		/* Fallthrough */
-	case V4L2_PIX_FMT_RGB24:
-		for (src_y = 0, dst_y = 0; dst_y < src_size[1]; src_y++, dst_y++) {
-			for (src_x = 0, dst_x = 0; dst_x < src_size[0]; ) {
-				r = src[dst_y*src_stride + dst_x*3 + 0];
-				g = src[dst_y*src_stride + dst_x*3 + 1];
-				b = src[dst_y*src_stride + dst_x*3 + 2];
-				rgb[src_y*rgb_stride+3*src_x+0] = swaprb ? b : r;
-				rgb[src_y*rgb_stride+3*src_x+1] = g;
-				rgb[src_y*rgb_stride+3*src_x+2] = swaprb ? r : b;
-				src_x++;
-				dst_x++;
-			}
-		}
-		break;
-	case V4L2_PIX_FMT_BGR32:
-		for (src_y = 0, dst_y = 0; dst_y < src_size[1]; src_y++, dst_y++) {
-			for (src_x = 0, dst_x = 0; dst_x < src_size[0]; ) {
-				r = src[dst_y*src_stride + dst_x*4 + 2];
-				g = src[dst_y*src_stride + dst_x*4 + 1];
-				b = src[dst_y*src_stride + dst_x*4 + 0];
-				rgb[src_y*rgb_stride+3*src_x+0] = swaprb ? b : r;
-				rgb[src_y*rgb_stride+3*src_x+1] = g;
-				rgb[src_y*rgb_stride+3*src_x+2] = swaprb ? r : b;
-				src_x++;
-				dst_x++;
-			}
-		}
-		break;
-	case V4L2_PIX_FMT_RGB32:
-		for (src_y = 0, dst_y = 0; dst_y < src_size[1]; src_y++, dst_y++) {
-			for (src_x = 0, dst_x = 0; dst_x < src_size[0]; ) {
-				r = src[dst_y*src_stride + dst_x*4 + 1];
-				g = src[dst_y*src_stride + dst_x*4 + 2];
-				b = src[dst_y*src_stride + dst_x*4 + 3];
-				rgb[src_y*rgb_stride+3*src_x+0] = swaprb ? b : r;
-				rgb[src_y*rgb_stride+3*src_x+1] = g;
-				rgb[src_y*rgb_stride+3*src_x+2] = swaprb ? r : b;
-				src_x++;
-				dst_x++;
-			}
-		}
-		break;
+	case 'M':
+		v *= 1024;
+		/* Fallthrough */
+	case 'K':
+		v *= 1024;
+		end++;
 	}
+	if (*end != '\0' || v <= 0)
+		return -1;
+	return v;
 }
 
 static int parse_format(const char *p, int *w, int *h)
@@ -632,21 +3594,91 @@ static int parse_format(const char *p, int *w, int *h)
 	return 0;
 }
 
+/* WxH+X+Y */
+static int parse_crop(const char *p, int size[2], int pos[2])
+{
+	char *end;
+
+	size[0] = strtoul(p, &end, 10);
+	if (*end != 'x')
+		return -1;
+	size[1] = strtoul(end + 1, &end, 10);
+	if (*end != '+')
+		return -1;
+	pos[0] = strtoul(end + 1, &end, 10);
+	if (*end != '+')
+		return -1;
+	pos[1] = strtoul(end + 1, &end, 10);
+	if (*end != '\0' || size[0] <= 0 || size[1] <= 0 || pos[0] < 0 || pos[1] < 0)
+		return -1;
+
+	return 0;
+}
+
+/* --plane <file>[,<offset>[,<stride>]] */
+static void plane_add(const char *arg)
+{
+	struct plane_source *ps;
+	char *p, *q;
+
+	if (plane_count >= 3) error("too many planes");
+	ps = &plane_src[plane_count++];
+	ps->file = strdup(arg);
+	if (!ps->file) error("memory allocation failed");
+	p = strchr(ps->file, ',');
+	if (!p)
+		return;
+	*p++ = 0;
+	q = strchr(p, ',');
+	if (q) {
+		*q++ = 0;
+		ps->stride = atoi(q);
+		if (ps->stride <= 0) error("bad plane stride");
+	}
+	ps->offset = strcmp(p, "0") ? parse_bytes(p) : 0;	/* parse_bytes() refuses 0 */
+	if (ps->offset < 0) error("bad plane offset");
+}
+
 int main(int argc, char *argv[])
 {
-	FILE *f;
 	int size[2] = {-1,-1};
-	unsigned char *src, *dst;
+	unsigned char *dst;
 	char *file_in = NULL, *file_out = NULL;
-	char multi_file_out[NAME_MAX];
 	int format = V4L2_PIX_FMT_UYVY;
 	const struct format_info *info;
-	int r;
 	char *algorithm_name = NULL;
-	int n = 0, multiple = 0;
+	int multiple = 0;
+	unsigned int frames;
+	int threads = sysconf(_SC_NPROCESSORS_ONLN);
+	struct pool *pool;
+	struct batch batch;
+	const char *file_list = NULL;
+	long long max_mem = 0;
+	enum stream_format stream = STREAM_NONE;
+	const struct format_info *out_info = NULL;
+	struct sink sink;
+	static const struct option long_options[] = {
+		{ "huge-pages", no_argument, NULL, 'H' },
+		{ "max-mem", required_argument, NULL, 'M' },
+		{ "16bit", no_argument, NULL, 'D' },
+		{ "stream", required_argument, NULL, 'S' },
+		{ "matrix", required_argument, NULL, 'X' },
+		{ "encode", required_argument, NULL, 'E' },
+		{ "plane", required_argument, NULL, 'P' },
+		{ "yuv", required_argument, NULL, 'Y' },
+		{ "bin", required_argument, NULL, 'B' },
+		{ "crop", required_argument, NULL, 'C' },
+		{ "scale", required_argument, NULL, 'Z' },
+		{ "thumbnail", required_argument, NULL, 'T' },
+		{ "stats", required_argument, NULL, 'A' },
+		{ "fps", required_argument, NULL, 'R' },
+		{ NULL, 0, NULL, 0 },
+	};
+
+	memset(&batch, 0, sizeof(batch));
 
 	for (;;) {
-		int c = getopt(argc, argv, "a:b:f:ghs:w");
+		int c = getopt_long(argc, argv, "a:b:d:f:ghj:l:ns:w", long_options, NULL);
 		if (c==-1) break;
 		switch (c) {
 		case 'a':
@@ -660,6 +3692,9 @@ int main(int argc, char *argv[])
 		case 'b':
 			brightness = (int)(atof(optarg) * 256.0 + 0.5);
 			break;
+		case 'd':
+			batch.outdir = optarg;
+			break;
 		case 'f':
 			if (optarg[0]=='?' && optarg[1]==0) {
 				unsigned int i,j;
@@ -671,14 +3706,9 @@ int main(int argc, char *argv[])
 				};
 				exit(0);
 			} else {
-				unsigned int i,j;
-				for (i=0; i<SIZE(v4l2_pix_fmt_str); i++) {
-					for (j=0; v4l2_pix_fmt_str[i].name[j]!=' ' && v4l2_pix_fmt_str[i].name[j]!=0; j++);
-					if (memcmp(v4l2_pix_fmt_str[i].name, optarg, j)==0 &&
-					    optarg[j]==0) break;
-				};
-				if (i >= SIZE(v4l2_pix_fmt_str)) error("bad format");
-				format = v4l2_pix_fmt_str[i].fmt;
+				info = find_format(optarg);
+				if (!info) error("bad format");
+				format = info->fmt;
 			}
 			break;
 		case 'g':
@@ -687,15 +3717,136 @@ int main(int argc, char *argv[])
 		case 'h':
 			printf("%s - Convert headerless raw image to RGB file (PNM)\n"
 			       "Usage: %s [-h] [-w] [-s XxY] <inputfile> <outputfile>\n"
+			       "       %s [options] -d <outdir> [-l <filelist>] [<inputfile|pattern>...]\n"
+			       "       %s [options] -s XxY --plane <file>... <outputfile>\n"
 			       "-a <algo>     Select algorithm, use \"-a ?\" for a list\n"
 			       "-b <bright>   Set brightness (multiplier) to output image (float, default 1.0)\n"
+			       "-d <outdir>   Batch mode: convert every input to <outdir>/<name>.pnm\n"
 			       "-f <format>   Specify input file format format (-f ? for list, default UYVY)\n"
 			       "-g            Use high bits for Bayer RAW 10 data\n"
-			       "-h            Show this help\n",
+			       "-h            Show this help\n"
+			       "-j <threads>  Number of conversion threads (default: number of CPUs)\n"
+			       "-l <file>     Batch mode: read input file names from file (- for stdin)\n"
 			       "-n            Assume multiple input frames, extract several PNM files\n"
 			       "-s <XxY>      Specify image size\n"
-			       "-w            Swap R and B channels\n", argv[0]);
+			       "-w            Swap R and B channels\n"
+			       "--bin <n>     Average n x n Bayer pixels (2 or 4) into one, without demosaic\n"
+			       "--crop <WxH+X+Y>\n"
+			       "              Read and convert only a W by H region at X, Y\n"
+			       "--scale <XxY> Downscale the output to X by Y with an area filter,\n"
+			       "              with --bin from the binned pixels\n"
+			       "--thumbnail <XxY>\n"
+			       "              Also write an X by Y thumbnail of every frame, named\n"
+			       "              after the output file with -thumb added\n"
+			       "--stats <file> Also write per channel min, max and mean of every frame\n"
+			       "              as converted, after --bin and before --scale\n"
+			       "--huge-pages  Back frame buffers with huge pages where possible\n"
+			       "--16bit       Write 16 bit samples for input of more than 8 bits\n"
+			       "--encode <f>  Write images as pnm (default), qoi, png or png-stored\n"
+			       "--matrix <m>  YUV to RGB matrix: bt601 (default), bt709 or bt2020\n"
+			       "--plane <file>[,<offset>[,<stride>]]\n"
+			       "              Read the next plane of planar YUV from a file, give one\n"
+			       "              for every plane and only the output file\n"
+			       "--max-mem <n> Convert a single frame in strips using at most n bytes\n"
+			       "              (K, M, G suffixes)\n"
+			       "--stream <s>  Write all frames to one stream, y4m or rgb (- for stdout),\n"
+			       "              or archive for an indexed file of all frames\n"
+			       "--fps <n>[:<d>] Frame rate written to Y4M streams (default 25)\n"
+			       "--yuv <f>     Repack YUV frames to raw frames of format f (- for stdout)\n",
+			       argv[0], argv[0], argv[0], argv[0]);
 			exit(0);
+		case 'j':
+			threads = atoi(optarg);
+			if (threads < 1)
+				error("bad number of threads");
+			break;
+		case 'l':
+			file_list = optarg;
+			break;
+		case 'B':
+			bin = atoi(optarg);
+			if (bin != 2 && bin != 4)
+				error("bad bin factor");
+			break;
+		case 'C':
+			if (parse_crop(optarg, crop_size, crop_pos) < 0)
+				error("bad crop");
+			break;
+		case 'Z':
+			if (parse_format(optarg, &scale_size[0], &scale_size[1]) < 0 ||
+			    scale_size[0] <= 0 || scale_size[1] <= 0)
+				error("bad scale");
+			break;
+		case 'T':
+			if (parse_format(optarg, &thumb_size[0], &thumb_size[1]) < 0 ||
+			    thumb_size[0] <= 0 || thumb_size[1] <= 0)
+				error("bad thumbnail size");
+			break;
+		case 'R':
+			frame_rate[1] = 1;
+			if (sscanf(optarg, "%i:%i", &frame_rate[0], &frame_rate[1]) < 1 ||
+			    frame_rate[0] <= 0 || frame_rate[1] <= 0)
+				error("bad frame rate");
+			break;
+		case 'A':
+			stats_file = fopen(optarg, "w");
+			if (!stats_file) error("can not open stats file `%s'", optarg);
+			break;
+		case 'D':
+			deep = 1;
+			break;
+		case 'H':
+			arena_set_huge_pages(1);
+			break;
+		case 'E':
+			if (strcmp(optarg, "pnm") == 0)
+				out_format = IMAGE_PNM;
+			else if (strcmp(optarg, "qoi") == 0)
+				out_format = IMAGE_QOI;
+			else if (strcmp(optarg, "png") == 0)
+				out_format = IMAGE_PNG;
+			else if (strcmp(optarg, "png-stored") == 0)
+				out_format = IMAGE_PNG_STORED;
+			else
+				error("bad image format");
+			break;
+		case 'P':
+			plane_add(optarg);
+			break;
+		case 'Y':
+			out_info = find_format(optarg);
+			if (!out_info) error("bad format");
+			if (stream != STREAM_NONE) error("--yuv and --stream can not be combined");
+			stream = STREAM_YUV;
+			multiple = 1;
+			break;
+		case 'X':
+			if (strcmp(optarg, "bt601") == 0)
+				matrix = &yuv_bt601;
+			else if (strcmp(optarg, "bt709") == 0)
+				matrix = &yuv_bt709;
+			else if (strcmp(optarg, "bt2020") == 0)
+				matrix = &yuv_bt2020;
+			else
+				error("bad matrix");
+			break;
+		case 'S':
+			if (stream == STREAM_YUV) error("--yuv and --stream can not be combined");
+			if (strcmp(optarg, "y4m") == 0)
+				stream = STREAM_Y4M;
+			else if (strcmp(optarg, "rgb") == 0)
+				stream = STREAM_RGB;
+			else if (strcmp(optarg, "archive") == 0)
+				stream = STREAM_ARCHIVE;
+			else
+				error("bad stream format");
+			multiple = 1;
+			break;
+		case 'M':
+			max_mem = parse_bytes(optarg);
+			if (max_mem < 0)
+				error("bad memory size");
+			break;
 		case 'n':
 			multiple = 1;
 			break;
@@ -714,9 +3865,6 @@ int main(int argc, char *argv[])
 	}
 
 	if (algorithm_name != NULL) qc_set_algorithm(algorithm_name);
-	if (argc-optind != 2) error("give input and output files");
-	file_in  = argv[optind++];
-	file_out = argv[optind++];
 
 	info = get_format_info(format);
 	if (info == NULL) {
@@ -724,25 +3872,98 @@ int main(int argc, char *argv[])
 		return 1;
 	}
 
+	if (bin > 1 && !is_bayer(info))
+		error("--bin only applies to Bayer formats");
+
+	if (deep && sample_depth(info) > 8) {
+		out_bpp = 6;
+		out_maxval = (1 << sample_depth(info)) - 1;
+	}
+
+	if (file_list && !batch.outdir) error("file list needs an output directory (-d)");
+	if (max_mem && (batch.outdir || multiple))
+		error("--max-mem only works with a single frame");
+	if (plane_count && (batch.outdir || max_mem))
+		error("planes can not be converted in batches or strips");
+	if (crop_size[0] && (plane_count || max_mem))
+		error("--crop can not be combined with planes or --max-mem");
+	if (scale_size[0] && plane_count)
+		error("--scale can not be combined with planes");
+	if ((thumb_size[0] || stats_file) && plane_count)
+		error("--thumbnail and --stats can not be combined with planes");
+	if (batch.outdir) {
+		if (multiple) error("batch mode does not support multiple frames");
+		if (file_list)
+			batch_add_list(&batch, file_list);
+		while (optind < argc)
+			batch_add_pattern(&batch, argv[optind++]);
+		if (batch.count == 0) error("no input files");
+		batch_check_names(&batch);
+	} else if (plane_count) {
+		if (argc-optind != 1) error("give the output file");
+		file_out = argv[optind++];
+	} else {
+		if (argc-optind != 2) error("give input and output files");
+		file_in  = argv[optind++];
+		file_out = argv[optind++];
+	}
+
+	if (thumb_size[0] && file_out && strcmp(file_out, "-") == 0)
+		error("thumbnails need an output file name");
+
+	/* Before the first message, which may have to move to stderr */
+	if (multiple)
+		sink_init(&sink, stream, info, out_info, size, file_out);
+
+	if (threads < 1)
+		threads = 1;
+	pool = pool_create(threads);
+	qc_set_pool(pool);
+	if (numa_nodes() > 1)
+		printf("Using %i threads on %u NUMA nodes\n", threads, numa_nodes());
+
 	/* Read, convert, and save image */
-	src = read_raw_data(file_in, multiple ? 0 : -1, size, info->bpp);
-	printf("Image size: %ix%i, bytes per pixel: %i, format: %s\n", size[0], size[1],
-		info->bpp, info->name);
-	dst = xalloc(size[0]*size[1]*3);
-	do {
-		raw_to_rgb(info, src, size, dst);
-		sprintf(multi_file_out, "%s-%03i.pnm", file_out, n);
-		printf("Writing to file `%s'...\n", multiple ? multi_file_out : file_out);
-		f = fopen(multiple ? multi_file_out : file_out, "wb");
-		if (!f) error("file open failed");
-		fprintf(f, "P6\n%i %i\n255\n", size[0], size[1]);
-		r = fwrite(dst, size[0]*size[1]*3, 1, f);
-		if (r!=1) error("write failed");
-		fclose(f);
-		if (!multiple) break;
-		src = read_raw_data(file_in, ++n, size, info->bpp);
-	} while (src != NULL);
-	free(src);
-	free(dst);
+	if (batch.outdir) {
+		batch.info = info;
+		batch.size[0] = size[0];
+		batch.size[1] = size[1];
+		printf("Converting %u files, format: %s\n", batch.count, info->name);
+		convert_batch(pool, &batch);
+	} else if (plane_count) {
+		frames = plane_frames(info, size);
+		printf("Image size: %ix%i, format: %s, %i planes, %u frames\n",
+			size[0], size[1], info->name, plane_count, frames);
+		if (multiple) {
+			convert_frames(pool, info, NULL, &sink, size, frames);
+			sink_close(&sink);
+		} else {
+			struct planes planes;
+			read_planes(info, 0, size, &planes);
+			dst = arena_alloc(size[0]*size[1]*out_bpp);
+			planes_to_rgb(info, &planes, size, dst);
+			write_image(file_out, dst, size);
+			free_planes(&planes);
+			arena_free(dst);
+		}
+	} else if (multiple) {
+		frames = count_frames(file_in, size, info->bpp);
+		printf("Image size: %ix%i, bytes per pixel: %i, format: %s, %u frames\n",
+			size[0], size[1], info->bpp, info->name, frames);
+		convert_frames(pool, info, file_in, &sink, size, frames);
+		sink_close(&sink);
+	} else {
+		convert_file(info, file_in, size, file_out, max_mem);
+		if (crop_size[0])
+			printf("Image size: %ix%i, bytes per pixel: %i, format: %s, crop: %ix%i+%i+%i\n",
+				size[0], size[1], info->bpp, info->name,
+				crop_size[0], crop_size[1], crop_pos[0], crop_pos[1]);
+		else
+			printf("Image size: %ix%i, bytes per pixel: %i, format: %s\n", size[0], size[1],
+				info->bpp, info->name);
+	}
+	if (stats_file && fclose(stats_file))
+		error("write failed");
+	pool_destroy(pool);
+	arena_trim();
 	return 0;
 }
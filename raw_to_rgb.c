@@ -26,9 +26,16 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+#include "pool.h"
 #include "raw_to_rgb.h"
 
-#define DEFAULT_BGR 0
+#if defined(__i386__) || defined(__x86_64__)
+#include <tmmintrin.h>
+#define QC_SSSE3
+#define QC_SSSE3_FUNC	__attribute__((target("ssse3")))
+#endif
+
 #define DETECT_BADVAL 1
 
 #define MAX(a,b)	((a)>(b)?(a):(b))
@@ -39,6 +46,7 @@
 #define SIZE(x)		(sizeof(x)/sizeof((x)[0]))
 
 static int qc_sharpness = 32768;
+static struct pool *qc_pool;
 
 /* Bayer-to-RGB conversion Copyright (C) Tuukka Toivonen 2003 */
 /* Licensed under GPL */
@@ -46,13 +54,14 @@ static int qc_sharpness = 32768;
 /* Write RGB pixel value to the given address.
  * addr = memory address, to which the pixel is written
  * bpp = number of bytes in the pixel (should be 3 or 4)
+ * bgr = write blue first instead of red
  * r, g, b = pixel component values to be written (red, green, blue)
  * Looks horribly slow but the compiler should be able to inline optimize it.
  */
-static inline void qc_imag_writergb(void *addr, int bpp,
+static inline void qc_imag_writergb(void *addr, int bpp, int bgr,
 	unsigned char r, unsigned char g, unsigned char b)
 {
-	if (DEFAULT_BGR) {
+	if (bgr) {
 		/* Blue is first (in the lowest memory address */
 		if (bpp==4) {
 #if defined(__LITTLE_ENDIAN)
@@ -107,774 +116,472 @@ static inline void qc_imag_writergb(void *addr, int bpp,
 	}
 }
 
-/* Assume r, g, and b are 10-bit quantities */
-static inline void qc_imag_writergb10(void *addr, int bpp,
+static inline void qc_imag_writergb8(void *addr, int bpp, int bgr, int depth,
+	unsigned char r, unsigned char g, unsigned char b)
+{
+	(void)depth;
+	qc_imag_writergb(addr, bpp, bgr, r, g, b);
+}
+
+/* Write a pixel of depth bit samples. With bpp 6 the pixel is written
+ * as three 16 bit samples in host byte order, keeping all bits. */
+static inline void qc_imag_writergb16(void *addr, int bpp, int bgr, int depth,
 	unsigned short r, unsigned short g, unsigned short b)
 {
-	qc_imag_writergb(addr, bpp, r>>2, g>>2, b>>2);
+	if (bpp == 6) {
+		unsigned short *addr2 = (unsigned short *)addr;
+		addr2[0] = bgr ? b : r;
+		addr2[1] = g;
+		addr2[2] = bgr ? r : b;
+		return;
+	}
+	qc_imag_writergb(addr, bpp, bgr, r >> (depth-8), g >> (depth-8), b >> (depth-8));
 }
 
-/* Following routines work with 8 bit RAW bayer data */
+/* Generalized Pei-Tam weights in 0.10 fixed point, derived from qc_sharpness */
+struct gptm_weights {
+	int wrg;		/* Weight for Red on Green */
+	int wbg;
+	int wgr;
+	int wbr;
+	int wgb;
+	int wrb;
+};
 
-/* Convert bayer image to RGB image using fast horizontal-only interpolation.
- * bay = points to the bayer image data (upper left pixel is green)
- * bay_line = bytes between the beginnings of two consecutive rows
- * rgb = points to the rgb image data that is written
- * rgb_line = bytes between the beginnings of two consecutive rows
- * columns, rows = bayer image size (both must be even)
- * bpp = number of bytes in each pixel in the RGB image (should be 3 or 4)
- */
-/* Execution time: 2735776-3095322 clock cycles for CIF image (Pentium II) */
-/* Not recommended: ip seems to be somewhat faster, probably with better image quality.
- * cott is quite much faster, but possibly with slightly worse image quality */
-static inline void qc_imag_bay2rgb_horip(unsigned char *bay, int bay_line,
-		unsigned char *rgb, int rgb_line,
-		int columns, int rows, int bpp)
+static void qc_gptm_weights(struct gptm_weights *wt)
 {
-	unsigned char *cur_bay, *cur_rgb;
-	int bay_line2, rgb_line2;
-	int total_columns;
-	unsigned char red, green, blue;
-	unsigned int column_cnt, row_cnt;
-
-	/* Process 2 lines and rows per each iteration */
-	total_columns = (columns-2) / 2;
-	row_cnt = rows / 2;
-	bay_line2 = 2*bay_line;
-	rgb_line2 = 2*rgb_line;
-
-	do {
-		qc_imag_writergb(rgb+0,        bpp, bay[1], bay[0], bay[bay_line]);
-		qc_imag_writergb(rgb+rgb_line, bpp, bay[1], bay[0], bay[bay_line]);
-		cur_bay = bay + 1;
-		cur_rgb = rgb + bpp;
-		column_cnt = total_columns;
-		do {
-			green = ((unsigned int)cur_bay[-1]+cur_bay[1]) / 2;
-			blue  = ((unsigned int)cur_bay[bay_line-1]+cur_bay[bay_line+1]) / 2;
-			qc_imag_writergb(cur_rgb+0, bpp, cur_bay[0], green, blue);
-			red   = ((unsigned int)cur_bay[0]+cur_bay[2]) / 2;
-			qc_imag_writergb(cur_rgb+bpp, bpp, red, cur_bay[1], cur_bay[bay_line+1]);
-			green = ((unsigned int)cur_bay[bay_line]+cur_bay[bay_line+2]) / 2;
-			qc_imag_writergb(cur_rgb+rgb_line, bpp, cur_bay[0], cur_bay[bay_line], blue);
-			qc_imag_writergb(cur_rgb+rgb_line+bpp, bpp, red, cur_bay[1], cur_bay[bay_line+1]);
-			cur_bay += 2;
-			cur_rgb += 2*bpp;
-		} while (--column_cnt);
-		qc_imag_writergb(cur_rgb+0,        bpp, cur_bay[0], cur_bay[-1],       cur_bay[bay_line-1]);
-		qc_imag_writergb(cur_rgb+rgb_line, bpp, cur_bay[0], cur_bay[bay_line], cur_bay[bay_line-1]);
-		bay += bay_line2;
-		rgb += rgb_line2;
-	} while (--row_cnt);
+	/* 0.8 fixed point weights, should be between 0-256. Larger value = sharper, zero corresponds to bilinear interpolation. */
+	/* Best PSNR with sharpness = 23170 */
+	static const int wrg0 = 144;		/* Weight for Red on Green */
+	static const int wbg0 = 160;
+	static const int wgr0 = 120;
+	static const int wbr0 = 192;
+	static const int wgb0 = 120;
+	static const int wrb0 = 168;
+	unsigned int wu;
+
+	wu = (qc_sharpness * qc_sharpness) >> 16;
+	wu = (wu * wu) >> 16;
+	wt->wrg = (wrg0 * wu) >> 10;
+	wt->wbg = (wbg0 * wu) >> 10;
+	wt->wgr = (wgr0 * wu) >> 10;
+	wt->wbr = (wbr0 * wu) >> 10;
+	wt->wgb = (wgb0 * wu) >> 10;
+	wt->wrb = (wrb0 * wu) >> 10;
 }
 
-/* Convert bayer image to RGB image using full (slow) linear interpolation.
- * bay = points to the bayer image data (upper left pixel is green)
- * bay_line = bytes between the beginnings of two consecutive rows
- * rgb = points to the rgb image data that is written
- * rgb_line = bytes between the beginnings of two consecutive rows
- * columns, rows = bayer image size (both must be even)
- * bpp = number of bytes in each pixel in the RGB image (should be 3 or 4)
- */
-/* Execution time: 2714077-2827455 clock cycles for CIF image (Pentium II) */
-static inline void qc_imag_bay2rgb_ip(unsigned char *bay, int bay_line,
-		unsigned char *rgb, int rgb_line,
-		int columns, int rows, int bpp)
+/* Interior of a gptm conversion, split into tiles for qc_gptm_tile() */
+struct gptm_tiling {
+	void *bay;		/* Upper left pixel of the first interior 2x2 block */
+	int bay_line;		/* Samples between two consecutive rows */
+	unsigned char *rgb;
+	int rgb_line;
+	int bpp;
+	int bgr;
+	int sample_size;	/* Bytes per bayer sample, 1 or 2 */
+	int depth;		/* Significant bits per bayer sample */
+	int blocks, pairs;	/* Interior size in 2x2 blocks */
+	int tile_blocks, tile_pairs;
+	int htiles, vtiles;
+	struct gptm_weights wt;
+};
+
+static void qc_imag_bay2rgb_gptm_tiled(struct gptm_tiling *t);
+
+/* The algorithms are written once in raw_to_rgb_template.h and compiled
+ * for each bayer sample size. */
+
+/* Output pixels binned at a time, see qc_imag_bay2rgb_bin8() */
+#define QC_BIN_LANES	256
+
+#ifdef QC_SSSE3
+/* Byte shuffle taking colour c of eight RGB pixels of size byte samples,
+ * one colour per register, to output register reg */
+QC_SSSE3_FUNC
+static __m128i qc_rgb_mask(int reg, int c, int size)
 {
-	unsigned char *cur_bay, *cur_rgb;
-	int bay_line2, rgb_line2;
-	int total_columns;
-	unsigned char red, green, blue;
-	unsigned int column_cnt, row_cnt;
-
-	/* Process 2 rows and columns each iteration */
-	total_columns = (columns-2) / 2;
-	row_cnt = (rows-2) / 2;
-	bay_line2 = 2*bay_line;
-	rgb_line2 = 2*rgb_line;
-
-	/* First scanline is handled here as a special case */
-	qc_imag_writergb(rgb, bpp, bay[1], bay[0], bay[bay_line]);
-	cur_bay = bay + 1;
-	cur_rgb = rgb + bpp;
-	column_cnt = total_columns;
-	do {
-		green  = ((unsigned int)cur_bay[-1] + cur_bay[1] + cur_bay[bay_line]) / 3;
-		blue   = ((unsigned int)cur_bay[bay_line-1] + cur_bay[bay_line+1]) / 2;
-		qc_imag_writergb(cur_rgb, bpp, cur_bay[0], green, blue);
-		red    = ((unsigned int)cur_bay[0] + cur_bay[2]) / 2;
-		qc_imag_writergb(cur_rgb+bpp, bpp, red, cur_bay[1], cur_bay[bay_line+1]);
-		cur_bay += 2;
-		cur_rgb += 2*bpp;
-	} while (--column_cnt);
-	green = ((unsigned int)cur_bay[-1] + cur_bay[bay_line]) / 2;
-	qc_imag_writergb(cur_rgb, bpp, cur_bay[0], green, cur_bay[bay_line-1]);
-
-	/* Process here all other scanlines except first and last */
-	bay += bay_line;
-	rgb += rgb_line;
-	do {
-		red = ((unsigned int)bay[-bay_line+1] + bay[bay_line+1]) / 2;
-		green = ((unsigned int)bay[-bay_line] + bay[1] + bay[bay_line]) / 3;
-		qc_imag_writergb(rgb+0, bpp, red, green, bay[0]);
-		blue = ((unsigned int)bay[0] + bay[bay_line2]) / 2;
-		qc_imag_writergb(rgb+rgb_line, bpp, bay[bay_line+1], bay[bay_line], blue);
-		cur_bay = bay + 1;
-		cur_rgb = rgb + bpp;
-		column_cnt = total_columns;
-		do {
-			red   = ((unsigned int)cur_bay[-bay_line]+cur_bay[bay_line]) / 2;
-			blue  = ((unsigned int)cur_bay[-1]+cur_bay[1]) / 2;
-			qc_imag_writergb(cur_rgb+0, bpp, red, cur_bay[0], blue);
-			red   = ((unsigned int)cur_bay[-bay_line]+cur_bay[-bay_line+2]+cur_bay[bay_line]+cur_bay[bay_line+2]) / 4;
-			green = ((unsigned int)cur_bay[0]+cur_bay[2]+cur_bay[-bay_line+1]+cur_bay[bay_line+1]) / 4;
-			qc_imag_writergb(cur_rgb+bpp, bpp, red, green, cur_bay[1]);
-			green = ((unsigned int)cur_bay[0]+cur_bay[bay_line2]+cur_bay[bay_line-1]+cur_bay[bay_line+1]) / 4;
-			blue  = ((unsigned int)cur_bay[-1]+cur_bay[1]+cur_bay[bay_line2-1]+cur_bay[bay_line2+1]) / 4;
-			qc_imag_writergb(cur_rgb+rgb_line, bpp, cur_bay[bay_line], green, blue);
-			red   = ((unsigned int)cur_bay[bay_line]+cur_bay[bay_line+2]) / 2;
-			blue  = ((unsigned int)cur_bay[1]+cur_bay[bay_line2+1]) / 2;
-			qc_imag_writergb(cur_rgb+rgb_line+bpp, bpp, red, cur_bay[bay_line+1], blue);
-			cur_bay += 2;
-			cur_rgb += 2*bpp;
-		} while (--column_cnt);
-		red = ((unsigned int)cur_bay[-bay_line] + cur_bay[bay_line]) / 2;
-		qc_imag_writergb(cur_rgb, bpp, red, cur_bay[0], cur_bay[-1]);
-		green = ((unsigned int)cur_bay[0] + cur_bay[bay_line-1] + cur_bay[bay_line2]) / 3;
-		blue = ((unsigned int)cur_bay[-1] + cur_bay[bay_line2-1]) / 2;
-		qc_imag_writergb(cur_rgb+rgb_line, bpp, cur_bay[bay_line], green, blue);
-		bay += bay_line2;
-		rgb += rgb_line2;
-	} while (--row_cnt);
-
-	/* Last scanline is handled here as a special case */
-	green = ((unsigned int)bay[-bay_line] + bay[1]) / 2;
-	qc_imag_writergb(rgb, bpp, bay[-bay_line+1], green, bay[0]);
-	cur_bay = bay + 1;
-	cur_rgb = rgb + bpp;
-	column_cnt = total_columns;
-	do {
-		blue   = ((unsigned int)cur_bay[-1] + cur_bay[1]) / 2;
-		qc_imag_writergb(cur_rgb, bpp, cur_bay[-bay_line], cur_bay[0], blue);
-		red    = ((unsigned int)cur_bay[-bay_line] + cur_bay[-bay_line+2]) / 2;
-		green  = ((unsigned int)cur_bay[0] + cur_bay[-bay_line+1] + cur_bay[2]) / 3;
-		qc_imag_writergb(cur_rgb+bpp, bpp, red, green, cur_bay[1]);
-		cur_bay += 2;
-		cur_rgb += 2*bpp;
-	} while (--column_cnt);
-	qc_imag_writergb(cur_rgb, bpp, cur_bay[-bay_line], cur_bay[0], cur_bay[-1]);
+	signed char m[16];
+	int j, at;
+
+	for (j = 0; j < 16; j++) {
+		at = reg * 16 + j;
+		m[j] = (at / size) % 3 == c ? at / (3 * size) * size + at % size : -1;
+	}
+
+	return _mm_loadu_si128((const __m128i *)m);
 }
 
-/* Convert bayer image to RGB image using 0.5 displaced light linear interpolation.
- * bay = points to the bayer image data (upper left pixel is green)
- * bay_line = bytes between the beginnings of two consecutive rows
- * rgb = points to the rgb image data that is written
- * rgb_line = bytes between the beginnings of two consecutive rows
- * columns, rows = bayer image size (both must be even)
- * bpp = number of bytes in each pixel in the RGB image (should be 3 or 4)
- */
-/* Execution time: 2167685 clock cycles for CIF image (Pentium II) */
-/* Original idea for this routine from Cagdas Ogut */
-static inline void qc_imag_bay2rgb_cott(unsigned char *bay, int bay_line,
-		unsigned char *rgb, int rgb_line,
-		int columns, int rows, int bpp)
+/* Sums of the even and of the odd columns under eight output pixels in
+ * one bayer row of size byte samples. Samples are widened to 16 bits and
+ * split into even and odd columns with a shuffle, with a factor of 4 the
+ * two columns of each colour under a pixel are added by phaddw. Samples
+ * above max leave bits set in *over. */
+QC_SSSE3_FUNC __attribute__((always_inline))
+static inline void qc_bin_columns_ssse3(const unsigned char *p, int size, int factor,
+		__m128i max, __m128i *over, __m128i *even, __m128i *odd)
 {
-	unsigned char *cur_bay, *cur_rgb;
-	int bay_line2, rgb_line2;
-	int total_columns;
-
-	/* Process 2 lines and rows per each iteration, but process the last row and column separately */
-	total_columns = (columns>>1) - 1;
-	rows = (rows>>1) - 1;
-	bay_line2 = 2*bay_line;
-	rgb_line2 = 2*rgb_line;
-	do {
-		cur_bay = bay;
-		cur_rgb = rgb;
-		columns = total_columns;
-		do {
-			qc_imag_writergb(cur_rgb+0,            bpp, cur_bay[1],           ((unsigned int)cur_bay[0] + cur_bay[bay_line+1])          /2, cur_bay[bay_line]);
-			qc_imag_writergb(cur_rgb+bpp,          bpp, cur_bay[1],           ((unsigned int)cur_bay[2] + cur_bay[bay_line+1])          /2, cur_bay[bay_line+2]);
-			qc_imag_writergb(cur_rgb+rgb_line,     bpp, cur_bay[bay_line2+1], ((unsigned int)cur_bay[bay_line2] + cur_bay[bay_line+1])  /2, cur_bay[bay_line]);
-			qc_imag_writergb(cur_rgb+rgb_line+bpp, bpp, cur_bay[bay_line2+1], ((unsigned int)cur_bay[bay_line2+2] + cur_bay[bay_line+1])/2, cur_bay[bay_line+2]);
-			cur_bay += 2;
-			cur_rgb += 2*bpp;
-		} while (--columns);
-		qc_imag_writergb(cur_rgb+0,            bpp, cur_bay[1], ((unsigned int)cur_bay[0] + cur_bay[bay_line+1])/2, cur_bay[bay_line]);
-		qc_imag_writergb(cur_rgb+bpp,          bpp, cur_bay[1], cur_bay[bay_line+1], cur_bay[bay_line]);
-		qc_imag_writergb(cur_rgb+rgb_line,     bpp, cur_bay[bay_line2+1], ((unsigned int)cur_bay[bay_line2] + cur_bay[bay_line+1])/2, cur_bay[bay_line]);
-		qc_imag_writergb(cur_rgb+rgb_line+bpp, bpp, cur_bay[bay_line2+1], cur_bay[bay_line+1], cur_bay[bay_line]);
-		bay += bay_line2;
-		rgb += rgb_line2;
-	} while (--rows);
-	/* Last scanline handled here as special case */
-	cur_bay = bay;
-	cur_rgb = rgb;
-	columns = total_columns;
-	do {
-		qc_imag_writergb(cur_rgb+0,            bpp, cur_bay[1], ((unsigned int)cur_bay[0] + cur_bay[bay_line+1])/2, cur_bay[bay_line]);
-		qc_imag_writergb(cur_rgb+bpp,          bpp, cur_bay[1], ((unsigned int)cur_bay[2] + cur_bay[bay_line+1])/2, cur_bay[bay_line+2]);
-		qc_imag_writergb(cur_rgb+rgb_line,     bpp, cur_bay[1], cur_bay[bay_line+1], cur_bay[bay_line]);
-		qc_imag_writergb(cur_rgb+rgb_line+bpp, bpp, cur_bay[1], cur_bay[bay_line+1], cur_bay[bay_line+2]);
-		cur_bay += 2;
-		cur_rgb += 2*bpp;
-	} while (--columns);
-	/* Last lower-right pixel is handled here as special case */
-	qc_imag_writergb(cur_rgb+0,            bpp, cur_bay[1], ((unsigned int)cur_bay[0] + cur_bay[bay_line+1])/2, cur_bay[bay_line]);
-	qc_imag_writergb(cur_rgb+bpp,          bpp, cur_bay[1], cur_bay[bay_line+1], cur_bay[bay_line]);
-	qc_imag_writergb(cur_rgb+rgb_line,     bpp, cur_bay[1], cur_bay[bay_line+1], cur_bay[bay_line]);
-	qc_imag_writergb(cur_rgb+rgb_line+bpp, bpp, cur_bay[1], cur_bay[bay_line+1], cur_bay[bay_line]);
+	const __m128i split = _mm_setr_epi8(0, 1, 4, 5, 8, 9, 12, 13, 2, 3, 6, 7, 10, 11, 14, 15);
+	__m128i w[4], e[2], o[2];
+	int i;
+
+	for (i = 0; i < factor; i += 2) {
+		if (size == 1) {
+			__m128i v = _mm_loadu_si128((const __m128i *)(p + 8 * i));
+			w[i] = _mm_unpacklo_epi8(v, _mm_setzero_si128());
+			w[i + 1] = _mm_unpackhi_epi8(v, _mm_setzero_si128());
+		} else {
+			w[i] = _mm_loadu_si128((const __m128i *)(p + 16 * i));
+			w[i + 1] = _mm_loadu_si128((const __m128i *)(p + 16 * i + 16));
+		}
+		*over = _mm_or_si128(*over, _mm_or_si128(_mm_subs_epu16(w[i], max),
+							 _mm_subs_epu16(w[i + 1], max)));
+		w[i] = _mm_shuffle_epi8(w[i], split);
+		w[i + 1] = _mm_shuffle_epi8(w[i + 1], split);
+		e[i / 2] = _mm_unpacklo_epi64(w[i], w[i + 1]);
+		o[i / 2] = _mm_unpackhi_epi64(w[i], w[i + 1]);
+	}
+	if (factor == 2) {
+		*even = e[0];
+		*odd = o[0];
+	} else {
+		*even = _mm_hadd_epi16(e[0], e[1]);
+		*odd = _mm_hadd_epi16(o[0], o[1]);
+	}
+}
+
+/* Bin eight output pixels of a row per iteration, see
+ * qc_imag_bay2rgb_bin8() for the arguments and bay_line in bytes. The
+ * sums are kept in 16 bits, so deep samples are left to the scalar code,
+ * as are 4 byte pixels. So are pixels from the first one with a sample
+ * out of its depth onwards, which the scalar code wraps in its own way.
+ * Returns the number of pixels binned. */
+QC_SSSE3_FUNC
+static int qc_bin_row_ssse3(const unsigned char *bay, int bay_line, int size,
+		unsigned char *rgb, int columns, int bpp, int bgr, int depth,
+		int factor, int rx, int ry)
+{
+	int shift = factor == 4 ? 2 : 0;
+	int out = bpp == 6 ? 2 : 1;
+	int down = size == 2 && bpp == 3 ? depth - 8 : 0;
+	const __m128i half = _mm_set1_epi16(1 << shift >> 1);
+	const __m128i one = _mm_set1_epi16(1 << shift);
+	const __m128i max = _mm_set1_epi16((1 << depth) - 1);
+	__m128i mask[3][3];
+	int x, i, j, c;
+
+	if (bpp == 4 || (bpp == 6 && size == 1) || (factor * factor / 2) * ((1 << depth) - 1) + (1 << shift) > 0xffff)
+		return 0;
+	for (i = 0; i < out + 1; i++)
+		for (c = 0; c < 3; c++)
+			mask[i][c] = qc_rgb_mask(i, c, out);
+
+	for (x = 0; x + 8 <= columns; x += 8) {
+		__m128i sr = _mm_setzero_si128(), sg = sr, sb = sr, over = sr;
+		__m128i col[2], ch[3], t;
+
+		for (j = 0; j < factor; j++) {
+			qc_bin_columns_ssse3(bay + (long)j * bay_line + (long)x * factor * size,
+					     size, factor, max, &over, &col[0], &col[1]);
+			if ((j & 1) == ry) {
+				sr = _mm_add_epi16(sr, col[rx]);
+				sg = _mm_add_epi16(sg, col[1 - rx]);
+			} else {
+				sg = _mm_add_epi16(sg, col[rx]);
+				sb = _mm_add_epi16(sb, col[1 - rx]);
+			}
+		}
+		if (_mm_movemask_epi8(_mm_cmpeq_epi16(over, _mm_setzero_si128())) != 0xffff)
+			break;
+		ch[bgr ? 2 : 0] = _mm_srli_epi16(_mm_add_epi16(sr, half), shift + down);
+		ch[1] = _mm_srli_epi16(_mm_add_epi16(sg, one), shift + 1 + down);
+		ch[bgr ? 0 : 2] = _mm_srli_epi16(_mm_add_epi16(sb, half), shift + down);
+		if (out == 1)
+			for (c = 0; c < 3; c++)
+				ch[c] = _mm_packus_epi16(ch[c], ch[c]);
+
+		for (i = 0; i < out + 1; i++) {
+			t = _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(ch[0], mask[i][0]),
+						      _mm_shuffle_epi8(ch[1], mask[i][1])),
+					 _mm_shuffle_epi8(ch[2], mask[i][2]));
+			if (out == 1 && i == 1)
+				_mm_storel_epi64((__m128i *)(rgb + 3 * x + 16), t);
+			else
+				_mm_storeu_si128((__m128i *)(rgb + 3 * out * x + 16 * i), t);
+		}
+	}
+
+	return x;
 }
+#endif
 
-/* Convert bayer image to RGB image using 0.5 displaced nearest neighbor.
- * bay = points to the bayer image data (upper left pixel is green)
- * bay_line = bytes between the beginnings of two consecutive rows
- * rgb = points to the rgb image data that is written
- * rgb_line = bytes between the beginnings of two consecutive rows
- * columns, rows = bayer image size (both must be even)
- * bpp = number of bytes in each pixel in the RGB image (should be 3 or 4)
+/* Following routines work with 8 bit RAW bayer data */
+#define QC_SAMPLE	unsigned char
+#define QC_FN(name)	name##8
+#define QC_SUM		int
+#include "raw_to_rgb_template.h"
+
+/* Following routines work with 9 to 16 bit RAW bayer data (16 bits per pixel) */
+#define QC_SAMPLE	unsigned short
+#define QC_FN(name)	name##16
+#define QC_SUM		long long	/* Sharp gptm weights overflow int at 16 bits */
+#include "raw_to_rgb_template.h"
+
+/* Tiled gptm interior
+ *
+ * gptm reads two pixels around every 2x2 block (three rows below its top
+ * row), so the image can not be cut into independent row bands. Instead
+ * the interior is cut into roughly square tiles small enough that a tile
+ * of bayer input and rgb output stays in the L2 cache. Every tile reads
+ * its two pixel halo straight from the shared input, which is never
+ * written, and writes its own part of the output directly.
  */
-/* Execution time: 2133302 clock cycles for CIF image (Pentium II), fastest */
-static inline void qc_imag_bay2rgb_cottnoip(unsigned char *bay, int bay_line,
-		unsigned char *rgb, int rgb_line,
-		int columns, int rows, int bpp)
+
+static long qc_cache_size(int name, long fallback)
 {
-	unsigned char *cur_bay, *cur_rgb;
-	int bay_line2, rgb_line2;
-	int total_columns;
-
-	/* Process 2 lines and rows per each iteration, but process the last row and column separately */
-	total_columns = (columns>>1) - 1;
-	rows = (rows>>1) - 1;
-	bay_line2 = 2*bay_line;
-	rgb_line2 = 2*rgb_line;
-	do {
-		cur_bay = bay;
-		cur_rgb = rgb;
-		columns = total_columns;
-		do {
-			qc_imag_writergb(cur_rgb+0,            bpp, cur_bay[1],           cur_bay[0], cur_bay[bay_line]);
-			qc_imag_writergb(cur_rgb+bpp,          bpp, cur_bay[1],           cur_bay[2], cur_bay[bay_line+2]);
-			qc_imag_writergb(cur_rgb+rgb_line,     bpp, cur_bay[bay_line2+1], cur_bay[bay_line+1], cur_bay[bay_line]);
-			qc_imag_writergb(cur_rgb+rgb_line+bpp, bpp, cur_bay[bay_line2+1], cur_bay[bay_line+1], cur_bay[bay_line+2]);
-			cur_bay += 2;
-			cur_rgb += 2*bpp;
-		} while (--columns);
-		qc_imag_writergb(cur_rgb+0,            bpp, cur_bay[1], cur_bay[0], cur_bay[bay_line]);
-		qc_imag_writergb(cur_rgb+bpp,          bpp, cur_bay[1], cur_bay[bay_line+1], cur_bay[bay_line]);
-		qc_imag_writergb(cur_rgb+rgb_line,     bpp, cur_bay[bay_line2+1], cur_bay[bay_line+1], cur_bay[bay_line]);
-		qc_imag_writergb(cur_rgb+rgb_line+bpp, bpp, cur_bay[bay_line2+1], cur_bay[bay_line+1], cur_bay[bay_line]);
-		bay += bay_line2;
-		rgb += rgb_line2;
-	} while (--rows);
-	/* Last scanline handled here as special case */
-	cur_bay = bay;
-	cur_rgb = rgb;
-	columns = total_columns;
-	do {
-		qc_imag_writergb(cur_rgb+0,            bpp, cur_bay[1], cur_bay[0], cur_bay[bay_line]);
-		qc_imag_writergb(cur_rgb+bpp,          bpp, cur_bay[1], cur_bay[2], cur_bay[bay_line+2]);
-		qc_imag_writergb(cur_rgb+rgb_line,     bpp, cur_bay[1], cur_bay[bay_line+1], cur_bay[bay_line]);
-		qc_imag_writergb(cur_rgb+rgb_line+bpp, bpp, cur_bay[1], cur_bay[bay_line+1], cur_bay[bay_line+2]);
-		cur_bay += 2;
-		cur_rgb += 2*bpp;
-	} while (--columns);
-	/* Last lower-right pixel is handled here as special case */
-	qc_imag_writergb(cur_rgb+0,            bpp, cur_bay[1], cur_bay[0], cur_bay[bay_line]);
-	qc_imag_writergb(cur_rgb+bpp,          bpp, cur_bay[1], cur_bay[bay_line+1], cur_bay[bay_line]);
-	qc_imag_writergb(cur_rgb+rgb_line,     bpp, cur_bay[1], cur_bay[bay_line+1], cur_bay[bay_line]);
-	qc_imag_writergb(cur_rgb+rgb_line+bpp, bpp, cur_bay[1], cur_bay[bay_line+1], cur_bay[bay_line]);
+	long size = sysconf(name);
+
+	return size > 0 ? size : fallback;
 }
 
-/* Convert Bayer image to RGB image using Generalized Pei-Tam method
- * Uses fixed weights */
-/* Execution time: 3795517 clock cycles */
-static inline void qc_imag_bay2rgb_gptm_fast(unsigned char *bay, int bay_line,
-		   unsigned char *rgb, int rgb_line,
-		   int columns, int rows, int bpp)
+static void qc_gptm_tile(void *arg, unsigned int index, unsigned int worker)
 {
-	int r,g,b,w;
-	unsigned char *cur_bay, *cur_rgb;
-	int bay_line2, bay_line3, rgb_line2;
-	int total_columns;
-
-	/* Process 2 lines and rows per each iteration, but process the first and last two columns and rows separately */
-	total_columns = (columns>>1) - 2;
-	rows = (rows>>1) - 2;
-	bay_line2 = 2*bay_line;
-	bay_line3 = 3*bay_line;
-	rgb_line2 = 2*rgb_line;
-
-	/* Process first two pixel rows here */
-	cur_bay = bay;
-	cur_rgb = rgb;
-	columns = total_columns + 2;
-	do {
-		qc_imag_writergb(cur_rgb+0,            bpp, cur_bay[1], cur_bay[0],          cur_bay[bay_line]);
-		qc_imag_writergb(cur_rgb+bpp,          bpp, cur_bay[1], cur_bay[0],          cur_bay[bay_line]);
-		qc_imag_writergb(cur_rgb+rgb_line,     bpp, cur_bay[1], cur_bay[bay_line+1], cur_bay[bay_line]);
-		qc_imag_writergb(cur_rgb+rgb_line+bpp, bpp, cur_bay[1], cur_bay[bay_line+1], cur_bay[bay_line]);
-		cur_bay += 2;
-		cur_rgb += 2*bpp;
-	} while (--columns);
-	bay += bay_line2;
-	rgb += rgb_line2;
-
-	do {
-		cur_bay = bay;
-		cur_rgb = rgb;
-		columns = total_columns;
-
-		/* Process first 2x2 pixel block in a row here */
-		qc_imag_writergb(cur_rgb+0,            bpp, cur_bay[1], cur_bay[0],          cur_bay[bay_line]);
-		qc_imag_writergb(cur_rgb+bpp,          bpp, cur_bay[1], cur_bay[0],          cur_bay[bay_line]);
-		qc_imag_writergb(cur_rgb+rgb_line,     bpp, cur_bay[1], cur_bay[bay_line+1], cur_bay[bay_line]);
-		qc_imag_writergb(cur_rgb+rgb_line+bpp, bpp, cur_bay[1], cur_bay[bay_line+1], cur_bay[bay_line]);
-		cur_bay += 2;
-		cur_rgb += 2*bpp;
-
-		do {
-			w = 4*cur_bay[0] - (cur_bay[-bay_line-1] + cur_bay[-bay_line+1] + cur_bay[bay_line-1] + cur_bay[bay_line+1]);
-			r = (2*(cur_bay[-1] + cur_bay[1]) + w) >> 2;
-			b = (2*(cur_bay[-bay_line] + cur_bay[bay_line]) + w) >> 2;
-			qc_imag_writergb(cur_rgb+0, bpp, CLIP(r,0,255), cur_bay[0], CLIP(b,0,255));
-
-			w = 4*cur_bay[1] - (cur_bay[-bay_line2+1] + cur_bay[-1] + cur_bay[3] + cur_bay[bay_line2+1]);
-			g = (2*(cur_bay[-bay_line+1] + cur_bay[0] + cur_bay[2] + cur_bay[bay_line+1]) + w) >> 3;
-			b = (2*(cur_bay[-bay_line] + cur_bay[-bay_line+2] + cur_bay[bay_line] + cur_bay[bay_line+2]) + w) >> 3;
-			qc_imag_writergb(cur_rgb+bpp, bpp, cur_bay[1], CLIP(g,0,255), CLIP(b,0,255));
-
-			w = 4*cur_bay[bay_line] - (cur_bay[-bay_line] + cur_bay[bay_line-2] + cur_bay[bay_line+2] + cur_bay[bay_line3]);
-			r = ((cur_bay[-1] + cur_bay[1] + cur_bay[bay_line2-1] + cur_bay[bay_line2+1]) + w) >> 2;
-			g = ((cur_bay[0] + cur_bay[bay_line-1] + cur_bay[bay_line+1] + cur_bay[bay_line2]) + w) >> 2;
-			qc_imag_writergb(cur_rgb+rgb_line, bpp, CLIP(r,0,255), CLIP(g,0,255), cur_bay[bay_line]);
-
-			w = 4*cur_bay[bay_line+1] - (cur_bay[0] + cur_bay[2] + cur_bay[bay_line2] + cur_bay[bay_line2+2]);
-			r = (2*(cur_bay[1] + cur_bay[bay_line2+1]) + w) >> 2;
-			b = (2*(cur_bay[bay_line] + cur_bay[bay_line+2]) + w) >> 2;
-			qc_imag_writergb(cur_rgb+rgb_line+bpp, bpp, CLIP(r,0,255), cur_bay[bay_line+1], CLIP(b,0,255));
-
-			cur_bay += 2;
-			cur_rgb += 2*bpp;
-		} while (--columns);
-
-		/* Process last 2x2 pixel block in a row here */
-		qc_imag_writergb(cur_rgb+0,            bpp, cur_bay[1], cur_bay[0],          cur_bay[bay_line]);
-		qc_imag_writergb(cur_rgb+bpp,          bpp, cur_bay[1], cur_bay[0],          cur_bay[bay_line]);
-		qc_imag_writergb(cur_rgb+rgb_line,     bpp, cur_bay[1], cur_bay[bay_line+1], cur_bay[bay_line]);
-		qc_imag_writergb(cur_rgb+rgb_line+bpp, bpp, cur_bay[1], cur_bay[bay_line+1], cur_bay[bay_line]);
-
-		bay += bay_line2;
-		rgb += rgb_line2;
-	} while (--rows);
-
-	/* Process last two pixel rows here */
-	cur_bay = bay;
-	cur_rgb = rgb;
-	columns = total_columns + 2;
-	do {
-		qc_imag_writergb(cur_rgb+0,            bpp, cur_bay[1], cur_bay[0],          cur_bay[bay_line]);
-		qc_imag_writergb(cur_rgb+bpp,          bpp, cur_bay[1], cur_bay[0],          cur_bay[bay_line]);
-		qc_imag_writergb(cur_rgb+rgb_line,     bpp, cur_bay[1], cur_bay[bay_line+1], cur_bay[bay_line]);
-		qc_imag_writergb(cur_rgb+rgb_line+bpp, bpp, cur_bay[1], cur_bay[bay_line+1], cur_bay[bay_line]);
-		cur_bay += 2;
-		cur_rgb += 2*bpp;
-	} while (--columns);
+	const struct gptm_tiling *t = arg;
+	int x = (index % t->htiles) * t->tile_blocks;
+	int y = (index / t->htiles) * t->tile_pairs;
+	int blocks = MIN(t->tile_blocks, t->blocks - x);
+	int pairs = MIN(t->tile_pairs, t->pairs - y);
+	unsigned char *rgb = t->rgb + 2*y*t->rgb_line + 2*x*t->bpp;
+
+	(void)worker;
+
+	if (t->sample_size == 1)
+		qc_imag_bay2rgb_gptm_rect8((unsigned char *)t->bay + 2*y*t->bay_line + 2*x,
+			t->bay_line, rgb, t->rgb_line, blocks, pairs, t->bpp, t->bgr, t->depth, &t->wt);
+	else
+		qc_imag_bay2rgb_gptm_rect16((unsigned short *)t->bay + 2*y*t->bay_line + 2*x,
+			t->bay_line, rgb, t->rgb_line, blocks, pairs, t->bpp, t->bgr, t->depth, &t->wt);
 }
 
-/* Convert Bayer image to RGB image using Generalized Pei-Tam method (See:
- * "Effective Color Interpolation in CCD Color Filter Arrays Using Signal Correlation"
- * IEEE Transactions on Circuits and Systems for Video Technology, vol. 13, no. 6, June 2003.
- * Note that this is much improved version of the algorithm described in the paper)
- * bay = points to the bayer image data (upper left pixel is green)
- * bay_line = bytes between the beginnings of two consecutive rows
- * rgb = points to the rgb image data that is written
- * rgb_line = bytes between the beginnings of two consecutive rows
- * columns, rows = bayer image size (both must be even)
- * bpp = number of bytes in each pixel in the RGB image (should be 3 or 4)
- * sharpness = how sharp the image should be, between 0..65535 inclusive.
- *             23170 gives in theory image that corresponds to the original
- *             best, but human eye likes slightly sharper picture... 32768 is a good bet.
- *             When sharpness = 0, this routine is same as bilinear interpolation.
- */
-/* Execution time: 4344042 clock cycles for CIF image (Pentium II) */
-static inline void qc_imag_bay2rgb_gptm(unsigned char *bay, int bay_line,
-		   unsigned char *rgb, int rgb_line,
-		   int columns, int rows, int bpp)
+static void qc_imag_bay2rgb_gptm_tiled(struct gptm_tiling *t)
 {
+	long budget = qc_cache_size(_SC_LEVEL2_CACHE_SIZE, 256 * 1024) / 2;
+	unsigned int workers = pool_workers(qc_pool);
+	int side;
+
+	if (t->blocks <= 0 || t->pairs <= 0)
+		return;
+
+	qc_gptm_weights(&t->wt);
+
+	/* Largest power of two tile side, in 2x2 blocks, that fits the budget */
+	for (side = 8; (long)(4*side) * (4*side) * (t->sample_size + t->bpp) <= budget; side *= 2);
+	t->tile_blocks = MIN(side, t->blocks);
+	t->tile_pairs = MIN(side, t->pairs);
+	t->htiles = (t->blocks + t->tile_blocks - 1) / t->tile_blocks;
+	t->vtiles = (t->pairs + t->tile_pairs - 1) / t->tile_pairs;
+
+	/* Give every worker a few tiles to balance */
+	while ((unsigned int)(t->htiles * t->vtiles) < 4 * workers && t->tile_pairs > 4) {
+		t->tile_pairs /= 2;
+		t->vtiles = (t->pairs + t->tile_pairs - 1) / t->tile_pairs;
+	}
 
-	/* 0.8 fixed point weights, should be between 0-256. Larger value = sharper, zero corresponds to bilinear interpolation. */
-	/* Best PSNR with sharpness = 23170 */
-	static const int wrg0 = 144;		/* Weight for Red on Green */
-	static const int wbg0 = 160;
-	static const int wgr0 = 120;
-	static const int wbr0 = 192;
-	static const int wgb0 = 120;
-	static const int wrb0 = 168;
+	pool_run(qc_pool, qc_gptm_tile, t, t->htiles * t->vtiles);
+}
 
-	int wrg;
-	int wbg;
-	int wgr;
-	int wbr;
-	int wgb;
-	int wrb;
+typedef void (*qc_algo8)(unsigned char *bay, int bay_line, unsigned char *rgb, int rgb_line,
+		int columns, int rows, int bpp, int bgr, int depth);
+typedef void (*qc_algo16)(unsigned short *bay, int bay_line, unsigned char *rgb, int rgb_line,
+		int columns, int rows, int bpp, int bgr, int depth);
 
-	unsigned int wu;
-	int r,g,b,w;
-	unsigned char *cur_bay, *cur_rgb;
-	int bay_line2, bay_line3, rgb_line2;
-	int total_columns;
+#define QC_ALGORITHM(name) { #name, qc_imag_bay2rgb_##name##8, qc_imag_bay2rgb_##name##16 }
 
-	/* Compute weights */
-	wu = (qc_sharpness * qc_sharpness) >> 16;
-	wu = (wu * wu) >> 16;
-	wrg = (wrg0 * wu) >> 10;
-	wbg = (wbg0 * wu) >> 10;
-	wgr = (wgr0 * wu) >> 10;
-	wbr = (wbr0 * wu) >> 10;
-	wgb = (wgb0 * wu) >> 10;
-	wrb = (wrb0 * wu) >> 10;
-
-	/* Process 2 lines and rows per each iteration, but process the first and last two columns and rows separately */
-	total_columns = (columns>>1) - 2;
-	rows = (rows>>1) - 2;
-	bay_line2 = 2*bay_line;
-	bay_line3 = 3*bay_line;
-	rgb_line2 = 2*rgb_line;
-
-	/* Process first two pixel rows here */
-	cur_bay = bay;
-	cur_rgb = rgb;
-	columns = total_columns + 2;
-	do {
-		qc_imag_writergb(cur_rgb+0,            bpp, cur_bay[1], cur_bay[0],          cur_bay[bay_line]);
-		qc_imag_writergb(cur_rgb+bpp,          bpp, cur_bay[1], cur_bay[0],          cur_bay[bay_line]);
-		qc_imag_writergb(cur_rgb+rgb_line,     bpp, cur_bay[1], cur_bay[bay_line+1], cur_bay[bay_line]);
-		qc_imag_writergb(cur_rgb+rgb_line+bpp, bpp, cur_bay[1], cur_bay[bay_line+1], cur_bay[bay_line]);
-		cur_bay += 2;
-		cur_rgb += 2*bpp;
-	} while (--columns);
-	bay += bay_line2;
-	rgb += rgb_line2;
-
-	do {
-		cur_bay = bay;
-		cur_rgb = rgb;
-		columns = total_columns;
-
-		/* Process first 2x2 pixel block in a row here */
-		qc_imag_writergb(cur_rgb+0,            bpp, cur_bay[1], cur_bay[0],          cur_bay[bay_line]);
-		qc_imag_writergb(cur_rgb+bpp,          bpp, cur_bay[1], cur_bay[0],          cur_bay[bay_line]);
-		qc_imag_writergb(cur_rgb+rgb_line,     bpp, cur_bay[1], cur_bay[bay_line+1], cur_bay[bay_line]);
-		qc_imag_writergb(cur_rgb+rgb_line+bpp, bpp, cur_bay[1], cur_bay[bay_line+1], cur_bay[bay_line]);
-		cur_bay += 2;
-		cur_rgb += 2*bpp;
-
-		do {
-			w = 4*cur_bay[0] - (cur_bay[-bay_line-1] + cur_bay[-bay_line+1] + cur_bay[bay_line-1] + cur_bay[bay_line+1]);
-			r = (512*(cur_bay[-1] + cur_bay[1]) + w*wrg) >> 10;
-			b = (512*(cur_bay[-bay_line] + cur_bay[bay_line]) + w*wbg) >> 10;
-			qc_imag_writergb(cur_rgb+0, bpp, CLIP(r,0,255), cur_bay[0], CLIP(b,0,255));
-
-			w = 4*cur_bay[1] - (cur_bay[-bay_line2+1] + cur_bay[-1] + cur_bay[3] + cur_bay[bay_line2+1]);
-			g = (256*(cur_bay[-bay_line+1] + cur_bay[0] + cur_bay[2] + cur_bay[bay_line+1]) + w*wgr) >> 10;
-			b = (256*(cur_bay[-bay_line] + cur_bay[-bay_line+2] + cur_bay[bay_line] + cur_bay[bay_line+2]) + w*wbr) >> 10;
-			qc_imag_writergb(cur_rgb+bpp, bpp, cur_bay[1], CLIP(g,0,255), CLIP(b,0,255));
-
-			w = 4*cur_bay[bay_line] - (cur_bay[-bay_line] + cur_bay[bay_line-2] + cur_bay[bay_line+2] + cur_bay[bay_line3]);
-			r = (256*(cur_bay[-1] + cur_bay[1] + cur_bay[bay_line2-1] + cur_bay[bay_line2+1]) + w*wrb) >> 10;
-			g = (256*(cur_bay[0] + cur_bay[bay_line-1] + cur_bay[bay_line+1] + cur_bay[bay_line2]) + w*wgb) >> 10;
-			qc_imag_writergb(cur_rgb+rgb_line, bpp, CLIP(r,0,255), CLIP(g,0,255), cur_bay[bay_line]);
-
-			w = 4*cur_bay[bay_line+1] - (cur_bay[0] + cur_bay[2] + cur_bay[bay_line2] + cur_bay[bay_line2+2]);
-			r = (512*(cur_bay[1] + cur_bay[bay_line2+1]) + w*wrg) >> 10;
-			b = (512*(cur_bay[bay_line] + cur_bay[bay_line+2]) + w*wbg) >> 10;
-			qc_imag_writergb(cur_rgb+rgb_line+bpp, bpp, CLIP(r,0,255), cur_bay[bay_line+1], CLIP(b,0,255));
-
-			cur_bay += 2;
-			cur_rgb += 2*bpp;
-		} while (--columns);
-
-		/* Process last 2x2 pixel block in a row here */
-		qc_imag_writergb(cur_rgb+0,            bpp, cur_bay[1], cur_bay[0],          cur_bay[bay_line]);
-		qc_imag_writergb(cur_rgb+bpp,          bpp, cur_bay[1], cur_bay[0],          cur_bay[bay_line]);
-		qc_imag_writergb(cur_rgb+rgb_line,     bpp, cur_bay[1], cur_bay[bay_line+1], cur_bay[bay_line]);
-		qc_imag_writergb(cur_rgb+rgb_line+bpp, bpp, cur_bay[1], cur_bay[bay_line+1], cur_bay[bay_line]);
-
-		bay += bay_line2;
-		rgb += rgb_line2;
-	} while (--rows);
-
-	/* Process last two pixel rows here */
-	cur_bay = bay;
-	cur_rgb = rgb;
-	columns = total_columns + 2;
-	do {
-		qc_imag_writergb(cur_rgb+0,            bpp, cur_bay[1], cur_bay[0],          cur_bay[bay_line]);
-		qc_imag_writergb(cur_rgb+bpp,          bpp, cur_bay[1], cur_bay[0],          cur_bay[bay_line]);
-		qc_imag_writergb(cur_rgb+rgb_line,     bpp, cur_bay[1], cur_bay[bay_line+1], cur_bay[bay_line]);
-		qc_imag_writergb(cur_rgb+rgb_line+bpp, bpp, cur_bay[1], cur_bay[bay_line+1], cur_bay[bay_line]);
-		cur_bay += 2;
-		cur_rgb += 2*bpp;
-	} while (--columns);
-}
+static struct {
+	char *name;
+	qc_algo8 algo8;
+	qc_algo16 algo16;
+} algorithms[] = {
+	QC_ALGORITHM(horip),
+	QC_ALGORITHM(ip),
+	QC_ALGORITHM(cott),
+	QC_ALGORITHM(cottnoip),
+	QC_ALGORITHM(gptm_fast),
+	QC_ALGORITHM(gptm),
+};
 
-/* Following routines work with 10 bit RAW bayer data (16 bits per pixel) */
+static qc_algo8 algo8 = qc_imag_bay2rgb_gptm8;
+static qc_algo16 algo16 = qc_imag_bay2rgb_cottnoip16;
 
-/* Convert bayer image to RGB image using 0.5 displaced nearest neighbor.
- * bay = points to the bayer image data (upper left pixel is green)
- * bay_line = short ints between the beginnings of two consecutive rows
- * rgb = points to the rgb image data that is written
- * rgb_line = bytes between the beginnings of two consecutive rows
- * columns, rows = bayer image size (both must be even)
- * bpp = number of bytes in each pixel in the RGB image (should be 3 or 4)
+/* Bayer phases
+ *
+ * The algorithms only know the GRBG phase, and need an even number of
+ * rows. GBRG is GRBG with red and blue swapped, which the algorithms do
+ * while writing out the pixels. BGGR and RGGB read from the last row up
+ * are GRBG and GBRG when the image has an even number of rows, so the
+ * phase only changes the strides and the first row used: no pass over
+ * the image is added.
+ *
+ * With an odd number of rows, all rows but the last (GRBG, GBRG) or the
+ * first (BGGR, RGGB) are converted top down. The remaining row is taken
+ * from a small bottom up conversion of the six rows at its end of the
+ * image, which has the same phase as the rest.
  */
-static inline void qc_imag_bay2rgb_cottnoip10(unsigned short *bay, int bay_line,
+
+#define QC_EDGE_ROWS	6
+
+/* bay_line in bytes, samples are 16 bit if depth is above 8 */
+static void qc_imag_bay2rgb_algo(int depth, unsigned char *bay, int bay_line,
 		unsigned char *rgb, int rgb_line,
-		int columns, int rows, int bpp)
+		int columns, int rows, int bpp, int bgr)
 {
-	unsigned short *cur_bay;
-	unsigned char *cur_rgb;
-	int bay_line2, rgb_line2;
-	int total_columns;
-
-	/* Process 2 lines and rows per each iteration, but process the last row and column separately */
-	total_columns = (columns>>1) - 1;
-	rows = (rows>>1) - 1;
-	bay_line2 = 2*bay_line;
-	rgb_line2 = 2*rgb_line;
-	do {
-		cur_bay = bay;
-		cur_rgb = rgb;
-		columns = total_columns;
-		do {
-			qc_imag_writergb10(cur_rgb+0,            bpp, cur_bay[1],           cur_bay[0], cur_bay[bay_line]);
-			qc_imag_writergb10(cur_rgb+bpp,          bpp, cur_bay[1],           cur_bay[2], cur_bay[bay_line+2]);
-			qc_imag_writergb10(cur_rgb+rgb_line,     bpp, cur_bay[bay_line2+1], cur_bay[bay_line+1], cur_bay[bay_line]);
-			qc_imag_writergb10(cur_rgb+rgb_line+bpp, bpp, cur_bay[bay_line2+1], cur_bay[bay_line+1], cur_bay[bay_line+2]);
-			cur_bay += 2;
-			cur_rgb += 2*bpp;
-		} while (--columns);
-		qc_imag_writergb10(cur_rgb+0,            bpp, cur_bay[1], cur_bay[0], cur_bay[bay_line]);
-		qc_imag_writergb10(cur_rgb+bpp,          bpp, cur_bay[1], cur_bay[bay_line+1], cur_bay[bay_line]);
-		qc_imag_writergb10(cur_rgb+rgb_line,     bpp, cur_bay[bay_line2+1], cur_bay[bay_line+1], cur_bay[bay_line]);
-		qc_imag_writergb10(cur_rgb+rgb_line+bpp, bpp, cur_bay[bay_line2+1], cur_bay[bay_line+1], cur_bay[bay_line]);
-		bay += bay_line2;
-		rgb += rgb_line2;
-	} while (--rows);
-	/* Last scanline handled here as special case */
-	cur_bay = bay;
-	cur_rgb = rgb;
-	columns = total_columns;
-	do {
-		qc_imag_writergb10(cur_rgb+0,            bpp, cur_bay[1], cur_bay[0], cur_bay[bay_line]);
-		qc_imag_writergb10(cur_rgb+bpp,          bpp, cur_bay[1], cur_bay[2], cur_bay[bay_line+2]);
-		qc_imag_writergb10(cur_rgb+rgb_line,     bpp, cur_bay[1], cur_bay[bay_line+1], cur_bay[bay_line]);
-		qc_imag_writergb10(cur_rgb+rgb_line+bpp, bpp, cur_bay[1], cur_bay[bay_line+1], cur_bay[bay_line+2]);
-		cur_bay += 2;
-		cur_rgb += 2*bpp;
-	} while (--columns);
-	/* Last lower-right pixel is handled here as special case */
-	qc_imag_writergb10(cur_rgb+0,            bpp, cur_bay[1], cur_bay[0], cur_bay[bay_line]);
-	qc_imag_writergb10(cur_rgb+bpp,          bpp, cur_bay[1], cur_bay[bay_line+1], cur_bay[bay_line]);
-	qc_imag_writergb10(cur_rgb+rgb_line,     bpp, cur_bay[1], cur_bay[bay_line+1], cur_bay[bay_line]);
-	qc_imag_writergb10(cur_rgb+rgb_line+bpp, bpp, cur_bay[1], cur_bay[bay_line+1], cur_bay[bay_line]);
+	if (depth > 8)
+		algo16((unsigned short *)bay, bay_line / 2, rgb, rgb_line, columns, rows, bpp, bgr, depth);
+	else
+		algo8(bay, bay_line, rgb, rgb_line, columns, rows, bpp, bgr, depth);
 }
 
-/* Convert Bayer image to RGB image using Generalized Pei-Tam method (See:
- * "Effective Color Interpolation in CCD Color Filter Arrays Using Signal Correlation"
- * IEEE Transactions on Circuits and Systems for Video Technology, vol. 13, no. 6, June 2003.
- * Note that this is much improved version of the algorithm described in the paper)
- * bay = points to the bayer image data (upper left pixel is green)
- * bay_line = short ints between the beginnings of two consecutive rows
- * rgb = points to the rgb image data that is written
- * rgb_line = bytes between the beginnings of two consecutive rows
- * columns, rows = bayer image size (both must be even)
- * bpp = number of bytes in each pixel in the RGB image (should be 3 or 4)
- * sharpness = how sharp the image should be, between 0..65535 inclusive.
- *             23170 gives in theory image that corresponds to the original
- *             best, but human eye likes slightly sharper picture... 32768 is a good bet.
- *             When sharpness = 0, this routine is same as bilinear interpolation.
- */
-/* Execution time: 4344042 clock cycles for CIF image (Pentium II) */
-static inline void qc_imag_bay2rgb_gptm10(unsigned short *bay, int bay_line,
-		   unsigned char *rgb, int rgb_line,
-		   int columns, int rows, int bpp)
+static void qc_imag_bay2rgb_phase(int depth, unsigned char *bay, int bay_line,
+		unsigned char *rgb, int rgb_line,
+		int columns, int rows, int bpp,
+		enum qc_bayer_phase phase, int bgr)
 {
+	int flip = phase == QC_BAYER_BGGR || phase == QC_BAYER_RGGB;
+	int edge, edge_top;
+
+	if (phase == QC_BAYER_GBRG || phase == QC_BAYER_RGGB)
+		bgr = !bgr;
+
+	if (!(rows & 1)) {
+		if (flip)
+			qc_imag_bay2rgb_algo(depth, bay + (rows-1)*bay_line, -bay_line,
+				rgb + (rows-1)*rgb_line, -rgb_line, columns, rows, bpp, bgr);
+		else
+			qc_imag_bay2rgb_algo(depth, bay, bay_line, rgb, rgb_line,
+				columns, rows, bpp, bgr);
+		return;
+	}
 
-	/* 0.8 fixed point weights, should be between 0-256. Larger value = sharper, zero corresponds to bilinear interpolation. */
-	/* Best PSNR with sharpness = 23170 */
-	static const int wrg0 = 144;		/* Weight for Red on Green */
-	static const int wbg0 = 160;
-	static const int wgr0 = 120;
-	static const int wbr0 = 192;
-	static const int wgb0 = 120;
-	static const int wrb0 = 168;
-
-	int wrg;
-	int wbg;
-	int wgr;
-	int wbr;
-	int wgb;
-	int wrb;
+	/* Odd number of rows: edge is the row left out of the main conversion.
+	 * Its end of the image is converted straight into the output first,
+	 * and the main conversion then replaces all rows but the edge row. */
+	edge = flip ? 0 : rows - 1;
+	if (rows > QC_EDGE_ROWS) {
+		edge_top = flip ? 0 : rows - QC_EDGE_ROWS;
+		qc_imag_bay2rgb_algo(depth, bay + (edge_top + QC_EDGE_ROWS - 1)*bay_line, -bay_line,
+			rgb + (edge_top + QC_EDGE_ROWS - 1)*rgb_line, -rgb_line,
+			columns, QC_EDGE_ROWS, bpp, bgr);
+	}
+	qc_imag_bay2rgb_algo(depth, bay + flip*bay_line, bay_line, rgb + flip*rgb_line, rgb_line,
+		columns, rows - 1, bpp, bgr);
+	if (rows <= QC_EDGE_ROWS) {
+		/* Too small to convert the edge rows on their own */
+		memcpy(rgb + edge*rgb_line, rgb + (flip ? 1 : rows - 2)*rgb_line, columns * bpp);
+	}
+}
 
-	unsigned int wu;
-	int r,g,b,w;
-	unsigned short *cur_bay;
-	unsigned char *cur_rgb;
-	int bay_line2, bay_line3, rgb_line2;
-	int total_columns;
+/* Binning
+ *
+ * Output rows only depend on their own factor rows of input, so the
+ * image is cut into bands of rows that are binned in parallel.
+ */
 
-	/* Compute weights */
-	wu = (qc_sharpness * qc_sharpness) >> 16;
-	wu = (wu * wu) >> 16;
-	wrg = (wrg0 * wu) >> 10;
-	wbg = (wbg0 * wu) >> 10;
-	wgr = (wgr0 * wu) >> 10;
-	wbr = (wbr0 * wu) >> 10;
-	wgb = (wgb0 * wu) >> 10;
-	wrb = (wrb0 * wu) >> 10;
-
-	/* Process 2 lines and rows per each iteration, but process the first and last two columns and rows separately */
-	total_columns = (columns>>1) - 2;
-	rows = (rows>>1) - 2;
-	bay_line2 = 2*bay_line;
-	bay_line3 = 3*bay_line;
-	rgb_line2 = 2*rgb_line;
-
-	/* Process first two pixel rows here */
-	cur_bay = bay;
-	cur_rgb = rgb;
-	columns = total_columns + 2;
-	do {
-		qc_imag_writergb10(cur_rgb+0,            bpp, cur_bay[1], cur_bay[0],          cur_bay[bay_line]);
-		qc_imag_writergb10(cur_rgb+bpp,          bpp, cur_bay[1], cur_bay[0],          cur_bay[bay_line]);
-		qc_imag_writergb10(cur_rgb+rgb_line,     bpp, cur_bay[1], cur_bay[bay_line+1], cur_bay[bay_line]);
-		qc_imag_writergb10(cur_rgb+rgb_line+bpp, bpp, cur_bay[1], cur_bay[bay_line+1], cur_bay[bay_line]);
-		cur_bay += 2;
-		cur_rgb += 2*bpp;
-	} while (--columns);
-	bay += bay_line2;
-	rgb += rgb_line2;
-
-	do {
-		cur_bay = bay;
-		cur_rgb = rgb;
-		columns = total_columns;
-
-		/* Process first 2x2 pixel block in a row here */
-		qc_imag_writergb10(cur_rgb+0,            bpp, cur_bay[1], cur_bay[0],          cur_bay[bay_line]);
-		qc_imag_writergb10(cur_rgb+bpp,          bpp, cur_bay[1], cur_bay[0],          cur_bay[bay_line]);
-		qc_imag_writergb10(cur_rgb+rgb_line,     bpp, cur_bay[1], cur_bay[bay_line+1], cur_bay[bay_line]);
-		qc_imag_writergb10(cur_rgb+rgb_line+bpp, bpp, cur_bay[1], cur_bay[bay_line+1], cur_bay[bay_line]);
-		cur_bay += 2;
-		cur_rgb += 2*bpp;
-
-		do {
-			w = 4*cur_bay[0] - (cur_bay[-bay_line-1] + cur_bay[-bay_line+1] + cur_bay[bay_line-1] + cur_bay[bay_line+1]);
-			r = (512*(cur_bay[-1] + cur_bay[1]) + w*wrg) >> 10;
-			b = (512*(cur_bay[-bay_line] + cur_bay[bay_line]) + w*wbg) >> 10;
-			qc_imag_writergb10(cur_rgb+0, bpp, CLIP(r,0,255), cur_bay[0], CLIP(b,0,255));
-
-			w = 4*cur_bay[1] - (cur_bay[-bay_line2+1] + cur_bay[-1] + cur_bay[3] + cur_bay[bay_line2+1]);
-			g = (256*(cur_bay[-bay_line+1] + cur_bay[0] + cur_bay[2] + cur_bay[bay_line+1]) + w*wgr) >> 10;
-			b = (256*(cur_bay[-bay_line] + cur_bay[-bay_line+2] + cur_bay[bay_line] + cur_bay[bay_line+2]) + w*wbr) >> 10;
-			qc_imag_writergb10(cur_rgb+bpp, bpp, cur_bay[1], CLIP(g,0,255), CLIP(b,0,255));
-
-			w = 4*cur_bay[bay_line] - (cur_bay[-bay_line] + cur_bay[bay_line-2] + cur_bay[bay_line+2] + cur_bay[bay_line3]);
-			r = (256*(cur_bay[-1] + cur_bay[1] + cur_bay[bay_line2-1] + cur_bay[bay_line2+1]) + w*wrb) >> 10;
-			g = (256*(cur_bay[0] + cur_bay[bay_line-1] + cur_bay[bay_line+1] + cur_bay[bay_line2]) + w*wgb) >> 10;
-			qc_imag_writergb10(cur_rgb+rgb_line, bpp, CLIP(r,0,255), CLIP(g,0,255), cur_bay[bay_line]);
-
-			w = 4*cur_bay[bay_line+1] - (cur_bay[0] + cur_bay[2] + cur_bay[bay_line2] + cur_bay[bay_line2+2]);
-			r = (512*(cur_bay[1] + cur_bay[bay_line2+1]) + w*wrg) >> 10;
-			b = (512*(cur_bay[bay_line] + cur_bay[bay_line+2]) + w*wbg) >> 10;
-			qc_imag_writergb10(cur_rgb+rgb_line+bpp, bpp, CLIP(r,0,255), cur_bay[bay_line+1], CLIP(b,0,255));
-
-			cur_bay += 2;
-			cur_rgb += 2*bpp;
-		} while (--columns);
-
-		/* Process last 2x2 pixel block in a row here */
-		qc_imag_writergb10(cur_rgb+0,            bpp, cur_bay[1], cur_bay[0],          cur_bay[bay_line]);
-		qc_imag_writergb10(cur_rgb+bpp,          bpp, cur_bay[1], cur_bay[0],          cur_bay[bay_line]);
-		qc_imag_writergb10(cur_rgb+rgb_line,     bpp, cur_bay[1], cur_bay[bay_line+1], cur_bay[bay_line]);
-		qc_imag_writergb10(cur_rgb+rgb_line+bpp, bpp, cur_bay[1], cur_bay[bay_line+1], cur_bay[bay_line]);
-
-		bay += bay_line2;
-		rgb += rgb_line2;
-	} while (--rows);
-
-	/* Process last two pixel rows here */
-	cur_bay = bay;
-	cur_rgb = rgb;
-	columns = total_columns + 2;
-	do {
-		qc_imag_writergb10(cur_rgb+0,            bpp, cur_bay[1], cur_bay[0],          cur_bay[bay_line]);
-		qc_imag_writergb10(cur_rgb+bpp,          bpp, cur_bay[1], cur_bay[0],          cur_bay[bay_line]);
-		qc_imag_writergb10(cur_rgb+rgb_line,     bpp, cur_bay[1], cur_bay[bay_line+1], cur_bay[bay_line]);
-		qc_imag_writergb10(cur_rgb+rgb_line+bpp, bpp, cur_bay[1], cur_bay[bay_line+1], cur_bay[bay_line]);
-		cur_bay += 2;
-		cur_rgb += 2*bpp;
-	} while (--columns);
-}
+#define QC_BIN_BAND_ROWS	32
 
-static struct {
-	char *name;
-	void (*algo8)(unsigned char *bay, int bay_line, unsigned char *rgb, int rgb_line, int columns, int rows, int bpp);
-	void (*algo10)(unsigned short *bay, int bay_line, unsigned char *rgb, int rgb_line, int columns, int rows, int bpp);
-} algorithms[] = {
-	{ "horip",     qc_imag_bay2rgb_horip, NULL },
-	{ "ip",        qc_imag_bay2rgb_ip, NULL },
-	{ "cott",      qc_imag_bay2rgb_cott, NULL },
-	{ "cottnoip",  qc_imag_bay2rgb_cottnoip, qc_imag_bay2rgb_cottnoip10 },
-	{ "gptm_fast", qc_imag_bay2rgb_gptm_fast, NULL },
-	{ "gptm",      qc_imag_bay2rgb_gptm, qc_imag_bay2rgb_gptm10 },
+struct bin_bands {
+	unsigned char *bay;
+	int bay_line;		/* In bytes */
+	unsigned char *rgb;
+	int rgb_line;
+	int columns, rows;	/* Output size */
+	int bpp, bgr, depth;
+	int factor, rx, ry;
 };
 
-static void (*algo8)(unsigned char *bay, int bay_line, unsigned char *rgb, int rgb_line, int columns, int rows, int bpp)
-	= qc_imag_bay2rgb_gptm;
-static void (*algo10)(unsigned short *bay, int bay_line, unsigned char *rgb, int rgb_line, int columns, int rows, int bpp)
-	= qc_imag_bay2rgb_cottnoip10;
+static void qc_bin_band(void *arg, unsigned int index, unsigned int worker)
+{
+	const struct bin_bands *b = arg;
+	int y = index * QC_BIN_BAND_ROWS;
+	int rows = MIN(QC_BIN_BAND_ROWS, b->rows - y);
+	unsigned char *bay = b->bay + (long)y * b->factor * b->bay_line;
+	unsigned char *rgb = b->rgb + (long)y * b->rgb_line;
+
+	(void)worker;
+
+	if (b->depth > 8)
+		qc_imag_bay2rgb_bin16((unsigned short *)bay, b->bay_line / 2, rgb, b->rgb_line,
+			b->columns, rows, b->bpp, b->bgr, b->depth, b->factor, b->rx, b->ry);
+	else
+		qc_imag_bay2rgb_bin8(bay, b->bay_line, rgb, b->rgb_line,
+			b->columns, rows, b->bpp, b->bgr, b->depth, b->factor, b->rx, b->ry);
+}
 
 /* Public interface */
 
 void qc_imag_bay2rgb8(unsigned char *bay, int bay_line,
 		unsigned char *rgb, int rgb_line,
-		unsigned int columns, unsigned int rows, int bpp)
+		unsigned int columns, unsigned int rows, int bpp,
+		enum qc_bayer_phase phase, int bgr)
 {
-	if (algo8==NULL) {
-		printf("No such 8-bit algorithm\n");
-		exit(1);
-	}
-	algo8(bay, bay_line, rgb, rgb_line, columns, rows, bpp);
+	qc_imag_bay2rgb_phase(8, bay, bay_line, rgb, rgb_line, columns, rows, bpp, phase, bgr);
 }
 
 /* bay_line = image stride in the RAW data in bytes */
-void qc_imag_bay2rgb10(unsigned char *bay, int bay_line,
+void qc_imag_bay2rgb16(unsigned char *bay, int bay_line,
 		unsigned char *rgb, int rgb_line,
-		unsigned int columns, unsigned int rows, int bpp)
+		unsigned int columns, unsigned int rows, int bpp, int depth,
+		enum qc_bayer_phase phase, int bgr)
 {
 #if DETECT_BADVAL
 	int maxval = 0;
 	unsigned int x, y;
 #endif
-	if (algo10==NULL) {
-		printf("No such 10-bit algorithm\n");
+	if (depth <= 8 || depth > 16) {
+		printf("qc_imag_bay2rgb16: unsupported sample depth %i\n", depth);
 		exit(1);
 	}
 	if ((bay_line & 1)) {
-		printf("qc_imag_bay2rgb10: bayer stride must be even\n");
+		printf("qc_imag_bay2rgb16: bayer stride must be even\n");
 		exit(1);
 	}
-	bay_line >>= 1;
 #if DETECT_BADVAL
 	for (y=0; y<rows; y++) for (x=0; x<columns; x++) {
-		maxval = MAX(maxval, ((unsigned short *)bay)[bay_line*y+x]);
+		maxval = MAX(maxval, ((unsigned short *)(bay + (long)bay_line*y))[x]);
 	}
-	if (maxval >= (1<<10)) printf("Warning: qc_imag_bay2rgb10: detected illegal pixel value)\n");
+	if (maxval >= (1<<depth)) printf("Warning: qc_imag_bay2rgb16: detected illegal pixel value)\n");
 #endif
-	algo10((unsigned short *)bay, bay_line, rgb, rgb_line, columns, rows, bpp);
+	qc_imag_bay2rgb_phase(depth, bay, bay_line, rgb, rgb_line, columns, rows, bpp, phase, bgr);
+}
+
+/* bay_line = image stride in the RAW data in bytes */
+void qc_imag_bay2rgb_bin(unsigned char *bay, int bay_line,
+		unsigned char *rgb, int rgb_line,
+		unsigned int columns, unsigned int rows, int bpp, int depth, int factor,
+		enum qc_bayer_phase phase, int bgr)
+{
+	struct bin_bands b;
+
+	if (factor != 2 && factor != 4) {
+		printf("qc_imag_bay2rgb_bin: unsupported bin factor %i\n", factor);
+		exit(1);
+	}
+	if (depth < 8 || depth > 16 || (depth > 8 && (bay_line & 1))) {
+		printf("qc_imag_bay2rgb_bin: unsupported sample depth %i or stride\n", depth);
+		exit(1);
+	}
+
+	b.bay = bay;
+	b.bay_line = bay_line;
+	b.rgb = rgb;
+	b.rgb_line = rgb_line;
+	b.columns = columns / factor;
+	b.rows = rows / factor;
+	b.bpp = bpp;
+	b.bgr = bgr;
+	b.depth = depth;
+	b.factor = factor;
+	b.rx = phase == QC_BAYER_GRBG || phase == QC_BAYER_BGGR;
+	b.ry = phase == QC_BAYER_GBRG || phase == QC_BAYER_BGGR;
+	pool_run(qc_pool, qc_bin_band, &b, (b.rows + QC_BIN_BAND_ROWS - 1) / QC_BIN_BAND_ROWS);
 }
 
 void qc_set_sharpness(int sharpness)
@@ -882,14 +589,21 @@ void qc_set_sharpness(int sharpness)
 	qc_sharpness = sharpness;
 }
 
+void qc_set_pool(struct pool *pool)
+{
+	qc_pool = pool;
+}
+
+struct pool *qc_get_pool(void)
+{
+	return qc_pool;
+}
+
 void qc_print_algorithms(void)
 {
 	unsigned int i;
 	for (i=0; i<SIZE(algorithms); i++) {
-		printf("\t%s (", algorithms[i].name);
-		if (algorithms[i].algo8) printf("8-bit");
-		if (algorithms[i].algo10) printf(",10-bit");
-		printf(")\n");
+		printf("\t%s\n", algorithms[i].name);
 	}
 }
 
@@ -903,5 +617,5 @@ void qc_set_algorithm(const char *name)
 		exit(1);
 	}
 	algo8 = algorithms[i].algo8;
-	algo10 = algorithms[i].algo10;
+	algo16 = algorithms[i].algo16;
 }
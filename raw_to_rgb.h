@@ -23,17 +23,45 @@
  * 02110-1301 USA
  */
 
+struct pool;
 
+/* Colour filter array phase, named after the colours of the first two
+ * pixels of the first two rows */
+enum qc_bayer_phase {
+	QC_BAYER_GRBG,
+	QC_BAYER_GBRG,
+	QC_BAYER_BGGR,
+	QC_BAYER_RGGB,
+};
+
+/* Demosaic a bayer image. bgr writes blue first instead of red. bpp is
+ * 3 or 4, or 6 for 16 bit samples from qc_imag_bay2rgb16(). */
 void qc_imag_bay2rgb8(unsigned char *bay, int bay_line,
 		unsigned char *rgb, int rgb_line,
-		unsigned int columns, unsigned int rows, int bpp);
+		unsigned int columns, unsigned int rows, int bpp,
+		enum qc_bayer_phase phase, int bgr);
+
+/* Bayer samples are 16 bits wide, of which depth (9..16) are used. The
+ * rgb samples have the same depth with bpp 6, else the high 8 bits. */
+void qc_imag_bay2rgb16(unsigned char *bay, int bay_line,
+		unsigned char *rgb, int rgb_line,
+		unsigned int columns, unsigned int rows, int bpp, int depth,
+		enum qc_bayer_phase phase, int bgr);
 
-void qc_imag_bay2rgb10(unsigned char *bay, int bay_line,
+/* Bin factor (2 or 4) times factor pixels into one RGB pixel holding the
+ * mean of their red, green and blue samples, without interpolation. The
+ * rgb image is columns / factor by rows / factor pixels. Bayer samples
+ * are 8 bits wide if depth is 8, else as for qc_imag_bay2rgb16(). */
+void qc_imag_bay2rgb_bin(unsigned char *bay, int bay_line,
 		unsigned char *rgb, int rgb_line,
-		unsigned int columns, unsigned int rows, int bpp);
+		unsigned int columns, unsigned int rows, int bpp, int depth, int factor,
+		enum qc_bayer_phase phase, int bgr);
 
 void qc_set_sharpness(int sharpness);
 
+void qc_set_pool(struct pool *pool);
+struct pool *qc_get_pool(void);
+
 void qc_print_algorithms(void);
 
 void qc_set_algorithm(const char *name);
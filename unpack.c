@@ -0,0 +1,250 @@
+/*
+ * raw2rgbpnm --- convert raw bayer images to RGB PNM for easier viewing
+ *
+ * Copyright (C) 2008--2011 Nokia Corporation
+ *
+ * Contact: Sakari Ailus <sakari.ailus@maxwell.research.nokia.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ */
+
+/*
+ * Packed raw sample unpacking
+ *
+ * Each function unpacks one row, so that callers can feed the demosaic a
+ * few rows at a time from cache instead of writing out an unpacked frame.
+ * Where the CPU has SSSE3, groups of pixels are unpacked with byte
+ * shuffles; the scalar code handles the rest of the row and other CPUs.
+ *
+ * All MIPI packings store the high bits of every pixel in a byte of its
+ * own and gather the low bits of a group of pixels in the bytes after
+ * them. The vector code builds every 16 bit lane from its high byte and
+ * the one or two bytes holding its low bits, multiplies to move the low
+ * bits of that lane's pixel to the top of the word and shifts them down.
+ */
+
+#include <pthread.h>
+#include "unpack.h"
+
+#if defined(__i386__) || defined(__x86_64__)
+#include <tmmintrin.h>
+#define UNPACK_SSSE3
+#endif
+
+#ifdef UNPACK_SSSE3
+#define UNPACK_SSSE3_FUNC	__attribute__((target("ssse3")))
+
+struct unpack_ssse3 {
+	int bits;		/* Bits per pixel */
+	int group_bytes;	/* Bytes per eight pixels */
+	__m128i hi;		/* Shuffle for the high bits */
+	__m128i lo;		/* Shuffle for the bytes with the low bits */
+	__m128i mul;		/* Shift of the low bits to the top of the word */
+};
+
+/* Eight pixels per iteration. A 16 byte load covers a group of 10 to 14
+ * bytes, so stop while the load would still run past the row. */
+UNPACK_SSSE3_FUNC __attribute__((always_inline))
+static inline int unpack_ssse3(const struct unpack_ssse3 *u, const unsigned char *src,
+			       unsigned short *dst, int width)
+{
+	int row_bytes = width * u->bits / 8;
+	int low = u->bits - 8;
+	int x, o;
+
+	for (x = 0, o = 0; x + 8 <= width && o + 16 <= row_bytes; x += 8, o += u->group_bytes) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(src + o));
+		__m128i h = _mm_slli_epi16(_mm_shuffle_epi8(v, u->hi), low);
+		__m128i l = _mm_mullo_epi16(_mm_shuffle_epi8(v, u->lo), u->mul);
+		l = _mm_srli_epi16(l, 16 - low);
+		_mm_storeu_si128((__m128i *)(dst + x), _mm_or_si128(h, l));
+	}
+
+	return x;
+}
+
+UNPACK_SSSE3_FUNC
+static int unpack_raw10p_ssse3(const unsigned char *src, unsigned short *dst, int width)
+{
+	const struct unpack_ssse3 u = {
+		10, 10,
+		_mm_setr_epi8(0, -1, 1, -1, 2, -1, 3, -1, 5, -1, 6, -1, 7, -1, 8, -1),
+		_mm_setr_epi8(4, -1, 4, -1, 4, -1, 4, -1, 9, -1, 9, -1, 9, -1, 9, -1),
+		_mm_setr_epi16(1 << 14, 1 << 12, 1 << 10, 1 << 8, 1 << 14, 1 << 12, 1 << 10, 1 << 8),
+	};
+
+	return unpack_ssse3(&u, src, dst, width);
+}
+
+UNPACK_SSSE3_FUNC
+static int unpack_raw12p_ssse3(const unsigned char *src, unsigned short *dst, int width)
+{
+	const struct unpack_ssse3 u = {
+		12, 12,
+		_mm_setr_epi8(0, -1, 1, -1, 3, -1, 4, -1, 6, -1, 7, -1, 9, -1, 10, -1),
+		_mm_setr_epi8(2, -1, 2, -1, 5, -1, 5, -1, 8, -1, 8, -1, 11, -1, 11, -1),
+		_mm_setr_epi16(1 << 12, 1 << 8, 1 << 12, 1 << 8, 1 << 12, 1 << 8, 1 << 12, 1 << 8),
+	};
+
+	return unpack_ssse3(&u, src, dst, width);
+}
+
+UNPACK_SSSE3_FUNC
+static int unpack_raw14p_ssse3(const unsigned char *src, unsigned short *dst, int width)
+{
+	/* The low bits of the second and fourth pixel straddle two bytes */
+	const struct unpack_ssse3 u = {
+		14, 14,
+		_mm_setr_epi8(0, -1, 1, -1, 2, -1, 3, -1, 7, -1, 8, -1, 9, -1, 10, -1),
+		_mm_setr_epi8(4, 5, 4, 5, 5, 6, 5, 6, 11, 12, 11, 12, 12, 13, 12, 13),
+		_mm_setr_epi16(1 << 10, 1 << 4, 1 << 6, 1 << 0, 1 << 10, 1 << 4, 1 << 6, 1 << 0),
+	};
+
+	return unpack_ssse3(&u, src, dst, width);
+}
+
+UNPACK_SSSE3_FUNC
+static size_t pack_be16_ssse3(const unsigned short *src, unsigned char *dst, size_t n)
+{
+	const __m128i swap = _mm_setr_epi8(1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14);
+	size_t i;
+
+	for (i = 0; i + 8 <= n; i += 8) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(src + i));
+		_mm_storeu_si128((__m128i *)(dst + 2*i), _mm_shuffle_epi8(v, swap));
+	}
+
+	return i;
+}
+#endif
+
+void unpack_raw10p(const unsigned char *src, unsigned short *dst, int width)
+{
+	int x = 0;
+
+#ifdef UNPACK_SSSE3
+	if (__builtin_cpu_supports("ssse3"))
+		x = unpack_raw10p_ssse3(src, dst, width);
+#endif
+	for (; x < width; x++) {
+		const unsigned char *p = src + x / 4 * 5;
+		dst[x] = (p[x & 3] << 2) | ((p[4] >> ((x & 3) * 2)) & 3);
+	}
+}
+
+void unpack_raw12p(const unsigned char *src, unsigned short *dst, int width)
+{
+	int x = 0;
+
+#ifdef UNPACK_SSSE3
+	if (__builtin_cpu_supports("ssse3"))
+		x = unpack_raw12p_ssse3(src, dst, width);
+#endif
+	for (; x < width; x++) {
+		const unsigned char *p = src + x / 2 * 3;
+		dst[x] = (p[x & 1] << 4) | ((p[2] >> ((x & 1) * 4)) & 15);
+	}
+}
+
+void unpack_raw14p(const unsigned char *src, unsigned short *dst, int width)
+{
+	int x = 0;
+
+#ifdef UNPACK_SSSE3
+	if (__builtin_cpu_supports("ssse3"))
+		x = unpack_raw14p_ssse3(src, dst, width);
+#endif
+	for (; x < width; x++) {
+		const unsigned char *p = src + x / 4 * 7;
+		unsigned int low = p[4] | (p[5] << 8) | (p[6] << 16);
+		dst[x] = (p[x & 3] << 6) | ((low >> ((x & 3) * 6)) & 63);
+	}
+}
+
+/* 10-8-10 DPCM
+ *
+ * The first two pixels of a line are stored as their eight high bits.
+ * Every other pixel is predicted from the previous pixel of its colour,
+ * two pixels to the left, and the code byte holds either the difference
+ * to the prediction or, if that is too large, the seven high bits of the
+ * pixel:
+ *
+ *	00sxxxxx	DPCM1	+-x
+ *	010sxxxx	DPCM2	+-(2x + 32)
+ *	011sxxxx	DPCM3	+-(4x + 64 + 1)
+ *	1xxxxxxx	PCM	8x + 3 or 4, rounded away from the prediction
+ *
+ * Lines do not depend on each other, so any number of them can be decoded
+ * in parallel. The differences of all codes come from a table.
+ */
+static pthread_once_t dpcm_once = PTHREAD_ONCE_INIT;
+static short dpcm_delta[128];
+
+static void dpcm_init(void)
+{
+	int c, v;
+
+	for (c = 0; c < 128; c++) {
+		if ((c & 0x40) == 0) {
+			v = c & 0x1f;
+			dpcm_delta[c] = c & 0x20 ? -v : v;
+		} else if ((c & 0x20) == 0) {
+			v = (c & 0x0f) * 2 + 32;
+			dpcm_delta[c] = c & 0x10 ? -v : v;
+		} else {
+			v = (c & 0x0f) * 4 + 64 + 1;
+			dpcm_delta[c] = c & 0x10 ? -v : v;
+		}
+	}
+}
+
+void unpack_dpcm10_8(const unsigned char *src, unsigned short *dst, int width)
+{
+	int x, v, pred;
+
+	pthread_once(&dpcm_once, dpcm_init);
+
+	for (x = 0; x < width && x < 2; x++)
+		dst[x] = (src[x] << 2) + 2;
+	for (; x < width; x++) {
+		pred = dst[x - 2];
+		if (src[x] & 0x80) {
+			v = (src[x] & 0x7f) << 3;
+			v += v > pred ? 3 : 4;
+		} else {
+			v = pred + dpcm_delta[src[x]];
+			if (v < 0)
+				v = 0;
+			if (v > 1023)
+				v = 1023;
+		}
+		dst[x] = v;
+	}
+}
+
+void pack_be16(const unsigned short *src, unsigned char *dst, size_t n)
+{
+	size_t i = 0;
+
+#ifdef UNPACK_SSSE3
+	if (__builtin_cpu_supports("ssse3"))
+		i = pack_be16_ssse3(src, dst, n);
+#endif
+	for (; i < n; i++) {
+		unsigned short v = src[i];
+		dst[2*i] = v >> 8;
+		dst[2*i + 1] = v;
+	}
+}
@@ -0,0 +1,49 @@
+/*
+ * raw2rgbpnm --- convert raw bayer images to RGB PNM for easier viewing
+ *
+ * Copyright (C) 2008--2011 Nokia Corporation
+ *
+ * Contact: Sakari Ailus <sakari.ailus@maxwell.research.nokia.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ */
+
+#ifndef __UNPACK_H__
+#define __UNPACK_H__
+
+#include <stddef.h>
+
+/* Unpack one row of width pixels of MIPI CSI-2 packed RAW10 to 16 bit
+ * samples. Four pixels take five bytes: the high eight bits of each, then
+ * a byte with the low two bits of all four, first pixel in the LSBs. */
+void unpack_raw10p(const unsigned char *src, unsigned short *dst, int width);
+
+/* RAW12: two pixels in three bytes, the high bits of both followed by a
+ * byte with the low four bits of the first pixel in its low nibble. */
+void unpack_raw12p(const unsigned char *src, unsigned short *dst, int width);
+
+/* RAW14: four pixels in seven bytes, the high bits of all four followed
+ * by three bytes holding the low six bits of each, first pixel first. */
+void unpack_raw14p(const unsigned char *src, unsigned short *dst, int width);
+
+/* Decode one row of 10-8-10 DPCM compressed samples (MIPI CSI-2 simple
+ * predictor 1) to 10 bit samples */
+void unpack_dpcm10_8(const unsigned char *src, unsigned short *dst, int width);
+
+/* Store n 16 bit samples big endian, as 16 bit PNM wants them. dst may
+ * be the same buffer as src. */
+void pack_be16(const unsigned short *src, unsigned char *dst, size_t n);
+
+#endif /* __UNPACK_H__ */
@@ -109,4 +109,38 @@ static inline void yuv_to_rgb(int y, int u, int v, int *r, int *g, int *b)
 #endif
 }
 
+/* Limited range YCbCr to RGB coefficients, RGBSHIFT fixed point */
+struct yuv_matrix {
+	int y, rv, gu, gv, bu;
+};
+
+static const struct yuv_matrix yuv_bt601 = { 298, 409, 100, 208, 516 };
+static const struct yuv_matrix yuv_bt709 = { 298, 459, 55, 136, 541 };
+static const struct yuv_matrix yuv_bt2020 = { 298, 430, 48, 167, 548 };
+
+/* Convert samples of in_depth bits to RGB of out_depth bits. With 8 bits
+ * in and out and the BT.601 matrix, this is the same as yuv_to_rgb(). */
+static inline void yuv_to_rgb_matrix(const struct yuv_matrix *m, int in_depth, int out_depth,
+				     int y, int u, int v, int *r, int *g, int *b)
+{
+	int shift = RGBSHIFT + in_depth - out_depth;
+	int round = 1 << (shift - 1);
+	int max = (1 << out_depth) - 1;
+	int c = y - (16 << (in_depth - 8));
+	int d = u - (128 << (in_depth - 8));
+	int e = v - (128 << (in_depth - 8));
+
+	*r = CLAMP((m->y * c             + m->rv * e + round) >> shift, 0, max);
+	*g = CLAMP((m->y * c - m->gu * d - m->gv * e + round) >> shift, 0, max);
+	*b = CLAMP((m->y * c + m->bu * d             + round) >> shift, 0, max);
+}
+
+/* Inverse of yuv_to_rgb(): BT.601, Y in 16..235 */
+static inline void rgb_to_yuv(int r, int g, int b, int *y, int *u, int *v)
+{
+	*y = (( 66 * r + 129 * g +  25 * b + 128) >> RGBSHIFT) + 16;
+	*u = ((-38 * r -  74 * g + 112 * b + 128) >> RGBSHIFT) + 128;
+	*v = ((112 * r -  94 * g -  18 * b + 128) >> RGBSHIFT) + 128;
+}
+
 #endif